@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+"""Checks that JIT-compiled code behaves like the interpreter.
+
+Every benchmark in this directory and a set of edge cases are run twice, once
+with --no-jit and once with --jit-threshold=1 so that functions and loops are
+compiled as early as possible. Their output and exit status must match.
+
+    python3 bench/jit_check.py build/clox
+    python3 bench/jit_check.py build/clox --flags=--wordcode
+"""
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+
+# Scripts exercising what the JIT handles differently from the interpreter:
+# its own comparisons and arithmetic, its calls and the errors it raises.
+EDGE_CASES = {
+    "nan_compare": """
+fun compare(a, b) {
+  print a < b;
+  print a > b;
+  print a <= b;
+  print a >= b;
+  print a == b;
+  print a != b;
+  print !(a < b);
+  if (a < b) print "less"; else print "not less";
+}
+var nan = 0 / 0;
+for (var i = 0; i < 3; i = i + 1) {
+  compare(nan, 1);
+  compare(1, nan);
+  compare(nan, nan);
+}
+""",
+    "negative_zero": """
+fun negate(x) { return -x; }
+for (var i = 0; i < 3; i = i + 1) {
+  var zero = negate(0);
+  print zero;
+  print 1 / zero;
+  print zero == 0;
+  print zero < 0;
+  print 0 * -1;
+  print -0 + 0;
+}
+""",
+    "deep_recursion": """
+fun down(n) {
+  if (n == 0) return 0;
+  return down(n - 1) + 1;
+}
+print down(200);
+print down(100000);
+""",
+    "error_in_call": """
+fun add(a, b) { return a + b; }
+for (var i = 0; i < 100; i = i + 1) add(i, 1);
+print add(1, 2);
+print add("one", 2);
+""",
+    "error_in_loop": """
+fun count(limit) {
+  var total = 0;
+  for (var i = 0; i < 1000; i = i + 1) {
+    if (i == limit) total = total + nil;
+    total = total + i;
+  }
+  return total;
+}
+print count(-1);
+print count(500);
+""",
+    "undefined_global": """
+fun read() { return missing; }
+fun guarded(n) {
+  if (n > 10) return read();
+  return n;
+}
+for (var i = 0; i < 20; i = i + 1) print guarded(i);
+""",
+}
+
+
+def run(clox, flags, path):
+    proc = subprocess.run([clox, *flags, path], stdin=subprocess.DEVNULL,
+                          capture_output=True, timeout=60)
+    return proc.returncode, proc.stdout.decode(errors="replace")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("clox", help="clox binary to check")
+    parser.add_argument("--flags", default="",
+                        help="extra clox flags, e.g. --flags=--wordcode")
+    args = parser.parse_intermixed_args()
+
+    scripts = {os.path.splitext(f)[0]: os.path.join(BENCH_DIR, f)
+               for f in sorted(os.listdir(BENCH_DIR)) if f.endswith(".lox")}
+    tmp = tempfile.TemporaryDirectory()
+    for name, source in EDGE_CASES.items():
+        path = os.path.join(tmp.name, name + ".lox")
+        with open(path, "w") as out:
+            out.write(source.lstrip())
+        scripts[name] = path
+
+    flags = args.flags.split()
+    failed = 0
+    for name, path in scripts.items():
+        interpreted = run(args.clox, [*flags, "--no-jit"], path)
+        compiled = run(args.clox, [*flags, "--jit-threshold=1"], path)
+        if interpreted == compiled:
+            print(f"{name:<18} ok")
+            continue
+
+        failed += 1
+        print(f"{name:<18} FAILED")
+        for label, (status, stdout) in (("--no-jit", interpreted),
+                                        ("--jit-threshold=1", compiled)):
+            print(f"  {label}: exit status {status}, output:")
+            print("".join(f"    {line}\n" for line in stdout.splitlines()),
+                  end="")
+
+    if failed:
+        sys.exit(f"{failed} of {len(scripts)} scripts differ with the JIT")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,343 @@
+/*
+ * Microbenchmarks for the runtime's subsystems, driven directly from C.
+ *
+ * Each benchmark runs an operation n times, with n doubled until a run takes
+ * long enough to time reliably, and reports the time, allocations and bytes
+ * allocated per operation. Built and run with `make microbench`; pass names
+ * to run only some of them:
+ *
+ *   make microbench MICRO_ARGS="tableGet copyString/new"
+ */
+
+#include "chunk.h"
+#include "compiler.h"
+#include "memory.h"
+#include "number.h"
+#include "object.h"
+#include "scanner.h"
+#include "scriptcache.h"
+#include "table.h"
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Distinct strings used as table keys.
+#define KEY_COUNT 1024
+
+// A run must take this long for its timing to be reported.
+#define MIN_RUN_NANOS 200000000L
+
+static ObjString *keys[KEY_COUNT];
+static Table table;
+static char *source;
+static int sourceTokens;
+
+static void makeKeys(VM *vm) {
+  for (int i = 0; i < KEY_COUNT; i++) {
+    char name[16];
+    int length = snprintf(name, sizeof(name), "key%d", i);
+    keys[i]    = copyString(vm, name, length);
+  }
+}
+
+static void fillTable(VM *vm) {
+  makeKeys(vm);
+  initTable(&table, &vm->memStats);
+  for (int i = 0; i < KEY_COUNT; i++)
+    tableSet(&table, keys[i], NUM_VAL(i));
+}
+
+static void freeTableSetup(VM *vm) {
+  (void)vm;
+  freeTable(&table);
+}
+
+// Statements exercising most of the grammar, repeated to make a source.
+static const char *snippet =
+    "fun f(a, b) {\n"
+    "  var total = 0;\n"
+    "  for (var i = 0; i < a; i = i + 1) {\n"
+    "    if (i > b and !(i == 3)) total = total + i * 2.5;\n"
+    "    else total = total - 1;\n"
+    "  }\n"
+    "  return total;\n"
+    "}\n"
+    "var s = \"some\" + \"string\";\n"
+    "print f(10, 2);\n";
+
+// Builds a source of the snippet defined as many distinct functions, within
+// the 256 constants a chunk can hold.
+static void makeSource(VM *vm) {
+  (void)vm;
+  int copies    = 20;
+  size_t length = strlen(snippet);
+  source        = malloc(length * copies + 1);
+  for (int i = 0; i < copies; i++)
+    memcpy(source + i * length, snippet, length);
+  source[length * copies] = '\0';
+
+  Scanner scanner;
+  initScanner(&scanner, source);
+  sourceTokens = 0;
+  while (scanToken(&scanner).type != TOK_EOF)
+    sourceTokens++;
+}
+
+static void freeSource(VM *vm) {
+  (void)vm;
+  free(source);
+}
+
+static void benchTableSet(VM *vm, long n) {
+  Table fresh;
+  initTable(&fresh, &vm->memStats);
+  for (long i = 0; i < n; i++)
+    tableSet(&fresh, keys[i % KEY_COUNT], NUM_VAL(i));
+  freeTable(&fresh);
+}
+
+static void benchTableGet(VM *vm, long n) {
+  (void)vm;
+  Value value;
+  for (long i = 0; i < n; i++)
+    tableGet(&table, keys[i % KEY_COUNT], &value);
+}
+
+static void benchTableFindString(VM *vm, long n) {
+  for (long i = 0; i < n; i++) {
+    ObjString *key = keys[i % KEY_COUNT];
+    tableFindString(&vm->strings, key->chars, key->length, key->hash);
+  }
+}
+
+// Copies strings that are already interned, which shouldn't allocate.
+static void benchCopyStringInterned(VM *vm, long n) {
+  for (long i = 0; i < n; i++) {
+    ObjString *key = keys[i % KEY_COUNT];
+    copyString(vm, key->chars, key->length);
+  }
+}
+
+// Copies strings never seen before, each allocating a new ObjString.
+static void benchCopyStringNew(VM *vm, long n) {
+  static unsigned long next = 0;
+  char name[24];
+  for (long i = 0; i < n; i++) {
+    int length = snprintf(name, sizeof(name), "new%lu", next++);
+    copyString(vm, name, length);
+  }
+}
+
+// Takes ownership of buffers holding interned strings, freeing them.
+static void benchTakeString(VM *vm, long n) {
+  for (long i = 0; i < n; i++) {
+    ObjString *key = keys[i % KEY_COUNT];
+    char *chars    = ALLOCATE(&vm->memStats, char, key->length + 1);
+    memcpy(chars, key->chars, key->length + 1);
+    takeString(vm, chars, key->length);
+  }
+}
+
+// One operation is one token.
+static void benchScanToken(VM *vm, long n) {
+  (void)vm;
+  Scanner scanner;
+  initScanner(&scanner, source);
+  for (long i = 0; i < n; i++) {
+    if (scanToken(&scanner).type == TOK_EOF)
+      initScanner(&scanner, source);
+  }
+}
+
+static void benchWriteChunk(VM *vm, long n) {
+  Chunk chunk;
+  initChunk(&chunk, &vm->memStats);
+  for (long i = 0; i < n; i++)
+    writeChunk(&chunk, (uint8_t)i, (int)(i / 8));
+  freeChunk(&chunk);
+}
+
+// One operation is compiling the whole source.
+static void benchCompile(VM *vm, long n) {
+  for (long i = 0; i < n; i++) {
+    if (compile(vm, source) == NULL) {
+      fprintf(stderr, "benchmark source failed to compile\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+// Operands assigning to the local read by the binary operator enclosing them,
+// which the register compiler used to compile in time exponential in depth.
+#define NESTED_DEPTH 24
+
+static void makeNested(VM *vm) {
+  (void)vm;
+  const char *head = "fun f() { var a = 1; var b = 2; return ";
+  const char *tail = "; }\n";
+  size_t length    = strlen(head) + NESTED_DEPTH * 12 + 1 + strlen(tail);
+  source           = malloc(length + 1);
+
+  char *end = stpcpy(source, head);
+  for (int i = 0; i < NESTED_DEPTH; i++)
+    end = stpcpy(end, "(a + (b = ");
+  end = stpcpy(end, "a");
+  for (int i = 0; i < NESTED_DEPTH; i++)
+    end = stpcpy(end, "))");
+  stpcpy(end, tail);
+}
+
+static void benchCompileNested(VM *vm, long n) {
+  for (long i = 0; i < n; i++) {
+    if (compileRegister(vm, source) == NULL) {
+      fprintf(stderr, "benchmark source failed to compile\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+// A short script run over and over, as by a service evaluating requests.
+static const char *script =
+    "var total = 0;\n"
+    "for (var i = 0; i < 4; i = i + 1) total = total + i * 1.5;\n";
+
+static void runScript(VM *vm, long n) {
+  for (long i = 0; i < n; i++)
+    interpret(vm, script);
+}
+
+// Compiles the script every time.
+static void benchInterpret(VM *vm, long n) {
+  freeScriptCache(vm->scriptCache);
+  vm->scriptCache = NULL;
+  runScript(vm, n);
+}
+
+// Compiles the script once, then finds it in the VM's script cache.
+static void benchInterpretCached(VM *vm, long n) { runScript(vm, n); }
+
+// Fractions needing the full shortest round-trip search.
+static void benchFormatNumber(VM *vm, long n) {
+  (void)vm;
+  char buffer[NUMBER_BUFFER_SIZE];
+  double x = 0.1;
+  for (long i = 0; i < n; i++) {
+    formatNumber(x, buffer);
+    x = x * 1.000001 + 0.37;
+  }
+}
+
+static void benchFormatInteger(VM *vm, long n) {
+  (void)vm;
+  char buffer[NUMBER_BUFFER_SIZE];
+  for (long i = 0; i < n; i++)
+    formatNumber((double)i, buffer);
+}
+
+// Literals like those in generated numeric tables.
+static const char *literals[] = {
+    "0", "42", "1234567", "3.14159", "0.001", "2718.281828", "65536", "0.5",
+};
+
+static void benchParseNumber(VM *vm, long n) {
+  (void)vm;
+  int count = sizeof(literals) / sizeof(literals[0]);
+  for (long i = 0; i < n; i++) {
+    const char *literal = literals[i % count];
+    parseNumber(literal, (int)strlen(literal));
+  }
+}
+
+typedef struct benchmark {
+  const char *name;
+  void (*setup)(VM *vm); // Run once before timing, may be NULL
+  void (*run)(VM *vm, long n);
+  void (*teardown)(VM *vm); // May be NULL
+} Benchmark;
+
+static Benchmark benchmarks[] = {
+    {"tableSet",            makeKeys,   benchTableSet,           NULL          },
+    {"tableGet",            fillTable,  benchTableGet,           freeTableSetup},
+    {"tableFindString",     makeKeys,   benchTableFindString,    NULL          },
+    {"copyString/interned", makeKeys,   benchCopyStringInterned, NULL          },
+    {"copyString/new",      NULL,       benchCopyStringNew,      NULL          },
+    {"takeString",          makeKeys,   benchTakeString,         NULL          },
+    {"scanToken",           makeSource, benchScanToken,          freeSource    },
+    {"writeChunk",          NULL,       benchWriteChunk,         NULL          },
+    {"compile",             makeSource, benchCompile,            freeSource    },
+    {"compile/nested",      makeNested, benchCompileNested,      freeSource    },
+    {"interpret",           NULL,       benchInterpret,          NULL          },
+    {"interpret/cached",    NULL,       benchInterpretCached,    NULL          },
+    {"formatNumber",        NULL,       benchFormatNumber,       NULL          },
+    {"formatNumber/int",    NULL,       benchFormatInteger,      NULL          },
+    {"parseNumber",         NULL,       benchParseNumber,        NULL          },
+};
+
+static long nanosSince(struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000000L +
+         (now.tv_nsec - start->tv_nsec);
+}
+
+static void runBenchmark(Benchmark *bench) {
+  VM vm;
+  initVM(&vm);
+  if (bench->setup != NULL)
+    bench->setup(&vm);
+
+  long n = 1, nanos = 0;
+  unsigned long allocations = 0;
+  size_t bytes              = 0;
+
+  while (true) {
+    unsigned long startAllocations = vm.memStats.allocations;
+    size_t startBytes              = vm.memStats.total;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    bench->run(&vm, n);
+
+    nanos       = nanosSince(&start);
+    allocations = vm.memStats.allocations - startAllocations;
+    bytes       = vm.memStats.total - startBytes;
+    if (nanos >= MIN_RUN_NANOS)
+      break;
+    n *= 2;
+  }
+
+  printf("%-20s %12ld %10.1f ns/op %8.2f allocs/op %10.1f B/op\n",
+         bench->name, n, (double)nanos / n, (double)allocations / n,
+         (double)bytes / n);
+
+  if (bench->teardown != NULL)
+    bench->teardown(&vm);
+  freeVM(&vm);
+}
+
+int main(int argc, char *argv[]) {
+  int count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+
+  for (int arg = 1; arg < argc; arg++) {
+    bool found = false;
+    for (int i = 0; i < count; i++)
+      found = found || strcmp(argv[arg], benchmarks[i].name) == 0;
+    if (!found) {
+      fprintf(stderr, "unknown benchmark '%s'\n", argv[arg]);
+      return 2;
+    }
+  }
+
+  for (int i = 0; i < count; i++) {
+    bool selected = argc == 1;
+    for (int arg = 1; arg < argc; arg++)
+      selected = selected || strcmp(argv[arg], benchmarks[i].name) == 0;
+    if (selected)
+      runBenchmark(&benchmarks[i]);
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,201 @@
+#!/usr/bin/env python3
+"""Runs the Lox benchmarks in this directory and reports their timings.
+
+Each benchmark is run a few times to warm up caches, then timed over several
+more runs. The median and standard deviation of the wall time and the peak
+resident set size are printed, and compared against a baseline if one has
+been saved with --save.
+
+    python3 bench/run.py build/clox
+    python3 bench/run.py build/clox --save     # Record bench/baseline.json
+    python3 bench/run.py build/clox --perf-counters
+"""
+
+import argparse
+import json
+import os
+import re
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+DEFAULT_BASELINE = os.path.join(BENCH_DIR, "baseline.json")
+
+# Changes within this fraction of the baseline are reported as noise.
+NOISE = 0.05
+
+
+def large_source():
+    """Source with many long functions, mostly timing compilation.
+
+    Chunks hold at most 256 constants, so the functions stay under that and
+    their statements reuse locals rather than literals.
+    """
+    lines = []
+    for i in range(100):
+        lines.append(f"fun f{i}(a, b) {{")
+        lines.append("  var x = a;")
+        lines.append("  var y = b;")
+        for _ in range(100):
+            lines.append("  x = x + a * y - b;")
+            lines.append("  if (x > y) { y = x - y; } else { x = y - x; }")
+        lines.append("  return x;")
+        lines.append("}")
+    lines.append("print f99(1, 2);")
+    return "\n".join(lines) + "\n"
+
+
+# Benchmarks generated instead of checked in, by name.
+GENERATED = {"large_source": large_source}
+
+
+def parse_counters(stderr):
+    """Parses the table printed by --perf-counters into {phase: {event: n}}."""
+    lines = stderr.split("== Perf counters ==\n", 1)
+    if len(lines) < 2:
+        return None
+    rows = lines[1].splitlines()
+    events = rows[0].split()[1:]
+    counters = {}
+    for row in rows[1:]:
+        fields = row.split()
+        if len(fields) != len(events) + 1 or fields[0] == "run/op":
+            break
+        counters[fields[0]] = {event: int(n) for event, n
+                               in zip(events, fields[1:]) if n != "-"}
+    return counters
+
+
+def run_once(clox, flags, path):
+    """Runs clox once, returning wall seconds, peak RSS in kilobytes and the
+    hardware counters if they were asked for.
+
+    The child's ru_maxrss includes the memory of this Python process it was
+    forked from, so the peak RSS clox reports with --mem-stats is preferred.
+    """
+    start = time.perf_counter()
+    proc = subprocess.Popen([clox, "--mem-stats", *flags, path],
+                            stdout=subprocess.DEVNULL,
+                            stderr=subprocess.PIPE)
+    stderr = proc.stderr.read().decode(errors="replace")
+    proc.stderr.close()
+    _, status, usage = os.wait4(proc.pid, 0)
+    elapsed = time.perf_counter() - start
+    proc.returncode = os.waitstatus_to_exitcode(status)
+    if proc.returncode != 0:
+        sys.exit(f"{path} failed with status {proc.returncode}:\n{stderr}")
+    if "--perf-counters" in flags and "== Perf counters ==" not in stderr:
+        sys.exit(f"hardware counters are unavailable:\n{stderr}")
+    rss = re.search(r"^peak RSS\s+(\d+) kB$", stderr, re.MULTILINE)
+    rss = int(rss.group(1)) if rss else usage.ru_maxrss
+    return elapsed, rss, parse_counters(stderr)
+
+
+def measure(clox, flags, path, warmup, runs):
+    for _ in range(warmup):
+        run_once(clox, flags, path)
+    times, rss, counts = [], 0, []
+    for _ in range(runs):
+        elapsed, peak, counters = run_once(clox, flags, path)
+        times.append(elapsed)
+        rss = max(rss, peak)
+        if counters:
+            counts.append(counters)
+    result = {
+        "median": statistics.median(times),
+        "stdev": statistics.stdev(times) if len(times) > 1 else 0.0,
+        "rss_kb": rss,
+    }
+    if counts:
+        result["counters"] = {
+            phase: {event: statistics.median(c[phase][event] for c in counts)
+                    for event in counts[0][phase]}
+            for phase in counts[0]}
+    return result
+
+
+def compare(result, base):
+    """Compares with the baseline by instructions retired when both runs
+    counted them, which is far less noisy than wall time."""
+    if base is None:
+        return ""
+    try:
+        new = result["counters"]["total"]["instructions"]
+        old = base["counters"]["total"]["instructions"]
+        metric = "instructions"
+    except KeyError:
+        new, old, metric = result["median"], base["median"], "time"
+    change = new / old - 1
+    if abs(change) < NOISE:
+        return "  ~"
+    return (f"  {change:+.1%} {metric}" +
+            ("  slower" if change > 0 else "  faster"))
+
+
+def print_counters(result):
+    for phase, counts in result.get("counters", {}).items():
+        print(f"  {phase:<12}" +
+              "".join(f" {event}={n:.0f}" for event, n in counts.items()))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("clox", help="clox binary to benchmark")
+    parser.add_argument("names", nargs="*", help="benchmarks to run (all)")
+    parser.add_argument("--runs", type=int, default=5)
+    parser.add_argument("--warmup", type=int, default=1)
+    parser.add_argument("--flags", default="",
+                        help="extra clox flags, e.g. --flags=--no-jit")
+    parser.add_argument("--perf-counters", action="store_true",
+                        help="also count hardware events, comparing "
+                             "instructions retired with the baseline")
+    parser.add_argument("--baseline", default=DEFAULT_BASELINE)
+    parser.add_argument("--save", action="store_true",
+                        help="write the results as the new baseline")
+    args = parser.parse_intermixed_args()
+
+    benches = {os.path.splitext(f)[0]: os.path.join(BENCH_DIR, f)
+               for f in sorted(os.listdir(BENCH_DIR)) if f.endswith(".lox")}
+    tmp = tempfile.TemporaryDirectory()
+    for name, generate in GENERATED.items():
+        path = os.path.join(tmp.name, name + ".lox")
+        with open(path, "w") as out:
+            out.write(generate())
+        benches[name] = path
+
+    names = args.names or sorted(benches)
+    for name in names:
+        if name not in benches:
+            sys.exit(f"unknown benchmark '{name}'")
+
+    baseline = {}
+    if os.path.exists(args.baseline):
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+
+    flags = args.flags.split()
+    if args.perf_counters:
+        flags.append("--perf-counters")
+    print(f"{'benchmark':<14} {'median':>9} {'stdev':>9} {'peak RSS':>10}")
+    results = {}
+    for name in names:
+        result = measure(args.clox, flags, benches[name], args.warmup,
+                         args.runs)
+        results[name] = result
+        print(f"{name:<14} {result['median'] * 1000:7.1f}ms "
+              f"{result['stdev'] * 1000:7.1f}ms {result['rss_kb']:8d}KB"
+              f"{compare(result, baseline.get(name))}", flush=True)
+        print_counters(result)
+
+    if args.save:
+        with open(args.baseline, "w") as f:
+            json.dump({**baseline, **results}, f, indent=2, sort_keys=True)
+            f.write("\n")
+        print(f"Saved baseline to {args.baseline}")
+
+
+if __name__ == "__main__":
+    main()
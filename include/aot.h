@@ -0,0 +1,106 @@
+#ifndef CLOX_AOT_H
+#define CLOX_AOT_H
+
+#include "object.h"
+#include "vm.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Ahead-of-time compilation of scripts to C.
+ *
+ * `clox --emit-c` translates every function of a compiled script into a C
+ * function working on the VM stack, and writes them out together with the
+ * functions' bytecode, line and constant tables. The generated file includes
+ * this header and links against the runtime library (`make runtime`):
+ *
+ *   clox --emit-c script.lox > script.c
+ *   gcc -O2 -Iinclude script.c build/libclox.a -o script
+ *
+ * At startup aotRun rebuilds the ObjFunction tree from the tables, so runtime
+ * errors and calls between functions behave exactly like in the interpreter.
+ */
+
+typedef enum aot_constant_type {
+  AOT_NIL,
+  AOT_BOOL,
+  AOT_NUM,
+  AOT_STRING,
+  AOT_FUNCTION
+} AotConstantType;
+
+typedef struct aot_constant {
+  AotConstantType type;
+  bool boolean;
+  double number;
+  const char *chars; // AOT_STRING
+  int length;        // AOT_STRING
+  int function;      // AOT_FUNCTION, index into the script's function table
+} AotConstant;
+
+typedef struct aot_function {
+  const char *name; // NULL for the top-level script
+  int arity;
+  int maxSlots;
+  const uint8_t *code;
+  int count;
+  const LineRun *lines;
+  int lineCount;
+  const AotConstant *constants;
+  int constantCount;
+  CompiledFn compiled;
+} AotFunction;
+
+// Writes C source for the script and all functions it defines.
+void emitC(ObjFunction *script, FILE *out);
+
+// Runs a script compiled to C, whose top-level function comes first in the
+// table. Returns the process exit status.
+int aotRun(const AotFunction *functions, int count);
+
+// Building blocks of the generated code.
+
+#define AOT_PROLOGUE()                                         \
+  Value *slots __attribute__((unused)) = frame->slots;         \
+  Value *K __attribute__((unused)) =                           \
+      frame->function->chunk.constants.values;                 \
+  uint8_t *code __attribute__((unused)) = frame->function->chunk.code
+
+#define AOT_PUSH(value) (*vm->stackTop++ = (value))
+#define AOT_PEEK(dist)  (vm->stackTop[-1 - (dist)])
+#define AOT_FALSY(value) \
+  (IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)))
+
+// Runs a helper that can fail, first saving `next`, the offset just past the
+// instruction, as the frame's ip for error reporting.
+#define AOT_CHECK(next, call)                \
+  do {                                       \
+    frame->ip = code + (next);               \
+    if (!(call))                             \
+      return INTERPRET_RUNTIME_ERR;          \
+  } while (false)
+
+#define AOT_NUMBER_OP(next, helper, valueType, op)                       \
+  do {                                                                   \
+    Value *top = vm->stackTop;                                           \
+    if (IS_NUM(top[-2]) && IS_NUM(top[-1])) {                            \
+      top[-2] = valueType(AS_NUM(top[-2]) op AS_NUM(top[-1]));           \
+      vm->stackTop--;                                                    \
+    } else {                                                             \
+      AOT_CHECK(next, helper(vm));                                       \
+    }                                                                    \
+  } while (false)
+
+#define AOT_NEGATE(next)                                                 \
+  do {                                                                   \
+    Value *top = vm->stackTop;                                           \
+    if (IS_NUM(top[-1])) {                                               \
+      top[-1] = NUM_VAL(-AS_NUM(top[-1]));                               \
+    } else {                                                             \
+      AOT_CHECK(next, vmNegate(vm));                                     \
+    }                                                                    \
+  } while (false)
+
+#endif
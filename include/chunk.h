@@ -1,12 +1,15 @@
 #ifndef CLOX_CHUNK_H
 #define CLOX_CHUNK_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "value.h"
 
 typedef enum {
   OP_CONSTANT,
+  OP_CONSTANT_LONG,
   OP_NIL,
   OP_TRUE,
   OP_FALSE,
@@ -14,8 +17,11 @@ typedef enum {
   OP_GET_LOCAL,
   OP_SET_LOCAL,
   OP_GET_GLOBAL,
+  OP_GET_GLOBAL_LONG,
   OP_DEFINE_GLOBAL,
+  OP_DEFINE_GLOBAL_LONG,
   OP_SET_GLOBAL,
+  OP_SET_GLOBAL_LONG,
   OP_EQ,
   OP_NOT_EQ,
   OP_GREATER,
@@ -33,21 +39,149 @@ typedef enum {
   OP_JUMP_IF_FALSE,
   OP_LOOP,
   OP_CALL,
-  OP_RETURN
+  OP_RETURN // Keep last, see OP_COUNT
 } OpCode;
 
+#define OP_COUNT (OP_RETURN + 1)
+
+/*
+ * Instructions taking a constant index have a _LONG form whose operand is a
+ * 3-byte big-endian index, emitted once a chunk holds more constants than a
+ * byte can index. Wordcode operands are wide enough to never need them.
+ */
+#define LONG_OPERAND_BYTES 3
+#define LONG_OPERAND_MAX   0xffffff
+
+/*
+ * Register-based instruction set, used when the VM runs in VM_REGISTER mode.
+ *
+ * Every instruction is four bytes: the opcode followed by the operands A, B
+ * and C. Registers are slots of the current call frame's window, so locals
+ * live in fixed registers and temporaries are allocated above them. Some
+ * instructions instead take a 16-bit operand Bx made of B (high) and C (low).
+ */
+typedef enum {
+  ROP_MOVE,          // R[A] = R[B]
+  ROP_LOADK,         // R[A] = K[Bx]
+  ROP_NIL,           // R[A] = nil
+  ROP_TRUE,          // R[A] = true
+  ROP_FALSE,         // R[A] = false
+  ROP_GET_GLOBAL,    // R[A] = Globals[K[Bx]]
+  ROP_DEFINE_GLOBAL, // Globals[K[Bx]] = R[A]
+  ROP_SET_GLOBAL,    // Globals[K[Bx]] = R[A], must already be defined
+  ROP_EQ,            // R[A] = R[B] == R[C]
+  ROP_NOT_EQ,        // R[A] = R[B] != R[C]
+  ROP_GREATER,       // R[A] = R[B] > R[C]
+  ROP_GREATER_EQ,    // R[A] = R[B] >= R[C]
+  ROP_LESS,          // R[A] = R[B] < R[C]
+  ROP_LESS_EQ,       // R[A] = R[B] <= R[C]
+  ROP_ADD,           // R[A] = R[B] + R[C]
+  ROP_SUBTRACT,      // R[A] = R[B] - R[C]
+  ROP_MULTIPLY,      // R[A] = R[B] * R[C]
+  ROP_DIVIDE,        // R[A] = R[B] / R[C]
+  ROP_NOT,           // R[A] = !R[B]
+  ROP_NEGATE,        // R[A] = -R[B]
+  ROP_PRINT,         // print R[A]
+  ROP_JUMP,          // ip += Bx
+  ROP_JUMP_IF_FALSE, // if R[A] is falsy, ip += Bx
+  ROP_JUMP_IF_TRUE,  // if R[A] is truthy, ip += Bx
+  ROP_LOOP,          // ip -= Bx
+  ROP_CALL,          // R[A] = R[A](R[A+1], ..., R[A+B])
+  ROP_RETURN,        // return R[A]
+  ROP_RETURN_NIL     // return nil
+} RegOpCode;
+
+#define REG_INSTRUCTION_BYTES 4
+
+/*
+ * Wordcode is an alternative fixed-width encoding of OpCode instructions, used
+ * when the VM runs in VM_WORDCODE mode. Each instruction is one aligned 32-bit
+ * word holding the opcode in its low byte and a 24-bit operand above it, so
+ * the VM decodes it with a single load. Jump operands count words.
+ */
+#define WORD_BYTES         4
+#define WORD_ARG_MAX       0xffffff
+#define WORD_OP(word)      ((word) & 0xff)
+#define WORD_ARG(word)     ((word) >> 8)
+#define MAKE_WORD(op, arg) ((uint32_t)(op) | (uint32_t)(arg) << 8)
+
+// A run of bytecode compiled from the same source line, from `offset` up to
+// the start of the next run.
+typedef struct line_run {
+  int offset;
+  int line;
+} LineRun;
+
 typedef struct chunk {
   int count;
   int capacity;
   uint8_t *code;
-  int *lines; // Line number of corresponding byte in the bytecode.
+  int lineCount;
+  int lineCapacity;
+  LineRun *lines; // Source lines of the bytecode, run-length encoded
   ValueArray constants;
+  bool packed;     // Arrays live in a ChunkArena, see packChunks
+  MemStats *stats; // Where the arrays' memory is counted
 } Chunk;
 
-void initChunk(Chunk *chunk);
+/*
+ * A block of memory holding the arrays of every chunk compiled together.
+ * Arenas are chained together and freed all at once by their owner.
+ */
+typedef struct chunk_arena {
+  struct chunk_arena *next;
+  size_t size; // Bytes allocated, including this header
+} ChunkArena;
+
+void initChunk(Chunk *chunk, MemStats *stats);
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
+void writeWord(Chunk *chunk, uint32_t word, int line);
 void freeChunk(Chunk *chunk);
 
+// Inserts code before the bytecode at `offset`, moving the code after it.
+void insertChunk(Chunk *chunk, int offset, const uint8_t *code, int count);
+
+// The source line of the bytecode byte at `offset`.
+int getLine(const Chunk *chunk, int offset);
+
+/*
+ * Moves the code, constants and lines of finished chunks into one new arena,
+ * trimmed to size and laid out chunk after chunk, and frees their growable
+ * arrays. A packed chunk can no longer be written to.
+ */
+void packChunks(MemStats *stats, ChunkArena **arenas, Chunk **chunks,
+                int count);
+void freeChunkArenas(MemStats *stats, ChunkArena **arenas);
+
 int addConstant(Chunk *chunk, Value value);
 
+// The constant index operand of a bytecode instruction, short or _LONG form.
+int constantOperand(const uint8_t *ip);
+
+// The size in bytes of a bytecode instruction taking a constant index.
+int constantInstructionBytes(uint8_t instruction);
+
+// Index of a compiled function's constants by value, so that numbers and
+// strings used repeatedly are stored once. Functions are never shared.
+typedef struct constant_slot {
+  Value value;
+  int index; // -1 for an empty slot
+} ConstantSlot;
+
+typedef struct constant_map {
+  int count;
+  int capacity;
+  ConstantSlot *slots;
+  MemStats *stats;
+} ConstantMap;
+
+void initConstantMap(ConstantMap *map, MemStats *stats);
+void freeConstantMap(ConstantMap *map);
+
+// Returns the index of a constant in the map equal to the value, or -1.
+int findConstant(ConstantMap *map, Value value);
+
+// Records that the value is stored at the index of the chunk's constants.
+void mapConstant(ConstantMap *map, Value value, int index);
+
 #endif
@@ -6,5 +6,16 @@
 #include <stdbool.h>
 
 ObjFunction *compile(VM *vm, const char *source);
+ObjFunction *compileRegister(VM *vm, const char *source);
+
+/*
+ * With vm->lazyCompile set, compile() parses a function body for errors
+ * without emitting code, keeping its source for compileLazy to generate the
+ * bytecode on the first call. Only limits on the size of the code, such as
+ * jump distances and constant counts, are left for the first call. Returns
+ * false once it has reported a compile error. Only the stack and wordcode
+ * compilers are lazy.
+ */
+bool compileLazy(VM *vm, ObjFunction *func);
 
 #endif
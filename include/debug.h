@@ -3,7 +3,16 @@
 
 #include "chunk.h"
 
+// Returns the name of an OpCode instruction, e.g. "OP_ADD".
+const char *opcodeName(uint8_t instruction);
+
 void disassembleChunk(Chunk *chunk, const char *name);
 int disassembleInstruction(Chunk *chunk, int offset);
 
+void disassembleWordChunk(Chunk *chunk, const char *name);
+int disassembleWordInstruction(Chunk *chunk, int offset);
+
+void disassembleRegChunk(Chunk *chunk, const char *name);
+int disassembleRegInstruction(Chunk *chunk, int offset);
+
 #endif
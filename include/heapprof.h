@@ -0,0 +1,46 @@
+#ifndef CLOX_HEAPPROF_H
+#define CLOX_HEAPPROF_H
+
+#include "object.h"
+#include "vm.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * Allocation-site heap profiling, enabled with --heap-profile.
+ *
+ * Every object allocated while profiling is tagged with the function and line
+ * running at the time, or <compile> for objects made by the compiler. Tags
+ * live in a hash map keyed by object, so objects don't grow. A snapshot
+ * groups the live objects by type and allocation site with the bytes each
+ * group retains.
+ */
+
+typedef struct alloc_site {
+  Obj *obj;          // NULL for an empty map entry
+  ObjFunction *func; // Function that was running, NULL while compiling
+  int line;
+} AllocSite;
+
+struct heap_profile {
+  AllocSite *sites; // Open addressing hash map keyed by `obj`
+  int count;
+  int capacity;
+  MemStats *stats; // Where the profile's own memory is counted
+};
+
+HeapProfile *newHeapProfile(MemStats *stats);
+void freeHeapProfile(HeapProfile *profile);
+
+// Tags a newly allocated object with the VM's current function and line.
+void recordAllocation(HeapProfile *profile, VM *vm, Obj *obj);
+
+// Prints the largest groups of live objects by type and allocation site.
+void printHeapSnapshot(VM *vm, FILE *out);
+
+// Writes every group of live objects as JSON, returning false if the file
+// can't be written.
+bool writeHeapSnapshot(VM *vm, const char *path);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef CLOX_JIT_H
+#define CLOX_JIT_H
+
+#include "object.h"
+#include "vm.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Machine code is only generated for x86-64 on Linux. Elsewhere jitCompile
+// always fails and functions keep running in the interpreter.
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_SUPPORTED 1
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+#define JIT_DEFAULT_THRESHOLD 1000
+
+/*
+ * Machine code compiled from a function's bytecode.
+ *
+ * The code keeps no Lox state in machine registers between instructions, so
+ * it can be entered at the start of any bytecode instruction. This lets a
+ * function that became hot inside a loop switch to machine code mid-call.
+ */
+struct jit_code {
+  void *memory;   // Executable mapping holding the code
+  size_t size;    // Size of the mapping in bytes
+  void **entries; // Machine code address of each bytecode offset
+  int entryCount;
+};
+
+// Compiles the function to machine code, returning false if it can't be.
+bool jitCompile(VM *vm, ObjFunction *func);
+
+// Runs the frame's function from the instruction at the given bytecode offset
+// until it returns, leaving its result on the stack like OP_RETURN.
+InterpretResult jitEnter(VM *vm, CallFrame *frame, int offset);
+
+void jitFree(VM *vm, JitCode *code);
+
+#endif
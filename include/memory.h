@@ -1,23 +1,76 @@
 #ifndef CLOX_MEMORY_H
 #define CLOX_MEMORY_H
 
-#include "vm.h"
-
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdio.h>
+
+typedef struct vm VM;
+
+/*
+ * What an allocation is for, so memory use can be broken down. Allocations
+ * made through the macros without a category count as MEM_OTHER.
+ *
+ * Every allocation is counted in the MemStats passed with it, normally those
+ * of the VM it belongs to, or not at all if that is NULL. Memory must be grown
+ * and freed with the stats it was allocated with, so data structures outliving
+ * a single call keep a pointer to theirs.
+ */
+typedef enum mem_category {
+  MEM_STRING,      // ObjString and its characters
+  MEM_FUNCTION,    // ObjFunction
+  MEM_NATIVE,      // ObjNative
+  MEM_CHUNK,       // Bytecode and line arrays, chunk arenas
+  MEM_TABLE,       // Hash table entries
+  MEM_VALUE_ARRAY, // Constant arrays
+  MEM_OTHER,       // Compiler state, JIT and profiling data, ...
+  MEM_CATEGORY_COUNT
+} MemCategory;
+
+typedef struct mem_stats {
+  size_t current;          // Bytes allocated right now
+  size_t peak;             // Highest `current` so far
+  size_t total;            // Bytes ever allocated, counting growth
+  unsigned long allocations;
+  unsigned long frees;
+  size_t bytes[MEM_CATEGORY_COUNT]; // Current bytes per category
+  size_t peakBytes[MEM_CATEGORY_COUNT];
+} MemStats;
+
+#define ALLOCATE_IN(stats, category, type, count) \
+  (type *)reallocateIn(stats, category, NULL, 0, sizeof(type) * (count))
 
-#define ALLOCATE(type, count) (type *)reallocate(NULL, 0, sizeof(type) * count)
+#define GROW_ARRAY_IN(stats, category, type, ptr, oldCap, newCap)     \
+  (type *)reallocateIn(stats, category, ptr, sizeof(type) * (oldCap), \
+                       sizeof(type) * (newCap))
+
+#define FREE_ARRAY_IN(stats, category, type, ptr, oldCap) \
+  reallocateIn(stats, category, ptr, sizeof(type) * (oldCap), 0)
+
+#define FREE_IN(stats, category, type, ptr) \
+  reallocateIn(stats, category, ptr, sizeof(type), 0)
+
+#define ALLOCATE(stats, type, count) ALLOCATE_IN(stats, MEM_OTHER, type, count)
 
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity) * 2)
 
-#define GROW_ARRAY(type, ptr, oldCap, newCap) \
-  (type *)reallocate(ptr, sizeof(type) * (oldCap), sizeof(type) * (newCap))
+#define GROW_ARRAY(stats, type, ptr, oldCap, newCap) \
+  GROW_ARRAY_IN(stats, MEM_OTHER, type, ptr, oldCap, newCap)
 
-#define FREE_ARRAY(type, ptr, oldCap) \
-  reallocate(ptr, sizeof(type) * (oldCap), 0)
+#define FREE_ARRAY(stats, type, ptr, oldCap) \
+  FREE_ARRAY_IN(stats, MEM_OTHER, type, ptr, oldCap)
 
-#define FREE(type, ptr) reallocate(ptr, sizeof(type), 0)
+#define FREE(stats, type, ptr) FREE_IN(stats, MEM_OTHER, type, ptr)
 
-void *reallocate(void *ptr, size_t oldSize, size_t newSize);
+void *reallocateIn(MemStats *stats, MemCategory category, void *ptr,
+                   size_t oldSize, size_t newSize);
+void *reallocate(MemStats *stats, void *ptr, size_t oldSize, size_t newSize);
 void freeObjects(VM *vm);
 
+// Looks up a statistic by name ("current", "peak", "total", "allocations",
+// "frees", or a category such as "strings"), returning false if unknown.
+bool getMemStat(MemStats *stats, const char *name, double *value);
+
+void printMemStats(MemStats *stats, FILE *out);
+
 #endif
@@ -0,0 +1,17 @@
+#ifndef CLOX_NUMBER_H
+#define CLOX_NUMBER_H
+
+// Enough for any number formatNumber writes, with its terminating NUL.
+#define NUMBER_BUFFER_SIZE 32
+
+/*
+ * Writes the shortest decimal string that reads back as the same double,
+ * returning its length. Whole numbers print without a fraction; very large
+ * and very small magnitudes use an exponent, like 1e+21 and 1e-7.
+ */
+int formatNumber(double value, char *buffer);
+
+// Parses a number literal: digits, optionally followed by '.' and digits.
+double parseNumber(const char *chars, int length);
+
+#endif
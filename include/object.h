@@ -23,14 +23,37 @@ struct obj {
   Obj *next;
 };
 
+typedef struct jit_code JitCode;
+
+// Native code for a function, entered with its call frame already pushed.
+typedef InterpretResult (*CompiledFn)(VM *vm, CallFrame *frame);
+
 struct obj_function {
   Obj obj;
   int arity;
+  int maxSlots; // Peak stack slots of a call, temporaries included
   Chunk chunk;
-  ObjString *name; // User defined functions have names
+  ObjString *name;      // User defined functions have names
+  unsigned long calls;        // Calls made by the interpreter
+  unsigned long *loopCounts;  // Back-edges taken into each loop header offset,
+                              // allocated when the first loop runs
+  unsigned long *opCounts;    // Executions of each instruction, allocated when
+                              // first run with --profile-ops
+  JitCode *jit;               // Machine code compiled for the function, if any
+  CompiledFn compiled;        // Code compiled ahead of time by --emit-c, if any
+  char *lazySource;           // With --lazy, the parameters and body still to
+                              // be compiled on the first call, or NULL
+  int lazyLength;
+  int lazyLine; // Line the lazy source starts on
 };
 
-typedef Value (*NativeFn)(int argCount, Value *args);
+// Natives store their return value in `result`. One that fails returns false
+// once it has reported a runtime error.
+typedef bool (*NativeFn)(VM *vm, int argCount, Value *args, Value *result);
+
+// Looks up the natives every VM defines by name, returning NULL if unknown.
+NativeFn findNative(const char *name, int length);
+const char *nativeName(NativeFn function);
 
 struct obj_native {
   Obj obj;
@@ -46,6 +69,10 @@ struct obj_string {
 
 ObjFunction *newFunction(VM *vm);
 
+// Packs the chunks of a freshly compiled script and every function defined in
+// it into one of the VM's chunk arenas.
+void packFunctions(VM *vm, ObjFunction *script);
+
 ObjNative *newNative(VM *vm, NativeFn function);
 
 ObjString *takeString(VM *vm, char *chars, int length);
@@ -0,0 +1,37 @@
+#ifndef CLOX_OUTPUT_H
+#define CLOX_OUTPUT_H
+
+#include "value.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+/*
+ * Buffered output of a VM's print statements.
+ *
+ * Output is collected in the buffer and written to the file descriptor in
+ * large writes: when the buffer fills, when flushed explicitly (the VM does so
+ * before reporting errors and when it is freed) and, in line-buffered mode,
+ * after each printed line.
+ */
+typedef struct output {
+  int fd;
+  bool lineBuffered;
+  size_t length; // Bytes waiting in the buffer
+  char buffer[OUTPUT_BUFFER_SIZE];
+} Output;
+
+void initOutput(Output *out, int fd, bool lineBuffered);
+void flushOutput(Output *out);
+
+void writeOutput(Output *out, const char *chars, size_t length);
+void writeOutputf(Output *out, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+void writeValue(Output *out, Value value);
+
+// Writes the value and a newline, like a print statement.
+void printLine(Output *out, Value value);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef CLOX_PERFCOUNT_H
+#define CLOX_PERFCOUNT_H
+
+#include "memory.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Hardware counters are read with perf_event_open, which only Linux has.
+// Elsewhere newPerfCounters always fails.
+#ifdef __linux__
+#define PERF_COUNTERS_SUPPORTED 1
+#else
+#define PERF_COUNTERS_SUPPORTED 0
+#endif
+
+typedef enum perf_event {
+  PERF_INSTRUCTIONS,
+  PERF_CYCLES,
+  PERF_BRANCH_MISSES,
+  PERF_L1D_MISSES,
+  PERF_LLC_MISSES,
+  PERF_EVENT_COUNT
+} PerfEvent;
+
+// The scanner runs on demand from the compiler, so the two share a phase.
+typedef enum perf_phase {
+  PERF_COMPILE,
+  PERF_RUN,
+  PERF_PHASE_COUNT
+} PerfPhase;
+
+/*
+ * Hardware counters for --perf-counters, measuring user space code only.
+ *
+ * The counters run freely once opened; a phase is measured by reading them at
+ * its start and end. Counts from every phase of the same kind add up, so a
+ * REPL session reports all of its lines together.
+ */
+struct perf_counters {
+  int fds[PERF_EVENT_COUNT]; // -1 for events the machine can't count
+  uint64_t start[PERF_EVENT_COUNT];
+  uint64_t counts[PERF_PHASE_COUNT][PERF_EVENT_COUNT];
+  MemStats *stats;
+};
+
+typedef struct perf_counters PerfCounters;
+
+// Opens the counters, returning NULL with errno set if none of them can be.
+PerfCounters *newPerfCounters(MemStats *stats);
+void freePerfCounters(PerfCounters *counters);
+
+void perfPhaseStart(PerfCounters *counters);
+void perfPhaseEnd(PerfCounters *counters, PerfPhase phase);
+
+// Prints counts per phase, and per bytecode instruction when `ops`, the
+// number of instructions run, is known (not 0).
+void printPerfCounters(PerfCounters *counters, unsigned long ops, FILE *out);
+
+#endif
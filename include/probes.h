@@ -0,0 +1,40 @@
+#ifndef CLOX_PROBES_H
+#define CLOX_PROBES_H
+
+/*
+ * USDT static probes for perf, bpftrace and SystemTap, under the "clox"
+ * provider. With <sys/sdt.h> (systemtap-sdt-dev) each probe is a single nop
+ * plus an ELF note describing its arguments; without it they compile to
+ * nothing.
+ *
+ *   function__entry(name, line)   A Lox function starts running
+ *   function__return(name)        A Lox function returns
+ *   compile__start(source)        Compiling a script starts
+ *   compile__end(ok)              Compiling a script ends
+ *   jit__start(name)              Compiling a function to machine code starts
+ *   jit__end(name, ok)            Compiling a function to machine code ends
+ *
+ * e.g. bpftrace -e 'usdt:./build/clox:clox:function__entry
+ *                   { @[str(arg0)] = count(); }'
+ */
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CLOX_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef CLOX_HAVE_SDT
+#define PROBE1(name, a)    DTRACE_PROBE1(clox, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(clox, name, a, b)
+#else
+#define PROBE1(name, a)    ((void)0)
+#define PROBE2(name, a, b) ((void)0)
+#endif
+
+// Name of a function as seen by probes.
+#define PROBE_NAME(func) \
+  ((func)->name == NULL ? "<script>" : (func)->name->chars)
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef CLOX_PROFILE_H
+#define CLOX_PROFILE_H
+
+#include "chunk.h"
+#include "object.h"
+#include "vm.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+// Prints the call counts of functions and back-edge counts of loops counted
+// by the interpreter, hottest first.
+void printHotnessReport(VM *vm, FILE *out);
+
+/*
+ * Instruction counts collected by the interpreter with --profile-ops. Counts
+ * per instruction offset, and so per source line, are kept in each function's
+ * `opCounts`.
+ */
+struct op_profile {
+  unsigned long total;
+  unsigned long counts[OP_COUNT];
+  unsigned long pairs[OP_COUNT][OP_COUNT]; // [previous][next]
+  int previous; // Opcode executed last, or -1 before the first
+  MemStats *stats;
+};
+
+OpProfile *newOpProfile(MemStats *stats);
+void freeOpProfile(OpProfile *profile);
+
+// Counts an execution of the instruction at `offset` in the function.
+void profileInstruction(OpProfile *profile, ObjFunction *func, int offset,
+                        uint8_t instruction);
+
+// Prints the instruction mix, most frequent first.
+void printOpProfile(VM *vm, FILE *out);
+
+// Writes the full profile as JSON, returning false if the file can't be
+// written.
+bool writeOpProfile(VM *vm, const char *path);
+
+#endif
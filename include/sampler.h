@@ -0,0 +1,28 @@
+#ifndef CLOX_SAMPLER_H
+#define CLOX_SAMPLER_H
+
+#include "vm.h"
+
+#include <stdbool.h>
+
+#define SAMPLER_DEFAULT_INTERVAL 1000 // Microseconds of CPU time per sample
+
+/*
+ * A sampling profiler for Lox code. A SIGPROF interval timer interrupts the
+ * process and the signal handler copies the VM's call stack, as functions and
+ * current lines, into a preallocated ring buffer. Only the most recent
+ * samples are kept once the buffer is full.
+ *
+ * One VM can be sampled at a time.
+ */
+
+// Starts sampling the VM, returning false if the timer can't be set up.
+bool startSampler(VM *vm, long intervalMicros);
+
+// Stops sampling and writes the samples as collapsed stacks, one
+// "script;outer:line;inner:line count" line per distinct stack, the input
+// format of flamegraph.pl and similar tools. Returns false if the file can't
+// be written.
+bool stopSampler(const char *path);
+
+#endif
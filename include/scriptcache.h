@@ -0,0 +1,57 @@
+#ifndef CLOX_SCRIPTCACHE_H
+#define CLOX_SCRIPTCACHE_H
+
+#include "object.h"
+#include "vm.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define SCRIPT_CACHE_DEFAULT_SIZE 16
+
+/*
+ * Compiled scripts kept by interpret(), so running the same source again
+ * skips scanning and compiling it.
+ *
+ * Entries are keyed by a hash of the source text, checked against a copy of
+ * it, and by the VM mode the script was compiled for. Once the cache is full
+ * the least recently used entry makes way for a new one.
+ *
+ * Only the cache's own table and source copies are bounded by its capacity.
+ * An evicted script's functions stay allocated with the VM's other objects,
+ * since globals may still refer to them, so a VM running ever new scripts
+ * keeps growing until it is freed.
+ */
+
+typedef struct script_entry {
+  uint64_t hash;
+  char *source;
+  size_t length;
+  VMMode mode;
+  ObjFunction *script;
+  unsigned long lastUsed; // Lookup count when the entry was last hit or added
+} ScriptEntry;
+
+struct script_cache {
+  ScriptEntry *entries;
+  int count;
+  int capacity;
+  unsigned long lookups;
+  unsigned long hits;
+  unsigned long evictions;
+  MemStats *stats;
+};
+
+ScriptCache *newScriptCache(MemStats *stats, int capacity);
+void freeScriptCache(ScriptCache *cache); // Accepts NULL
+
+// Returns the script compiled from the source for the mode, or NULL.
+ObjFunction *findScript(ScriptCache *cache, const char *source, VMMode mode);
+
+// Adds a script compiled from the source, evicting the oldest one if full.
+void addScript(ScriptCache *cache, const char *source, VMMode mode,
+               ObjFunction *script);
+
+void printScriptCacheStats(ScriptCache *cache, FILE *out);
+
+#endif
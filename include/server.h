@@ -0,0 +1,33 @@
+#ifndef CLOX_SERVER_H
+#define CLOX_SERVER_H
+
+#include "vm.h"
+
+#include <stdbool.h>
+
+/*
+ * A warm clox process serving script runs over a local Unix socket.
+ *
+ * `clox --serve=SOCKET` initialises a VM once and waits for requests.
+ * `clox --connect=SOCKET script.lox` sends the script's absolute path along
+ * with its own stdin, stdout and stderr, so the script reads and writes them
+ * directly, then exits with the script's exit status.
+ *
+ * The server compiles each script in its VM, where the script cache keeps it
+ * for later requests, and runs it in a forked child. Every run so starts from
+ * the same pristine VM, and requests run concurrently. Once the cache is
+ * full, scripts missing from it are compiled in the child instead, so the
+ * server's memory stays bounded. Compile errors are written to the client's
+ * stderr.
+ */
+
+// Serves requests until SIGINT or SIGTERM, then removes the socket and
+// returns true. Returns false, with errno set, if the socket can't be set up
+// or stops accepting connections.
+bool serve(VM *vm, const char *socketPath);
+
+// Runs a script on the server listening at the socket, returning the exit
+// status to exit with.
+int runRemote(const char *socketPath, const char *scriptPath);
+
+#endif
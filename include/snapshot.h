@@ -0,0 +1,34 @@
+#ifndef CLOX_SNAPSHOT_H
+#define CLOX_SNAPSHOT_H
+
+#include "vm.h"
+
+#include <stdbool.h>
+
+/*
+ * Snapshots of a VM's global state, to start new VMs without running a
+ * prelude script again:
+ *
+ *   clox --save-snapshot=prelude.snap prelude.lox
+ *   clox --snapshot=prelude.snap script.lox
+ *
+ * A snapshot holds every global with the strings and functions reachable from
+ * them, compiled bytecode included. Natives are saved by name and bound to
+ * the loading VM's own. Snapshots are in the byte order of the machine that
+ * wrote them, and only load into a VM running the same bytecode format.
+ *
+ * A checksum over the file catches corruption, and the bytecode is verified
+ * before loading, so a damaged or hand-made file is rejected instead of run.
+ */
+
+#define SNAPSHOT_VERSION 2
+
+// Writes the VM's globals to the file, returning false with errno set if it
+// can't be written.
+bool writeSnapshot(VM *vm, const char *path);
+
+// Restores the globals in the file into the VM, replacing globals of the same
+// name. Returns false once it has reported why the file can't be loaded.
+bool loadSnapshot(VM *vm, const char *path);
+
+#endif
@@ -14,9 +14,10 @@ typedef struct table {
   int capacity;
   int count; // Number of entries plus tombstones (which count as full buckets)
   Entry *entries;
+  MemStats *stats; // Where the entries' memory is counted
 } Table;
 
-void initTable(Table *table);
+void initTable(Table *table, MemStats *stats);
 void freeTable(Table *table);
 
 /*
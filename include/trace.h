@@ -0,0 +1,56 @@
+#ifndef CLOX_TRACE_H
+#define CLOX_TRACE_H
+
+#include "object.h"
+#include "vm.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Execution tracing, enabled at runtime with --trace.
+ *
+ * Every instruction the interpreter executes, optionally only those in a
+ * given function or range of lines, is written to a compact binary file that
+ * `clox --decode-trace` turns back into text. The file starts with the magic
+ * TRACE_MAGIC, followed by little-endian records:
+ *
+ *   'F' u16 id, u16 length, name      A function seen for the first time
+ *   'I' u8 opcode, u16 function id,   One executed instruction, with the
+ *       u32 offset, u32 line,         stack size before it ran
+ *       u16 stack size
+ */
+
+#define TRACE_MAGIC "CLOXTRC1"
+
+typedef struct traced_function {
+  ObjFunction *function;
+  bool traced; // Whether it passes the function name filter
+} TracedFunction;
+
+struct trace {
+  FILE *out;
+  const char *function; // Only trace functions with this name, or NULL
+  int fromLine;         // Only trace lines from here...
+  int toLine;           // ...up to here, when not 0
+  TracedFunction *functions; // Index is the function's id in the file
+  int functionCount;
+  int functionCapacity;
+  int last; // Index of the function traced last, to skip the lookup
+  MemStats *stats;
+};
+
+// Opens a trace file, returning NULL if it can't be created.
+Trace *openTrace(MemStats *stats, const char *path, const char *function,
+                 int fromLine, int toLine);
+void closeTrace(Trace *trace);
+
+// Records the instruction at `offset` in the frame's function.
+void traceInstruction(Trace *trace, VM *vm, CallFrame *frame, int offset,
+                      uint8_t instruction);
+
+// Prints a trace file as text, returning false if it can't be read.
+bool decodeTrace(const char *path, FILE *out);
+
+#endif
@@ -9,6 +9,7 @@ typedef struct obj Obj;
 typedef struct obj_string ObjString;
 typedef struct obj_function ObjFunction;
 typedef struct obj_native ObjNative;
+typedef struct mem_stats MemStats;
 
 typedef struct value {
   ValueType type;
@@ -37,9 +38,10 @@ typedef struct value_array {
   int capacity;
   int count;
   Value *values;
+  MemStats *stats; // Where the array's memory is counted
 } ValueArray;
 
-void initValueArray(ValueArray *arr);
+void initValueArray(ValueArray *arr, MemStats *stats);
 void writeValueArray(ValueArray *arr, Value value);
 void freeValueArray(ValueArray *arr);
 
@@ -0,0 +1,27 @@
+#ifndef CLOX_VERIFY_H
+#define CLOX_VERIFY_H
+
+#include "object.h"
+#include "vm.h"
+
+#include <stdbool.h>
+
+/*
+ * Checks of bytecode that didn't come from this process's compiler, such as
+ * a loaded snapshot, before the VM runs it. The interpreters and the JIT
+ * trust their code, so a bad operand would read or write outside the chunk's
+ * arrays or the VM's stack.
+ *
+ * Every instruction, reachable or not, must have a known opcode and operands
+ * in range: constant indexes below the constant count, global names that are
+ * string constants, local slots and registers below the function's slot
+ * count, and jumps landing on an instruction inside the chunk. From the
+ * entry, no path may run off the end of the chunk, and stack code must keep
+ * the same stack depth wherever paths meet, never popping into the
+ * function's own slot.
+ */
+
+// Returns true if the function's code is safe to run in the mode.
+bool verifyFunction(ObjFunction *func, VMMode mode, MemStats *stats);
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef CLOX_VM_H
 #define CLOX_VM_H
 
+#include "memory.h"
+#include "output.h"
 #include "table.h"
 #include "value.h"
 
@@ -14,7 +16,28 @@ typedef struct call_frame {
   Value *slots; // Points into the first slot used in the VMs stack
 } CallFrame;
 
-typedef struct vm {
+// Selects the instruction set a VM compiles to and executes.
+typedef enum vm_mode {
+  VM_STACK,    // Stack-based bytecode (OpCode)
+  VM_WORDCODE, // Stack-based OpCode instructions in fixed-width words
+  VM_REGISTER  // Register-based bytecode (RegOpCode)
+} VMMode;
+
+/*
+ * Called once when a function's call count, or the back-edge count of one of
+ * its loops, reaches the VM's hot threshold. `loop` is the bytecode offset of
+ * the loop header, or -1 when the function itself became hot.
+ */
+typedef struct chunk_arena ChunkArena;
+typedef struct heap_profile HeapProfile;
+typedef struct op_profile OpProfile;
+typedef struct perf_counters PerfCounters;
+typedef struct script_cache ScriptCache;
+typedef struct trace Trace;
+typedef struct vm VM;
+typedef void (*HotHook)(VM *vm, ObjFunction *func, int loop);
+
+struct vm {
   CallFrame frames[FRAMES_MAX];
   int frameCount;
   Value stack[STACK_MAX];
@@ -22,7 +45,22 @@ typedef struct vm {
   Table strings; // String interning table (hashset)
   Table globals; // Global variables
   Obj *objects;
-} VM;
+  ChunkArena *chunkArenas; // Packed bytecode of every compiled script
+  VMMode mode;
+  unsigned long dispatchCount; // Interpreted instructions, see run
+  bool jitEnabled;             // Compile hot functions to machine code
+  unsigned long hotThreshold;  // Calls or loop iterations to become hot
+  HotHook hotHook;             // Compiles hot code by default, may be NULL
+  OpProfile *profile;          // Instruction counts for --profile-ops, or NULL
+  Trace *trace;                // Instructions traced with --trace, or NULL
+  HeapProfile *heapProfile;    // Allocation sites for --heap-profile, or NULL
+  PerfCounters *perfCounters;  // Counted for --perf-counters, or NULL
+  ScriptCache *scriptCache;    // Scripts compiled by interpret, or NULL
+  MemStats memStats;           // Memory allocated for this VM
+  bool perfMap;                // List machine code in /tmp/perf-<pid>.map
+  bool lazyCompile;            // Compile function bodies on their first call
+  Output output;               // Buffered output of print statements
+};
 
 typedef enum interpret_result {
   INTERPRET_OK,
@@ -38,4 +76,35 @@ Value popStack(VM *vm);
 
 InterpretResult interpret(VM *vm, const char *source);
 
+// Compiles a script for the VM's mode, reusing it from the VM's script cache
+// if the same source was compiled before. Returns NULL on compile errors.
+ObjFunction *compileScript(VM *vm, const char *source);
+
+// Runs an already compiled script.
+InterpretResult interpretFunction(VM *vm, ObjFunction *func);
+
+/*
+ * Operations used by machine code compiled from bytecode. Each one acts on the
+ * VM stack exactly like the instruction of the same name, and those that can
+ * fail return false once they have reported a runtime error.
+ */
+bool vmGetGlobal(VM *vm, ObjString *name);
+bool vmSetGlobal(VM *vm, ObjString *name);
+void vmDefineGlobal(VM *vm, ObjString *name);
+void vmEqual(VM *vm);
+void vmNotEqual(VM *vm);
+bool vmGreater(VM *vm);
+bool vmGreaterEq(VM *vm);
+bool vmLess(VM *vm);
+bool vmLessEq(VM *vm);
+bool vmAdd(VM *vm);
+bool vmSubtract(VM *vm);
+bool vmMultiply(VM *vm);
+bool vmDivide(VM *vm);
+void vmNot(VM *vm);
+bool vmNegate(VM *vm);
+void vmPrint(VM *vm);
+bool vmCall(VM *vm, int argCount); // Runs the callee until it returns
+void vmReturn(VM *vm);
+
 #endif
@@ -0,0 +1,372 @@
+#include "aot.h"
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct function_list {
+  ObjFunction **functions;
+  int count;
+  int capacity;
+} FunctionList;
+
+static int indexOf(FunctionList *list, ObjFunction *func) {
+  for (int i = 0; i < list->count; i++) {
+    if (list->functions[i] == func)
+      return i;
+  }
+
+  return -1;
+}
+
+// Lists the function and, depth first, every function it defines. Like the
+// rest of the code generator's scratch memory, the list isn't counted in any
+// VM's statistics.
+static void collectFunctions(FunctionList *list, ObjFunction *func) {
+  if (list->count >= list->capacity) {
+    int oldCap      = list->capacity;
+    list->capacity  = GROW_CAPACITY(oldCap);
+    list->functions = GROW_ARRAY(NULL, ObjFunction *, list->functions, oldCap,
+                                 list->capacity);
+  }
+
+  list->functions[list->count++] = func;
+
+  ValueArray *constants = &func->chunk.constants;
+  for (int i = 0; i < constants->count; i++) {
+    Value constant = constants->values[i];
+    if (IS_FUNCTION(constant) && indexOf(list, AS_FUNCTION(constant)) == -1)
+      collectFunctions(list, AS_FUNCTION(constant));
+  }
+}
+
+static void emitString(FILE *out, const char *chars, int length) {
+  fputc('"', out);
+  for (int i = 0; i < length; i++) {
+    unsigned char c = chars[i];
+    if (c == '"' || c == '\\') {
+      fprintf(out, "\\%c", c);
+    } else if (c >= ' ' && c <= '~' && c != '?') {
+      fputc(c, out);
+    } else {
+      fprintf(out, "\\%03o", c);
+    }
+  }
+  fputc('"', out);
+}
+
+static void emitTables(FILE *out, FunctionList *list, int index) {
+  Chunk *chunk = &list->functions[index]->chunk;
+
+  fprintf(out, "static const uint8_t code_%d[] = {", index);
+  for (int i = 0; i < chunk->count; i++) {
+    fprintf(out, i % 12 == 0 ? "\n  0x%02x," : " 0x%02x,", chunk->code[i]);
+  }
+  fprintf(out, "\n};\n\n");
+
+  fprintf(out, "static const LineRun lines_%d[] = {", index);
+  for (int i = 0; i < chunk->lineCount; i++) {
+    LineRun *run = &chunk->lines[i];
+    fprintf(out, i % 6 == 0 ? "\n  {%d, %d}," : " {%d, %d},", run->offset,
+            run->line);
+  }
+  fprintf(out, "\n};\n\n");
+
+  if (chunk->constants.count == 0)
+    return;
+
+  fprintf(out, "static const AotConstant constants_%d[] = {\n", index);
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value constant = chunk->constants.values[i];
+    switch (constant.type) {
+      case VAL_NIL: fprintf(out, "  {.type = AOT_NIL},\n"); break;
+      case VAL_BOOL:
+        fprintf(out, "  {.type = AOT_BOOL, .boolean = %s},\n",
+                AS_BOOL(constant) ? "true" : "false");
+        break;
+      case VAL_NUM:
+        // Hexadecimal floats keep every bit of the number
+        fprintf(out, "  {.type = AOT_NUM, .number = %a},\n", AS_NUM(constant));
+        break;
+      case VAL_OBJ:
+        if (IS_STRING(constant)) {
+          ObjString *string = AS_STRING(constant);
+          fprintf(out, "  {.type = AOT_STRING, .chars = ");
+          emitString(out, string->chars, string->length);
+          fprintf(out, ", .length = %d},\n", string->length);
+        } else {
+          fprintf(out, "  {.type = AOT_FUNCTION, .function = %d},\n",
+                  indexOf(list, AS_FUNCTION(constant)));
+        }
+        break;
+    }
+  }
+  fprintf(out, "};\n\n");
+}
+
+static void emitNumberOp(FILE *out, int next, const char *helper,
+                         const char *valueType, const char *op) {
+  fprintf(out, "  AOT_NUMBER_OP(%d, %s, %s, %s);\n", next, helper, valueType,
+          op);
+}
+
+// Translates the instruction at `offset`, returning the next offset.
+static int emitInstruction(FILE *out, Chunk *chunk, int offset) {
+  uint8_t *ip = &chunk->code[offset];
+
+#define OPERAND()  (ip[1])
+#define JUMP_LEN() ((uint16_t)(ip[1] << 8 | ip[2]))
+
+  // Constant-taking instructions, short or _LONG form
+#define CONSTANT() constantOperand(ip)
+#define NEXT()     (offset + constantInstructionBytes(ip[0]))
+
+  switch (ip[0]) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+      fprintf(out, "  AOT_PUSH(K[%d]);\n", CONSTANT());
+      return NEXT();
+    case OP_NIL:   fprintf(out, "  AOT_PUSH(NIL_VAL);\n"); return offset + 1;
+    case OP_TRUE:
+      fprintf(out, "  AOT_PUSH(BOOL_VAL(true));\n");
+      return offset + 1;
+    case OP_FALSE:
+      fprintf(out, "  AOT_PUSH(BOOL_VAL(false));\n");
+      return offset + 1;
+    case OP_POP: fprintf(out, "  vm->stackTop--;\n"); return offset + 1;
+    case OP_GET_LOCAL:
+      fprintf(out, "  AOT_PUSH(slots[%d]);\n", OPERAND());
+      return offset + 2;
+    case OP_SET_LOCAL:
+      fprintf(out, "  slots[%d] = AOT_PEEK(0);\n", OPERAND());
+      return offset + 2;
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG:
+      fprintf(out, "  AOT_CHECK(%d, vmGetGlobal(vm, AS_STRING(K[%d])));\n",
+              NEXT(), CONSTANT());
+      return NEXT();
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_LONG:
+      fprintf(out, "  AOT_CHECK(%d, vmSetGlobal(vm, AS_STRING(K[%d])));\n",
+              NEXT(), CONSTANT());
+      return NEXT();
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_GLOBAL_LONG:
+      fprintf(out, "  vmDefineGlobal(vm, AS_STRING(K[%d]));\n", CONSTANT());
+      return NEXT();
+    case OP_EQ:     fprintf(out, "  vmEqual(vm);\n"); return offset + 1;
+    case OP_NOT_EQ: fprintf(out, "  vmNotEqual(vm);\n"); return offset + 1;
+    case OP_GREATER:
+      emitNumberOp(out, offset + 1, "vmGreater", "BOOL_VAL", ">");
+      return offset + 1;
+    case OP_GREATER_EQ:
+      emitNumberOp(out, offset + 1, "vmGreaterEq", "BOOL_VAL", ">=");
+      return offset + 1;
+    case OP_LESS:
+      emitNumberOp(out, offset + 1, "vmLess", "BOOL_VAL", "<");
+      return offset + 1;
+    case OP_LESS_EQ:
+      emitNumberOp(out, offset + 1, "vmLessEq", "BOOL_VAL", "<=");
+      return offset + 1;
+    case OP_ADD:
+      // Strings fall back to vmAdd along with type errors
+      emitNumberOp(out, offset + 1, "vmAdd", "NUM_VAL", "+");
+      return offset + 1;
+    case OP_SUBTRACT:
+      emitNumberOp(out, offset + 1, "vmSubtract", "NUM_VAL", "-");
+      return offset + 1;
+    case OP_MULTIPLY:
+      emitNumberOp(out, offset + 1, "vmMultiply", "NUM_VAL", "*");
+      return offset + 1;
+    case OP_DIVIDE:
+      emitNumberOp(out, offset + 1, "vmDivide", "NUM_VAL", "/");
+      return offset + 1;
+    case OP_NOT: fprintf(out, "  vmNot(vm);\n"); return offset + 1;
+    case OP_NEGATE:
+      fprintf(out, "  AOT_NEGATE(%d);\n", offset + 1);
+      return offset + 1;
+    case OP_PRINT: fprintf(out, "  vmPrint(vm);\n"); return offset + 1;
+    case OP_JUMP:
+      fprintf(out, "  goto L%d;\n", offset + 3 + JUMP_LEN());
+      return offset + 3;
+    case OP_JUMP_IF_FALSE:
+      fprintf(out, "  if (AOT_FALSY(AOT_PEEK(0)))\n    goto L%d;\n",
+              offset + 3 + JUMP_LEN());
+      return offset + 3;
+    case OP_LOOP:
+      fprintf(out, "  goto L%d;\n", offset + 3 - JUMP_LEN());
+      return offset + 3;
+    case OP_CALL:
+      fprintf(out, "  AOT_CHECK(%d, vmCall(vm, %d));\n", offset + 2,
+              OPERAND());
+      return offset + 2;
+    case OP_RETURN:
+      fprintf(out, "  vmReturn(vm);\n  return INTERPRET_OK;\n");
+      return offset + 1;
+    default:
+      fprintf(stderr, "Unknown opcode %d\n", ip[0]);
+      return offset + 1;
+  }
+
+#undef OPERAND
+#undef JUMP_LEN
+#undef CONSTANT
+#undef NEXT
+}
+
+static int instructionLength(uint8_t instruction) {
+  switch (instruction) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_CALL:          return 2;
+    case OP_CONSTANT_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:   return 1 + LONG_OPERAND_BYTES;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:          return 3;
+    default:               return 1;
+  }
+}
+
+static void emitFunction(FILE *out, ObjFunction *func, int index) {
+  Chunk *chunk = &func->chunk;
+
+  // Only jump targets get labels, so the C compiler doesn't warn about unused
+  // ones.
+  bool *targets = ALLOCATE(NULL, bool, chunk->count + 1);
+  memset(targets, 0, sizeof(bool) * (chunk->count + 1));
+
+  for (int offset = 0; offset < chunk->count;) {
+    uint8_t *ip = &chunk->code[offset];
+    int length  = instructionLength(ip[0]);
+    if (ip[0] == OP_JUMP || ip[0] == OP_JUMP_IF_FALSE) {
+      targets[offset + 3 + (uint16_t)(ip[1] << 8 | ip[2])] = true;
+    } else if (ip[0] == OP_LOOP) {
+      targets[offset + 3 - (uint16_t)(ip[1] << 8 | ip[2])] = true;
+    }
+    offset += length;
+  }
+
+  fprintf(out, "// %s\n", func->name == NULL ? "<script>" : func->name->chars);
+  fprintf(out, "static InterpretResult fn_%d(VM *vm, CallFrame *frame) {\n",
+          index);
+  fprintf(out, "  AOT_PROLOGUE();\n\n");
+
+  for (int offset = 0; offset < chunk->count;) {
+    if (targets[offset])
+      fprintf(out, "L%d:\n", offset);
+    offset = emitInstruction(out, chunk, offset);
+  }
+
+  // Every chunk ends in a return, but the C compiler can't know that
+  fprintf(out, "  return INTERPRET_OK;\n}\n\n");
+
+  FREE_ARRAY(NULL, bool, targets, chunk->count + 1);
+}
+
+void emitC(ObjFunction *script, FILE *out) {
+  FunctionList list = {0};
+  collectFunctions(&list, script);
+
+  fprintf(out, "// Generated by clox --emit-c.\n\n");
+  fprintf(out, "#include \"aot.h\"\n\n");
+
+  for (int i = 0; i < list.count; i++) {
+    emitTables(out, &list, i);
+    emitFunction(out, list.functions[i], i);
+  }
+
+  fprintf(out, "static const AotFunction functions[] = {\n");
+  for (int i = 0; i < list.count; i++) {
+    ObjFunction *func = list.functions[i];
+
+    fprintf(out, "    {");
+    if (func->name == NULL) {
+      fprintf(out, "NULL");
+    } else {
+      emitString(out, func->name->chars, func->name->length);
+    }
+
+    fprintf(out, ", %d, %d, code_%d, %d, lines_%d, %d, ", func->arity,
+            func->maxSlots, i, func->chunk.count, i, func->chunk.lineCount);
+    if (func->chunk.constants.count == 0) {
+      fprintf(out, "NULL, 0, fn_%d},\n", i);
+    } else {
+      fprintf(out, "constants_%d, %d, fn_%d},\n", i,
+              func->chunk.constants.count, i);
+    }
+  }
+  fprintf(out, "};\n\n");
+
+  fprintf(out, "int main(void) {\n");
+  fprintf(out, "  return aotRun(functions, %d);\n", list.count);
+  fprintf(out, "}\n");
+
+  FREE_ARRAY(NULL, ObjFunction *, list.functions, list.capacity);
+}
+
+int aotRun(const AotFunction *functions, int count) {
+  VM vm;
+  initVM(&vm);
+  vm.jitEnabled = false;
+
+  // Create every function first, so constants can refer to any of them.
+  ObjFunction **objs = ALLOCATE(&vm.memStats, ObjFunction *, count);
+  for (int i = 0; i < count; i++) {
+    objs[i] = newFunction(&vm);
+  }
+
+  for (int i = 0; i < count; i++) {
+    const AotFunction *source = &functions[i];
+    ObjFunction *func         = objs[i];
+
+    func->arity    = source->arity;
+    func->maxSlots = source->maxSlots;
+    func->compiled = source->compiled;
+    if (source->name != NULL)
+      func->name = copyString(&vm, source->name, strlen(source->name));
+
+    for (int run = 0; run < source->lineCount; run++) {
+      int end = run + 1 < source->lineCount ? source->lines[run + 1].offset
+                                            : source->count;
+      for (int j = source->lines[run].offset; j < end; j++) {
+        writeChunk(&func->chunk, source->code[j], source->lines[run].line);
+      }
+    }
+
+    for (int j = 0; j < source->constantCount; j++) {
+      const AotConstant *constant = &source->constants[j];
+      Value value;
+      switch (constant->type) {
+        case AOT_NIL:  value = NIL_VAL; break;
+        case AOT_BOOL: value = BOOL_VAL(constant->boolean); break;
+        case AOT_NUM:  value = NUM_VAL(constant->number); break;
+        case AOT_STRING:
+          value = OBJ_VAL(copyString(&vm, constant->chars, constant->length));
+          break;
+        case AOT_FUNCTION: value = OBJ_VAL(objs[constant->function]); break;
+      }
+      addConstant(&func->chunk, value);
+    }
+  }
+
+  packFunctions(&vm, objs[0]);
+  InterpretResult result = interpretFunction(&vm, objs[0]);
+
+  FREE_ARRAY(&vm.memStats, ObjFunction *, objs, count);
+  freeVM(&vm);
+
+  return result == INTERPRET_OK ? EXIT_SUCCESS : EXIT_FAILURE;
+}
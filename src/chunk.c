@@ -1,35 +1,179 @@
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 #include "value.h"
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 
-void initChunk(Chunk *chunk) {
-  chunk->count    = 0;
-  chunk->capacity = 0;
-  chunk->code     = NULL;
-  chunk->lines    = NULL;
-  initValueArray(&chunk->constants);
+void initChunk(Chunk *chunk, MemStats *stats) {
+  chunk->count        = 0;
+  chunk->capacity     = 0;
+  chunk->code         = NULL;
+  chunk->lineCount    = 0;
+  chunk->lineCapacity = 0;
+  chunk->lines        = NULL;
+  chunk->packed       = false;
+  chunk->stats        = stats;
+  initValueArray(&chunk->constants, stats);
+}
+
+// Records that the bytecode from the end of the chunk on is on `line`.
+static void addLine(Chunk *chunk, int line) {
+  if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line)
+    return;
+
+  if (chunk->lineCount >= chunk->lineCapacity) {
+    int oldCap          = chunk->lineCapacity;
+    chunk->lineCapacity = GROW_CAPACITY(oldCap);
+    chunk->lines        = GROW_ARRAY_IN(chunk->stats, MEM_CHUNK, LineRun,
+                                        chunk->lines, oldCap,
+                                        chunk->lineCapacity);
+  }
+
+  chunk->lines[chunk->lineCount++] = (LineRun){chunk->count, line};
 }
 
 void writeChunk(Chunk *chunk, uint8_t byte, int line) {
   if (chunk->count >= chunk->capacity) {
     int oldCap      = chunk->capacity;
     chunk->capacity = GROW_CAPACITY(oldCap);
-    chunk->code     = GROW_ARRAY(uint8_t, chunk->code, oldCap, chunk->capacity);
-    chunk->lines    = GROW_ARRAY(int, chunk->lines, oldCap, chunk->capacity);
+    chunk->code =
+        GROW_ARRAY_IN(chunk->stats, MEM_CHUNK, uint8_t, chunk->code, oldCap,
+                      chunk->capacity);
   }
 
-  chunk->code[chunk->count]  = byte;
-  chunk->lines[chunk->count] = line;
+  addLine(chunk, line);
+  chunk->code[chunk->count] = byte;
   chunk->count++;
 }
 
+// Appends a wordcode instruction. Chunks only ever hold whole words in
+// wordcode mode, so every word stays aligned for the VM's 32-bit loads.
+void writeWord(Chunk *chunk, uint32_t word, int line) {
+  if (chunk->count + WORD_BYTES > chunk->capacity) {
+    int oldCap      = chunk->capacity;
+    chunk->capacity = GROW_CAPACITY(oldCap);
+    chunk->code =
+        GROW_ARRAY_IN(chunk->stats, MEM_CHUNK, uint8_t, chunk->code, oldCap,
+                      chunk->capacity);
+  }
+
+  addLine(chunk, line);
+  memcpy(&chunk->code[chunk->count], &word, WORD_BYTES);
+  chunk->count += WORD_BYTES;
+}
+
 void freeChunk(Chunk *chunk) {
-  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity);
-  freeValueArray(&chunk->constants);
-  initChunk(chunk);
+  // A packed chunk's arrays go with its arena
+  if (!chunk->packed) {
+    FREE_ARRAY_IN(chunk->stats, MEM_CHUNK, uint8_t, chunk->code,
+                  chunk->capacity);
+    FREE_ARRAY_IN(chunk->stats, MEM_CHUNK, LineRun, chunk->lines,
+                  chunk->lineCapacity);
+    freeValueArray(&chunk->constants);
+  }
+  initChunk(chunk, chunk->stats);
+}
+
+void insertChunk(Chunk *chunk, int offset, const uint8_t *code, int count) {
+  if (chunk->count + count > chunk->capacity) {
+    int oldCap = chunk->capacity;
+    while (chunk->count + count > chunk->capacity)
+      chunk->capacity = GROW_CAPACITY(chunk->capacity);
+    chunk->code =
+        GROW_ARRAY_IN(chunk->stats, MEM_CHUNK, uint8_t, chunk->code, oldCap,
+                      chunk->capacity);
+  }
+
+  memmove(&chunk->code[offset + count], &chunk->code[offset],
+          chunk->count - offset);
+  memcpy(&chunk->code[offset], code, count);
+  chunk->count += count;
+
+  // The inserted code joins the run covering the offset
+  for (int i = 0; i < chunk->lineCount; i++) {
+    if (chunk->lines[i].offset > offset)
+      chunk->lines[i].offset += count;
+  }
+}
+
+int getLine(const Chunk *chunk, int offset) {
+  // Binary search for the last run starting at or before the offset
+  int low = 0, high = chunk->lineCount - 1;
+  while (low < high) {
+    int mid = low + (high - low + 1) / 2;
+    if (chunk->lines[mid].offset <= offset) {
+      low = mid;
+    } else {
+      high = mid - 1;
+    }
+  }
+  return chunk->lineCount == 0 ? 0 : chunk->lines[low].line;
+}
+
+// Rounds a size up so the next array in an arena stays aligned for Values.
+static size_t arenaAlign(size_t size) {
+  return (size + _Alignof(Value) - 1) & ~(_Alignof(Value) - 1);
+}
+
+static size_t packedSize(Chunk *chunk) {
+  return arenaAlign(sizeof(uint8_t) * chunk->count) +
+         arenaAlign(sizeof(Value) * chunk->constants.count) +
+         arenaAlign(sizeof(LineRun) * chunk->lineCount);
+}
+
+// Copies `size` bytes to the arena's free space, returning where they went.
+static void *pack(uint8_t **cursor, const void *data, size_t size) {
+  void *copy = *cursor;
+  if (size > 0)
+    memcpy(copy, data, size);
+  *cursor += arenaAlign(size);
+  return copy;
+}
+
+void packChunks(MemStats *stats, ChunkArena **arenas, Chunk **chunks,
+                int count) {
+  size_t size = arenaAlign(sizeof(ChunkArena));
+  for (int i = 0; i < count; i++)
+    size += packedSize(chunks[i]);
+
+  ChunkArena *arena = reallocateIn(stats, MEM_CHUNK, NULL, 0, size);
+  arena->next       = *arenas;
+  arena->size       = size;
+  *arenas           = arena;
+
+  // Each chunk's code comes right before its constants, and its lines, only
+  // read on errors and by tools, after them
+  uint8_t *cursor = (uint8_t *)arena + arenaAlign(sizeof(ChunkArena));
+  for (int i = 0; i < count; i++) {
+    Chunk *chunk = chunks[i];
+    Chunk packed = *chunk;
+
+    packed.code = pack(&cursor, chunk->code, sizeof(uint8_t) * chunk->count);
+    packed.constants.values =
+        pack(&cursor, chunk->constants.values,
+             sizeof(Value) * chunk->constants.count);
+    packed.lines =
+        pack(&cursor, chunk->lines, sizeof(LineRun) * chunk->lineCount);
+    packed.capacity           = chunk->count;
+    packed.constants.capacity = chunk->constants.count;
+    packed.lineCapacity       = chunk->lineCount;
+    packed.packed             = true;
+
+    freeChunk(chunk);
+    *chunk = packed;
+  }
+}
+
+void freeChunkArenas(MemStats *stats, ChunkArena **arenas) {
+  while (*arenas != NULL) {
+    ChunkArena *next = (*arenas)->next;
+    reallocateIn(stats, MEM_CHUNK, *arenas, (*arenas)->size, 0);
+    *arenas = next;
+  }
 }
 
 // Returns the index where the value was appended to in the constants array.
@@ -37,3 +181,103 @@ int addConstant(Chunk *chunk, Value value) {
   writeValueArray(&chunk->constants, value);
   return chunk->constants.count - 1;
 }
+
+static bool isLongOp(uint8_t instruction) {
+  switch (instruction) {
+    case OP_CONSTANT_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:    return true;
+    default:                    return false;
+  }
+}
+
+int constantOperand(const uint8_t *ip) {
+  if (isLongOp(ip[0]))
+    return ip[1] << 16 | ip[2] << 8 | ip[3];
+  return ip[1];
+}
+
+int constantInstructionBytes(uint8_t instruction) {
+  return isLongOp(instruction) ? 1 + LONG_OPERAND_BYTES : 2;
+}
+
+#define CONSTANT_MAP_MAX_LOAD 0.75
+
+void initConstantMap(ConstantMap *map, MemStats *stats) {
+  map->count    = 0;
+  map->capacity = 0;
+  map->slots    = NULL;
+  map->stats    = stats;
+}
+
+void freeConstantMap(ConstantMap *map) {
+  FREE_ARRAY(map->stats, ConstantSlot, map->slots, map->capacity);
+  initConstantMap(map, map->stats);
+}
+
+// Only numbers and strings are shared: equal strings are the same interned
+// object, and numbers are compared bit for bit so 0 and -0 stay apart.
+static bool isShared(Value value) { return IS_NUM(value) || IS_STRING(value); }
+
+static uint64_t constantBits(Value value) {
+  uint64_t bits;
+  if (IS_NUM(value)) {
+    memcpy(&bits, &value.as.number, sizeof(bits));
+  } else {
+    bits = (uint64_t)(uintptr_t)AS_OBJ(value);
+  }
+  return bits;
+}
+
+static bool sameConstant(Value a, Value b) {
+  return a.type == b.type && constantBits(a) == constantBits(b);
+}
+
+static ConstantSlot *findSlot(ConstantSlot *slots, int capacity, Value value) {
+  uint64_t bits  = constantBits(value);
+  uint32_t index = (uint32_t)((bits ^ bits >> 29) * 0x9e3779b97f4a7c15ull >> 32);
+
+  for (index &= capacity - 1;; index = (index + 1) & (capacity - 1)) {
+    ConstantSlot *slot = &slots[index];
+    if (slot->index == -1 || sameConstant(slot->value, value))
+      return slot;
+  }
+}
+
+int findConstant(ConstantMap *map, Value value) {
+  if (map->count == 0 || !isShared(value))
+    return -1;
+
+  return findSlot(map->slots, map->capacity, value)->index;
+}
+
+static void growConstantMap(ConstantMap *map) {
+  int capacity        = GROW_CAPACITY(map->capacity);
+  ConstantSlot *slots = ALLOCATE(map->stats, ConstantSlot, capacity);
+  for (int i = 0; i < capacity; i++)
+    slots[i].index = -1;
+
+  for (int i = 0; i < map->capacity; i++) {
+    ConstantSlot *slot = &map->slots[i];
+    if (slot->index != -1)
+      *findSlot(slots, capacity, slot->value) = *slot;
+  }
+
+  FREE_ARRAY(map->stats, ConstantSlot, map->slots, map->capacity);
+  map->slots    = slots;
+  map->capacity = capacity;
+}
+
+void mapConstant(ConstantMap *map, Value value, int index) {
+  if (!isShared(value))
+    return;
+
+  if (map->count + 1 > map->capacity * CONSTANT_MAP_MAX_LOAD)
+    growConstantMap(map);
+
+  ConstantSlot *slot = findSlot(map->slots, map->capacity, value);
+  if (slot->index == -1)
+    map->count++;
+  *slot = (ConstantSlot){value, index};
+}
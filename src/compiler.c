@@ -1,6 +1,8 @@
 #include "compiler.h"
 #include "chunk.h"
 #include "debug.h"
+#include "memory.h"
+#include "number.h"
 #include "object.h"
 #include "scanner.h"
 #include "value.h"
@@ -25,9 +27,13 @@ typedef struct compiler {
   struct compiler *enclosing;
   ObjFunction *function;
   FunctionType type;
-  Local locals[UINT8_MAX + 1];
+  Local *locals;
   int localCount;
+  int localCapacity;
+  int stackDepth; // Values on the stack as the code emitted leaves it
+  int maxDepth;   // Peak stack depth, locals and temporaries included
   int scopeDepth;
+  ConstantMap constants; // Indexes the function's constants by value
 } Compiler;
 
 typedef struct parser {
@@ -38,6 +44,8 @@ typedef struct parser {
   Scanner *scanner;
   Compiler *currentCompiler;
   VM *vm;
+  bool wordcode;  // Emit fixed-width wordcode instead of bytecode
+  bool checkOnly; // Parse for errors without emitting code or constants
 } Parser;
 
 // The language's precdence levels from lowest to highest
@@ -72,27 +80,47 @@ typedef struct parse_rule {
   Precedence precedence;
 } ParseRule;
 
-static void initCompiler(Parser *parser, Compiler *compiler,
-                         FunctionType type) {
-  compiler->enclosing  = parser->currentCompiler;
-  compiler->function   = NULL;
-  compiler->type       = type;
-  compiler->localCount = 0;
-  compiler->scopeDepth = 0;
-  compiler->function   = newFunction(parser->vm);
+static Local *pushLocal(Parser *parser, Token name) {
+  Compiler *compiler = parser->currentCompiler;
 
-  parser->currentCompiler = compiler;
+  if (compiler->localCount >= compiler->localCapacity) {
+    int oldCap              = compiler->localCapacity;
+    compiler->localCapacity = GROW_CAPACITY(oldCap);
+    compiler->locals = GROW_ARRAY(&parser->vm->memStats, Local,
+                                  compiler->locals, oldCap,
+                                  compiler->localCapacity);
+  }
+
+  Local *local = &compiler->locals[compiler->localCount++];
+  local->name  = name;
+  local->depth = -1;
 
-  if (type != TYPE_SCRIPT) {
-    parser->currentCompiler->function->name =
-        copyString(parser->vm, parser->previous.start, parser->previous.length);
+  // Parameters are on the stack without any code pushing them
+  if (compiler->localCount > compiler->maxDepth) {
+    compiler->maxDepth = compiler->localCount;
   }
 
-  Local *local =
-      &parser->currentCompiler->locals[parser->currentCompiler->localCount++];
-  local->depth       = 0;
-  local->name.start  = "";
-  local->name.length = 0;
+  return local;
+}
+
+static void initCompiler(Parser *parser, Compiler *compiler,
+                         FunctionType type, ObjFunction *function) {
+  compiler->enclosing     = parser->currentCompiler;
+  compiler->function      = function;
+  compiler->type          = type;
+  compiler->locals        = NULL;
+  compiler->localCount    = 0;
+  compiler->localCapacity = 0;
+  compiler->stackDepth    = 0;
+  compiler->maxDepth      = 0;
+  compiler->scopeDepth    = 0;
+  initConstantMap(&compiler->constants, &parser->vm->memStats);
+
+  parser->currentCompiler = compiler;
+
+  Token name  = {.start = "", .length = 0};
+  Local *local = pushLocal(parser, name);
+  local->depth = 0;
 }
 
 // Returns the chunk owned by the function we are in the middle of compiling.
@@ -164,56 +192,162 @@ static bool match(Parser *parser, TokenType type) {
   return true;
 }
 
-static void emitByte(Parser *parser, uint8_t byte) {
-  writeChunk(currentChunk(parser), byte, parser->previous.line);
+// Returns how many values the instruction leaves on the stack, less those it
+// takes off.
+static int stackEffect(OpCode op, int arg) {
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG: return 1;
+    case OP_SET_LOCAL:
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_LONG:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:            return 0;
+    case OP_CALL:            return -arg;
+    default:                 return -1;
+  }
 }
 
-static void emitBytes(Parser *parser, uint8_t byte1, uint8_t byte2) {
-  writeChunk(currentChunk(parser), byte1, parser->previous.line);
-  writeChunk(currentChunk(parser), byte2, parser->previous.line);
+// Tracks the stack depth through the instruction, so a call can make sure
+// the frame's temporaries fit on the stack and not only its locals.
+static void trackStack(Parser *parser, OpCode op, int arg) {
+  Compiler *compiler = parser->currentCompiler;
+  compiler->stackDepth += stackEffect(op, arg);
+  if (compiler->stackDepth > compiler->maxDepth)
+    compiler->maxDepth = compiler->stackDepth;
 }
 
-static int emitJump(Parser *parser, uint8_t jumpInstruction) {
-  emitByte(parser, jumpInstruction);
+static void emitOp(Parser *parser, OpCode op) {
+  if (parser->checkOnly)
+    return;
+
+  trackStack(parser, op, 0);
+  if (parser->wordcode) {
+    writeWord(currentChunk(parser), MAKE_WORD(op, 0), parser->previous.line);
+  } else {
+    writeChunk(currentChunk(parser), op, parser->previous.line);
+  }
+}
+
+static void emitOpArg(Parser *parser, OpCode op, int arg) {
+  if (parser->checkOnly)
+    return;
+
+  trackStack(parser, op, arg);
+  if (parser->wordcode) {
+    writeWord(currentChunk(parser), MAKE_WORD(op, arg), parser->previous.line);
+  } else {
+    writeChunk(currentChunk(parser), op, parser->previous.line);
+    writeChunk(currentChunk(parser), arg, parser->previous.line);
+  }
+}
+
+// Emits an instruction taking a constant index, switching to its _LONG form
+// when the index doesn't fit in a byte.
+static void emitConstantOp(Parser *parser, OpCode op, OpCode longOp,
+                           int index) {
+  if (parser->checkOnly)
+    return;
+
+  if (parser->wordcode || index <= UINT8_MAX) {
+    emitOpArg(parser, op, index);
+    return;
+  }
+
+  trackStack(parser, longOp, index);
+  Chunk *chunk = currentChunk(parser);
+  int line     = parser->previous.line;
+  writeChunk(chunk, longOp, line);
+  writeChunk(chunk, (index >> 16) & 0xff, line);
+  writeChunk(chunk, (index >> 8) & 0xff, line);
+  writeChunk(chunk, index & 0xff, line);
+}
+
+static int emitJump(Parser *parser, OpCode jumpInstruction) {
+  if (parser->checkOnly)
+    return 0;
+
+  if (parser->wordcode) {
+    emitOpArg(parser, jumpInstruction, WORD_ARG_MAX);
+    return currentChunk(parser)->count - WORD_BYTES;
+  }
+
+  emitOp(parser, jumpInstruction);
 
   // Write 2-byte placeholder operand for the given jump instruction
-  emitByte(parser, 0xff);
-  emitByte(parser, 0xff);
+  writeChunk(currentChunk(parser), 0xff, parser->previous.line);
+  writeChunk(currentChunk(parser), 0xff, parser->previous.line);
 
   // Return the offset of the jump instruction in the written chunk
   return currentChunk(parser)->count - JMP_OPERAND_BYTES;
 }
 
 static void emitLoop(Parser *parser, int loopStart) {
-  emitByte(parser, OP_LOOP);
+  if (parser->checkOnly)
+    return;
+
+  if (parser->wordcode) {
+    int words = (currentChunk(parser)->count - loopStart) / WORD_BYTES + 1;
+    if (words > WORD_ARG_MAX) {
+      errorAtPrevious(parser, "Loop body too large.");
+    }
+
+    emitOpArg(parser, OP_LOOP, words & WORD_ARG_MAX);
+    return;
+  }
+
+  emitOp(parser, OP_LOOP);
 
   int offset = currentChunk(parser)->count - loopStart + JMP_OPERAND_BYTES;
   if (offset > UINT16_MAX) {
     errorAtPrevious(parser, "Loop body too large.");
   }
 
-  emitByte(parser, (offset >> 8) & 0xff);
-  emitByte(parser, offset & 0xff);
+  writeChunk(currentChunk(parser), (offset >> 8) & 0xff, parser->previous.line);
+  writeChunk(currentChunk(parser), offset & 0xff, parser->previous.line);
 }
 
 static void emitReturn(Parser *parser) {
-  emitByte(parser, OP_NIL);
-  emitByte(parser, OP_RETURN);
+  emitOp(parser, OP_NIL);
+  emitOp(parser, OP_RETURN);
+}
+
+// When compiling finishes, pop itself off the stack and restore enclosing
+static void popCompiler(Parser *parser) {
+  FREE_ARRAY(&parser->vm->memStats, Local, parser->currentCompiler->locals,
+             parser->currentCompiler->localCapacity);
+  freeConstantMap(&parser->currentCompiler->constants);
+  parser->currentCompiler = parser->currentCompiler->enclosing;
 }
 
 static ObjFunction *endCompiler(Parser *parser) {
+  Compiler *compiler   = parser->currentCompiler;
+  compiler->stackDepth = compiler->localCount;
   emitReturn(parser);
-  ObjFunction *func = parser->currentCompiler->function;
+  ObjFunction *func = compiler->function;
+  func->maxSlots    = compiler->maxDepth;
 
 #ifdef DEBUG_PRINT_CODE
-  if (!parser->hadError) {
+  if (!parser->hadError && !parser->checkOnly) {
     char *name = func->name == NULL ? "<script>" : func->name->chars;
-    disassembleChunk(currentChunk(parser), name);
+    if (parser->wordcode) {
+      disassembleWordChunk(currentChunk(parser), name);
+    } else {
+      disassembleChunk(currentChunk(parser), name);
+    }
   }
 #endif
 
-  // When compiling finishes, pop itself off the stack and restore enclosing
-  parser->currentCompiler = parser->currentCompiler->enclosing;
+  popCompiler(parser);
   return func;
 }
 
@@ -230,7 +364,7 @@ static void endScope(Parser *parser) {
   while (compiler->localCount > 0 &&
          compiler->locals[compiler->localCount - 1].depth >
              compiler->scopeDepth) {
-    emitByte(parser, OP_POP);
+    emitOp(parser, OP_POP);
     compiler->localCount--;
   }
 }
@@ -244,17 +378,32 @@ static bool inGlobalScope(Parser *parser) {
 }
 
 static int makeConstant(Parser *parser, Value value) {
-  if (currentChunk(parser)->constants.count >= UINT8_MAX) {
-    // A byte for the index means we can only store 256 constants in a chunk.
+  if (parser->checkOnly)
+    return 0;
+
+  Chunk *chunk     = currentChunk(parser);
+  ConstantMap *map = &parser->currentCompiler->constants;
+
+  // Repeated numbers and strings share a constant
+  int index = findConstant(map, value);
+  if (index != -1)
+    return index;
+
+  // The index has to fit the operand: 24 bits, in _LONG forms or wordcode.
+  if (chunk->constants.count > LONG_OPERAND_MAX) {
     errorAtPrevious(parser, "Too many constants in one chunk.");
     return -1;
   }
 
-  int constantIndex = addConstant(currentChunk(parser), value);
-  return constantIndex;
+  index = addConstant(chunk, value);
+  mapConstant(map, value, index);
+  return index;
 }
 
 static int identifierConstant(Parser *parser, Token *name) {
+  if (parser->checkOnly)
+    return 0;
+
   Value nameVal = OBJ_VAL(copyString(parser->vm, name->start, name->length));
   return makeConstant(parser, nameVal);
 }
@@ -266,13 +415,28 @@ static bool identifiersEqual(Token *a, Token *b) {
 static void emitConstant(Parser *parser, Value value) {
   int constantIndex = makeConstant(parser, value);
   if (constantIndex != -1) {
-    emitBytes(parser, OP_CONSTANT, constantIndex);
+    emitConstantOp(parser, OP_CONSTANT, OP_CONSTANT_LONG, constantIndex);
   }
 }
 
 static void patchJump(Parser *parser, int offset) {
+  if (parser->checkOnly)
+    return;
+
   Chunk *chunk = currentChunk(parser);
 
+  if (parser->wordcode) {
+    // Wordcode jumps count words from the instruction after the jump.
+    int wordsToJump = (chunk->count - offset) / WORD_BYTES - 1;
+    if (wordsToJump > WORD_ARG_MAX) {
+      errorAtPrevious(parser, "too much code to jump over");
+    }
+
+    uint32_t word = MAKE_WORD(chunk->code[offset], wordsToJump & WORD_ARG_MAX);
+    memcpy(&chunk->code[offset], &word, WORD_BYTES);
+    return;
+  }
+
   // Adjust for the bytecode for the jump offset itself
   int bytesToJump = chunk->count - offset - JMP_OPERAND_BYTES;
 
@@ -288,15 +452,16 @@ static void patchJump(Parser *parser, int offset) {
 static void addLocal(Parser *parser, Token name) {
   Compiler *compiler = parser->currentCompiler;
 
-  // The operand index to a local variable instruction is limited to a byte
-  if (compiler->localCount > UINT8_MAX) {
+  // The operand index to a local variable instruction is limited to a byte.
+  // Wordcode locals may take half the VM's stack, leaving the rest for
+  // temporaries and the frames of calls.
+  int localsMax = parser->wordcode ? STACK_MAX / 2 : UINT8_MAX + 1;
+  if (compiler->localCount >= localsMax) {
     errorAtPrevious(parser, "Too many local variables in function.");
     return;
   }
 
-  Local *local = &compiler->locals[compiler->localCount++];
-  local->name  = name;
-  local->depth = -1;
+  pushLocal(parser, name);
 }
 
 // Walk the array of locals backwards to find the last declared variable with
@@ -326,7 +491,7 @@ static void parsePrecedence(Parser *parser, Precedence precedence);
 static ParseRule *getRule(TokenType type);
 
 static void number(Parser *parser, bool __attribute__((unused)) canAssign) {
-  double value = strtod(parser->previous.start, NULL);
+  double value = parseNumber(parser->previous.start, parser->previous.length);
   emitConstant(parser, NUM_VAL(value));
 }
 
@@ -343,8 +508,8 @@ static void unary(Parser *parser, bool __attribute__((unused)) canAssign) {
 
   // Emit operator instruction
   switch (opType) {
-    case TOK_MINUS: emitByte(parser, OP_NEGATE); break;
-    case TOK_BANG:  emitByte(parser, OP_NOT); break;
+    case TOK_MINUS: emitOp(parser, OP_NEGATE); break;
+    case TOK_BANG:  emitOp(parser, OP_NOT); break;
     default:        return;
   }
 }
@@ -360,30 +525,33 @@ static void binary(Parser *parser, bool __attribute__((unused)) canAssign) {
   parsePrecedence(parser, rule->precedence + 1);
 
   switch (opType) {
-    case TOK_PLUS:       emitByte(parser, OP_ADD); break;
-    case TOK_MINUS:      emitByte(parser, OP_SUBTRACT); break;
-    case TOK_STAR:       emitByte(parser, OP_MULTIPLY); break;
-    case TOK_SLASH:      emitByte(parser, OP_DIVIDE); break;
-    case TOK_BANG_EQ:    emitByte(parser, OP_NOT_EQ); break;
-    case TOK_GREATER:    emitByte(parser, OP_GREATER); break;
-    case TOK_GREATER_EQ: emitByte(parser, OP_GREATER_EQ); break;
-    case TOK_LESS:       emitByte(parser, OP_LESS); break;
-    case TOK_LESS_EQ:    emitByte(parser, OP_LESS_EQ); break;
-    case TOK_EQ:         emitByte(parser, OP_EQ); break;
+    case TOK_PLUS:       emitOp(parser, OP_ADD); break;
+    case TOK_MINUS:      emitOp(parser, OP_SUBTRACT); break;
+    case TOK_STAR:       emitOp(parser, OP_MULTIPLY); break;
+    case TOK_SLASH:      emitOp(parser, OP_DIVIDE); break;
+    case TOK_BANG_EQ:    emitOp(parser, OP_NOT_EQ); break;
+    case TOK_GREATER:    emitOp(parser, OP_GREATER); break;
+    case TOK_GREATER_EQ: emitOp(parser, OP_GREATER_EQ); break;
+    case TOK_LESS:       emitOp(parser, OP_LESS); break;
+    case TOK_LESS_EQ:    emitOp(parser, OP_LESS_EQ); break;
+    case TOK_EQ_EQ:      emitOp(parser, OP_EQ); break;
     default:             return;
   }
 }
 
 static void literal(Parser *parser, bool __attribute__((unused)) canAssign) {
   switch (parser->previous.type) {
-    case TOK_FALSE: emitByte(parser, OP_FALSE); break;
-    case TOK_TRUE:  emitByte(parser, OP_TRUE); break;
-    case TOK_NIL:   emitByte(parser, OP_NIL); break;
+    case TOK_FALSE: emitOp(parser, OP_FALSE); break;
+    case TOK_TRUE:  emitOp(parser, OP_TRUE); break;
+    case TOK_NIL:   emitOp(parser, OP_NIL); break;
     default:        return;
   }
 }
 
 static void string(Parser *parser, bool __attribute__((unused)) canAssign) {
+  if (parser->checkOnly)
+    return;
+
   // +1 and -2 trims leading/trailing quotation marks. Copying literal only.
   ObjString *s = copyString(parser->vm, parser->previous.start + 1,
                             parser->previous.length - 2);
@@ -392,28 +560,28 @@ static void string(Parser *parser, bool __attribute__((unused)) canAssign) {
 }
 
 static void namedVariable(Parser *parser, Token *name, bool canAssign) {
-  uint8_t getOp, setOp;
-  int opArg = resolveLocal(parser, name);
+  int local = resolveLocal(parser, name);
 
-  if (opArg != -1) {
-    getOp = OP_GET_LOCAL;
-    setOp = OP_SET_LOCAL;
-  } else {
-    opArg = identifierConstant(parser, name);
-    if (opArg == -1)
-      return;
-
-    getOp = OP_GET_GLOBAL;
-    setOp = OP_SET_GLOBAL;
+  if (local != -1) {
+    if (canAssign && match(parser, TOK_EQ)) {
+      expression(parser);
+      emitOpArg(parser, OP_SET_LOCAL, local);
+    } else {
+      emitOpArg(parser, OP_GET_LOCAL, local);
+    }
+    return;
   }
 
+  int global = identifierConstant(parser, name);
+  if (global == -1)
+    return;
+
   if (canAssign && match(parser, TOK_EQ)) {
     expression(parser);
-    emitBytes(parser, setOp, opArg);
-    return;
+    emitConstantOp(parser, OP_SET_GLOBAL, OP_SET_GLOBAL_LONG, global);
+  } else {
+    emitConstantOp(parser, OP_GET_GLOBAL, OP_GET_GLOBAL_LONG, global);
   }
-
-  emitBytes(parser, getOp, opArg);
 }
 
 static void variable(Parser *parser, bool canAssign) {
@@ -446,7 +614,7 @@ static void declareVariable(Parser *parser) {
 static void logicalAnd(Parser *parser, bool __attribute__((unused)) canAssign) {
   // Jump to the compiled right operand if the left operand is false
   int endJumpOffset = emitJump(parser, OP_JUMP_IF_FALSE);
-  emitByte(parser, OP_POP);
+  emitOp(parser, OP_POP);
 
   parsePrecedence(parser, PREC_AND);
 
@@ -463,7 +631,7 @@ static void logicalOr(Parser *parser, bool __attribute__((unused)) canAssign) {
   int endJumpOffset  = emitJump(parser, OP_JUMP);
 
   patchJump(parser, elseJumpOffset);
-  emitByte(parser, OP_POP);
+  emitOp(parser, OP_POP);
 
   parsePrecedence(parser, PREC_OR);
   patchJump(parser, endJumpOffset);
@@ -491,7 +659,7 @@ static uint8_t argumentList(Parser *parser) {
 
 static void call(Parser *parser, bool __attribute__((unused)) canAssign) {
   uint8_t argCount = argumentList(parser);
-  emitBytes(parser, OP_CALL, argCount);
+  emitOpArg(parser, OP_CALL, argCount);
 }
 
 // The table of parse rules that drives the parser.
@@ -594,13 +762,13 @@ static void markInitialized(Compiler *compiler) {
   compiler->locals[compiler->localCount - 1].depth = compiler->scopeDepth;
 }
 
-static void defineVariable(Parser *parser, uint8_t lexemeIndex) {
+static void defineVariable(Parser *parser, int lexemeIndex) {
   if (inLocalScope(parser)) {
     markInitialized(parser->currentCompiler);
     return;
   }
 
-  emitBytes(parser, OP_DEFINE_GLOBAL, lexemeIndex);
+  emitConstantOp(parser, OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, lexemeIndex);
 }
 
 static void expression(Parser *parser) {
@@ -637,10 +805,13 @@ static void blockStatement(Parser *parser) {
   consume(parser, TOK_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(Parser *parser, FunctionType type) {
-  Compiler compiler;
-  initCompiler(parser, &compiler, type);
-  beginScope(parser);
+// Compiles the parameters and body of the current compiler's function. With
+// lazy compiling, only the parameters are; the body is checked for errors and
+// its source saved.
+static void functionBody(Parser *parser, bool lazy) {
+  ObjFunction *func = parser->currentCompiler->function;
+  const char *start = parser->current.start;
+  int line          = parser->current.line;
 
   consume(parser, TOK_LEFT_PAREN, "expect '(' after function name");
   if (!check(parser, TOK_RIGHT_PAREN)) {
@@ -649,34 +820,72 @@ static void function(Parser *parser, FunctionType type) {
       if (parser->currentCompiler->function->arity > UINT8_MAX) {
         errorAtCurrent(parser, "can't have more than 255 parameters");
       }
-      uint8_t constantIndex = parseVariable(parser, "expect parameter name");
+      int constantIndex = parseVariable(parser, "expect parameter name");
       defineVariable(parser, constantIndex);
     } while (match(parser, TOK_COMMA));
   }
 
   consume(parser, TOK_RIGHT_PAREN, "expect ')' after parameters");
   consume(parser, TOK_LEFT_BRACE, "expect '{' after function body");
+  if (!lazy) {
+    blockStatement(parser);
+    return;
+  }
+
+  parser->checkOnly = true;
   blockStatement(parser);
+  parser->checkOnly = false;
+  if (parser->hadError)
+    return;
+
+  int length       = (int)(parser->previous.start + 1 - start);
+  func->lazySource = ALLOCATE(&parser->vm->memStats, char, length + 1);
+  memcpy(func->lazySource, start, length);
+  func->lazySource[length] = '\0';
+  func->lazyLength         = length;
+  func->lazyLine           = line;
+}
+
+static void function(Parser *parser, FunctionType type) {
+  // Functions in a checked body are parsed into one that is thrown away
+  ObjFunction discarded = {0};
+  ObjFunction *func     = &discarded;
+  if (!parser->checkOnly) {
+    func       = newFunction(parser->vm);
+    func->name = copyString(parser->vm, parser->previous.start,
+                            parser->previous.length);
+  }
+
+  Compiler compiler;
+  initCompiler(parser, &compiler, type, func);
+  beginScope(parser);
 
-  ObjFunction *func = endCompiler(parser);
-  emitBytes(parser, OP_CONSTANT, makeConstant(parser, OBJ_VAL(func)));
+  // A lazy function stays empty until compileLazy
+  if (parser->vm->lazyCompile && !parser->checkOnly) {
+    functionBody(parser, true);
+    popCompiler(parser);
+  } else {
+    functionBody(parser, false);
+    endCompiler(parser);
+  }
+  emitConstant(parser, OBJ_VAL(func));
 }
 
 static void funDeclaration(Parser *parser) {
-  uint8_t offset = parseVariable(parser, "expect function name");
+  int offset = parseVariable(parser, "expect function name");
   markInitialized(parser->currentCompiler);
   function(parser, TYPE_FUNCTION);
   defineVariable(parser, offset);
 }
 
 static void varDeclaration(Parser *parser) {
-  uint8_t globalLexemeIndex = parseVariable(parser, "Expect variable name.");
+  int globalLexemeIndex = parseVariable(parser, "Expect variable name.");
 
   if (match(parser, TOK_EQ)) {
     expression(parser);
   } else {
     // variables will be initialized with 'nil' by default if not given
-    emitByte(parser, OP_NIL);
+    emitOp(parser, OP_NIL);
   }
 
   consume(parser, TOK_SEMICOLON, "Expect ';' after variable declaration.");
@@ -687,7 +896,7 @@ static void varDeclaration(Parser *parser) {
 static void expressionStatement(Parser *parser) {
   expression(parser);
   consume(parser, TOK_SEMICOLON, "expect ';' after expresssion");
-  emitByte(parser, OP_POP);
+  emitOp(parser, OP_POP);
 }
 
 static void ifStatement(Parser *parser) {
@@ -698,15 +907,15 @@ static void ifStatement(Parser *parser) {
   // Emit the jump instruction with a placeholder, patched after statement.
   // Add OP_POP instruction to pop condition if we enter the 'then' statement.
   int thenJumpOffset = emitJump(parser, OP_JUMP_IF_FALSE);
-  emitByte(parser, OP_POP);
+  emitOp(parser, OP_POP);
   statement(parser);
 
   // Need to jump else branch statement to not fall through if cond truthy.
   // Add OP_POP instruction to pop condition if we enter the 'else' statement.
   int elseJumpOffset = emitJump(parser, OP_JUMP);
-  emitByte(parser, OP_POP);
 
   patchJump(parser, thenJumpOffset);
+  emitOp(parser, OP_POP);
 
   if (match(parser, TOK_ELSE)) {
     statement(parser);
@@ -725,13 +934,13 @@ static void whileStatement(Parser *parser) {
   // We jump out of the loop when its condition is false, otherwise each
   // iteration should jump back to the loop start.
   int exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
-  emitByte(parser, OP_POP);
+  emitOp(parser, OP_POP);
   statement(parser);
   emitLoop(parser, loopStart);
 
   // Patch the jump instruction operand, and pop the condition.
   patchJump(parser, exitJump);
-  emitByte(parser, OP_POP);
+  emitOp(parser, OP_POP);
 }
 
 static void forStatement(Parser *parser) {
@@ -755,7 +964,7 @@ static void forStatement(Parser *parser) {
 
     // Jump out of the loop if the condition is false.
     exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
-    emitByte(parser, OP_POP); // condition
+    emitOp(parser, OP_POP); // condition
   }
 
   // Increment - appears before loop body in bytecode but executes after it.
@@ -764,7 +973,7 @@ static void forStatement(Parser *parser) {
     int bodyJump       = emitJump(parser, OP_JUMP);
     int incrementStart = currentChunk(parser)->count;
     expression(parser);
-    emitByte(parser, OP_POP);
+    emitOp(parser, OP_POP);
     consume(parser, TOK_RIGHT_PAREN, "expect ')' after for clauses.");
 
     emitLoop(parser, loopStart);
@@ -779,7 +988,7 @@ static void forStatement(Parser *parser) {
   if (exitJump != -1) {
     // Patch the jump to the top of the loop i.e. before condition evaluation
     patchJump(parser, exitJump);
-    emitByte(parser, OP_POP); // condition
+    emitOp(parser, OP_POP); // condition
   }
 
   endScope(parser);
@@ -788,10 +997,13 @@ static void forStatement(Parser *parser) {
 static void printStatement(Parser *parser) {
   expression(parser);
   consume(parser, TOK_SEMICOLON, "expect ';' after value");
-  emitByte(parser, OP_PRINT);
+  emitOp(parser, OP_PRINT);
 }
 
 static void declarationStatement(Parser *parser) {
+  // Only locals are on the stack between statements
+  parser->currentCompiler->stackDepth = parser->currentCompiler->localCount;
+
   if (match(parser, TOK_FUN)) {
     funDeclaration(parser);
   } else if (match(parser, TOK_VAR)) {
@@ -815,11 +1027,13 @@ static void returnStatement(Parser *parser) {
   } else {
     expression(parser);
     consume(parser, TOK_SEMICOLON, "expect ';' after return value");
-    emitByte(parser, OP_RETURN);
+    emitOp(parser, OP_RETURN);
   }
 }
 
 static void statement(Parser *parser) {
+  parser->currentCompiler->stackDepth = parser->currentCompiler->localCount;
+
   if (match(parser, TOK_PRINT)) {
     printStatement(parser);
   } else if (match(parser, TOK_IF)) {
@@ -850,8 +1064,10 @@ ObjFunction *compile(VM *vm, const char *source) {
   parser.hadError        = false;
   parser.panicMode       = false;
   parser.scanner         = &scanner;
-  parser.currentCompiler = &compiler;
-  initCompiler(&parser, &compiler, TYPE_SCRIPT);
+  parser.currentCompiler = NULL;
+  parser.wordcode        = vm->mode == VM_WORDCODE;
+  parser.checkOnly       = false;
+  initCompiler(&parser, &compiler, TYPE_SCRIPT, newFunction(vm));
 
   advance(&parser);
 
@@ -860,5 +1076,48 @@ ObjFunction *compile(VM *vm, const char *source) {
   }
 
   ObjFunction *func = endCompiler(&parser);
-  return parser.hadError ? NULL : func;
+  if (parser.hadError)
+    return NULL;
+
+  packFunctions(vm, func);
+  return func;
+}
+
+bool compileLazy(VM *vm, ObjFunction *func) {
+  Scanner scanner;
+  initScanner(&scanner, func->lazySource);
+  scanner.line = func->lazyLine;
+
+  Compiler compiler;
+
+  Parser parser;
+  parser.vm              = vm;
+  parser.hadError        = false;
+  parser.panicMode       = false;
+  parser.scanner         = &scanner;
+  parser.currentCompiler = NULL;
+  parser.wordcode        = vm->mode == VM_WORDCODE;
+  parser.checkOnly       = false;
+  initCompiler(&parser, &compiler, TYPE_FUNCTION, func);
+  beginScope(&parser);
+
+  // The parameters are counted again
+  func->arity = 0;
+
+  advance(&parser);
+  functionBody(&parser, false);
+  consume(&parser, TOK_EOF, "Expect end of function.");
+  endCompiler(&parser);
+
+  // A body that fails to compile stays lazy, failing every call
+  if (parser.hadError) {
+    freeChunk(&func->chunk);
+    return false;
+  }
+
+  FREE_ARRAY(&vm->memStats, char, func->lazySource, func->lazyLength + 1);
+  func->lazySource = NULL;
+  func->lazyLength = 0;
+  packFunctions(vm, func);
+  return true;
 }
@@ -3,18 +3,60 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+
+static const char *opNames[OP_COUNT] = {
+    [OP_CONSTANT]           = "OP_CONSTANT",
+    [OP_CONSTANT_LONG]      = "OP_CONSTANT_LONG",
+    [OP_NIL]                = "OP_NIL",
+    [OP_TRUE]               = "OP_TRUE",
+    [OP_FALSE]              = "OP_FALSE",
+    [OP_POP]                = "OP_POP",
+    [OP_GET_LOCAL]          = "OP_GET_LOCAL",
+    [OP_SET_LOCAL]          = "OP_SET_LOCAL",
+    [OP_GET_GLOBAL]         = "OP_GET_GLOBAL",
+    [OP_GET_GLOBAL_LONG]    = "OP_GET_GLOBAL_LONG",
+    [OP_DEFINE_GLOBAL]      = "OP_DEFINE_GLOBAL",
+    [OP_DEFINE_GLOBAL_LONG] = "OP_DEFINE_GLOBAL_LONG",
+    [OP_SET_GLOBAL]         = "OP_SET_GLOBAL",
+    [OP_SET_GLOBAL_LONG]    = "OP_SET_GLOBAL_LONG",
+    [OP_EQ]                 = "OP_EQ",
+    [OP_NOT_EQ]             = "OP_NOT_EQ",
+    [OP_GREATER]            = "OP_GREATER",
+    [OP_GREATER_EQ]         = "OP_GREATER_EQ",
+    [OP_LESS]               = "OP_LESS",
+    [OP_LESS_EQ]            = "OP_LESS_EQ",
+    [OP_ADD]                = "OP_ADD",
+    [OP_SUBTRACT]           = "OP_SUBTRACT",
+    [OP_MULTIPLY]           = "OP_MULTIPLY",
+    [OP_DIVIDE]             = "OP_DIVIDE",
+    [OP_NOT]                = "OP_NOT",
+    [OP_NEGATE]             = "OP_NEGATE",
+    [OP_PRINT]              = "OP_PRINT",
+    [OP_JUMP]               = "OP_JUMP",
+    [OP_JUMP_IF_FALSE]      = "OP_JUMP_IF_FALSE",
+    [OP_LOOP]               = "OP_LOOP",
+    [OP_CALL]               = "OP_CALL",
+    [OP_RETURN]             = "OP_RETURN",
+};
+
+const char *opcodeName(uint8_t instruction) {
+  return instruction < OP_COUNT ? opNames[instruction] : "OP_UNKNOWN";
+}
 
 static int simpleInstruction(const char *name, int offset) {
   printf("%s\n", name);
   return offset + 1;
 }
 
+// Short and _LONG forms alike.
 static int constantInstruction(const char *name, Chunk *chunk, int offset) {
-  uint8_t constantIndex = chunk->code[offset + 1];
+  uint8_t *ip       = &chunk->code[offset];
+  int constantIndex = constantOperand(ip);
   printf("%-16s %4d '", name, constantIndex);
   printValue(chunk->constants.values[constantIndex]);
   printf("'\n");
-  return offset + 2;
+  return offset + constantInstructionBytes(*ip);
 }
 
 static int byteInstruction(const char *name, Chunk *chunk, int offset) {
@@ -46,15 +88,17 @@ int disassembleInstruction(Chunk *chunk, int offset) {
   printf("%04d ", offset);
 
   // Use a '|' for any instruction coming from same source line as preceding.
-  if (offset > 0 && chunk->lines[offset] == chunk->lines[offset] - 1) {
+  if (offset > 0 && getLine(chunk, offset) == getLine(chunk, offset - 1)) {
     printf("   | ");
   } else {
-    printf("%4d ", chunk->lines[offset]);
+    printf("%4d ", getLine(chunk, offset));
   }
 
   uint8_t instruction = chunk->code[offset];
   switch (instruction) {
     case OP_CONSTANT:  return constantInstruction("OP_CONSTANT", chunk, offset);
+    case OP_CONSTANT_LONG:
+      return constantInstruction("OP_CONSTANT_LONG", chunk, offset);
     case OP_NIL:       return simpleInstruction("OP_NIL", offset);
     case OP_TRUE:      return simpleInstruction("OP_TRUE", offset);
     case OP_FALSE:     return simpleInstruction("OP_FALSE", offset);
@@ -63,10 +107,16 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     case OP_SET_LOCAL: return byteInstruction("OP_SET_LOCAL", chunk, offset);
     case OP_GET_GLOBAL:
       return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+    case OP_GET_GLOBAL_LONG:
+      return constantInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
     case OP_DEFINE_GLOBAL:
       return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+    case OP_DEFINE_GLOBAL_LONG:
+      return constantInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
     case OP_SET_GLOBAL:
       return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+    case OP_SET_GLOBAL_LONG:
+      return constantInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
     case OP_EQ:         return simpleInstruction("OP_EQ", offset);
     case OP_NOT_EQ:     return simpleInstruction("OP_NOT_EQ", offset);
     case OP_GREATER:    return simpleInstruction("OP_GREATER", offset);
@@ -89,3 +139,181 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     default:        printf("Unknown opcode %d\n", instruction); return offset + 1;
   }
 }
+
+static uint32_t readWord(Chunk *chunk, int offset) {
+  uint32_t word;
+  memcpy(&word, &chunk->code[offset], WORD_BYTES);
+  return word;
+}
+
+static int simpleWord(const char *name, int offset) {
+  printf("%s\n", name);
+  return offset + WORD_BYTES;
+}
+
+static int constantWord(const char *name, Chunk *chunk, int offset) {
+  uint32_t constantIndex = WORD_ARG(readWord(chunk, offset));
+  printf("%-16s %4u '", name, constantIndex);
+  printValue(chunk->constants.values[constantIndex]);
+  printf("'\n");
+  return offset + WORD_BYTES;
+}
+
+static int operandWord(const char *name, Chunk *chunk, int offset) {
+  printf("%-16s %4u\n", name, WORD_ARG(readWord(chunk, offset)));
+  return offset + WORD_BYTES;
+}
+
+static int jumpWord(const char *name, int sign, Chunk *chunk, int offset) {
+  int words = (int)WORD_ARG(readWord(chunk, offset));
+  printf("%-16s %4d -> %d\n", name, offset,
+         offset + WORD_BYTES + sign * words * WORD_BYTES);
+  return offset + WORD_BYTES;
+}
+
+void disassembleWordChunk(Chunk *chunk, const char *name) {
+  printf("== %s (wordcode) ==\n", name);
+
+  int offset = 0;
+  while (offset < chunk->count) {
+    offset = disassembleWordInstruction(chunk, offset);
+  }
+}
+
+int disassembleWordInstruction(Chunk *chunk, int offset) {
+  printf("%04d ", offset);
+
+  if (offset > 0 && getLine(chunk, offset) == getLine(chunk, offset - 1)) {
+    printf("   | ");
+  } else {
+    printf("%4d ", getLine(chunk, offset));
+  }
+
+  uint8_t instruction = WORD_OP(readWord(chunk, offset));
+  switch (instruction) {
+    case OP_CONSTANT:   return constantWord("OP_CONSTANT", chunk, offset);
+    case OP_NIL:        return simpleWord("OP_NIL", offset);
+    case OP_TRUE:       return simpleWord("OP_TRUE", offset);
+    case OP_FALSE:      return simpleWord("OP_FALSE", offset);
+    case OP_POP:        return simpleWord("OP_POP", offset);
+    case OP_GET_LOCAL:  return operandWord("OP_GET_LOCAL", chunk, offset);
+    case OP_SET_LOCAL:  return operandWord("OP_SET_LOCAL", chunk, offset);
+    case OP_GET_GLOBAL: return constantWord("OP_GET_GLOBAL", chunk, offset);
+    case OP_DEFINE_GLOBAL:
+      return constantWord("OP_DEFINE_GLOBAL", chunk, offset);
+    case OP_SET_GLOBAL: return constantWord("OP_SET_GLOBAL", chunk, offset);
+    case OP_EQ:         return simpleWord("OP_EQ", offset);
+    case OP_NOT_EQ:     return simpleWord("OP_NOT_EQ", offset);
+    case OP_GREATER:    return simpleWord("OP_GREATER", offset);
+    case OP_GREATER_EQ: return simpleWord("OP_GREATER_EQ", offset);
+    case OP_LESS:       return simpleWord("OP_LESS", offset);
+    case OP_LESS_EQ:    return simpleWord("OP_LESS_EQ", offset);
+    case OP_ADD:        return simpleWord("OP_ADD", offset);
+    case OP_SUBTRACT:   return simpleWord("OP_SUBTRACT", offset);
+    case OP_MULTIPLY:   return simpleWord("OP_MULTIPLY", offset);
+    case OP_DIVIDE:     return simpleWord("OP_DIVIDE", offset);
+    case OP_NOT:        return simpleWord("OP_NOT", offset);
+    case OP_NEGATE:     return simpleWord("OP_NEGATE", offset);
+    case OP_PRINT:      return simpleWord("OP_PRINT", offset);
+    case OP_JUMP:       return jumpWord("OP_JUMP", 1, chunk, offset);
+    case OP_JUMP_IF_FALSE:
+      return jumpWord("OP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_LOOP:   return jumpWord("OP_LOOP", -1, chunk, offset);
+    case OP_RETURN: return simpleWord("OP_RETURN", offset);
+    case OP_CALL:   return operandWord("OP_CALL", chunk, offset);
+    default:
+      printf("Unknown opcode %d\n", instruction);
+      return offset + WORD_BYTES;
+  }
+}
+
+static int regABCInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t *ip = &chunk->code[offset];
+  printf("%-16s %4d %4d %4d\n", name, ip[1], ip[2], ip[3]);
+  return offset + REG_INSTRUCTION_BYTES;
+}
+
+static int regAInstruction(const char *name, Chunk *chunk, int offset) {
+  printf("%-16s %4d\n", name, chunk->code[offset + 1]);
+  return offset + REG_INSTRUCTION_BYTES;
+}
+
+static int regConstantInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t *ip            = &chunk->code[offset];
+  uint16_t constantIndex = (uint16_t)(ip[2] << 8 | ip[3]);
+  printf("%-16s %4d %4d '", name, ip[1], constantIndex);
+  printValue(chunk->constants.values[constantIndex]);
+  printf("'\n");
+  return offset + REG_INSTRUCTION_BYTES;
+}
+
+static int regJumpInstruction(const char *name, int sign, Chunk *chunk,
+                              int offset) {
+  uint8_t *ip   = &chunk->code[offset];
+  uint16_t jump = (uint16_t)(ip[2] << 8 | ip[3]);
+  int target    = offset + REG_INSTRUCTION_BYTES + sign * jump;
+  printf("%-16s %4d %4d -> %d\n", name, ip[1], offset, target);
+  return offset + REG_INSTRUCTION_BYTES;
+}
+
+void disassembleRegChunk(Chunk *chunk, const char *name) {
+  printf("== %s (registers) ==\n", name);
+
+  int offset = 0;
+  while (offset < chunk->count) {
+    offset = disassembleRegInstruction(chunk, offset);
+  }
+}
+
+int disassembleRegInstruction(Chunk *chunk, int offset) {
+  printf("%04d ", offset);
+
+  if (offset > 0 && getLine(chunk, offset) == getLine(chunk, offset - 1)) {
+    printf("   | ");
+  } else {
+    printf("%4d ", getLine(chunk, offset));
+  }
+
+  uint8_t instruction = chunk->code[offset];
+  switch (instruction) {
+    case ROP_MOVE:  return regABCInstruction("ROP_MOVE", chunk, offset);
+    case ROP_LOADK: return regConstantInstruction("ROP_LOADK", chunk, offset);
+    case ROP_NIL:   return regAInstruction("ROP_NIL", chunk, offset);
+    case ROP_TRUE:  return regAInstruction("ROP_TRUE", chunk, offset);
+    case ROP_FALSE: return regAInstruction("ROP_FALSE", chunk, offset);
+    case ROP_GET_GLOBAL:
+      return regConstantInstruction("ROP_GET_GLOBAL", chunk, offset);
+    case ROP_DEFINE_GLOBAL:
+      return regConstantInstruction("ROP_DEFINE_GLOBAL", chunk, offset);
+    case ROP_SET_GLOBAL:
+      return regConstantInstruction("ROP_SET_GLOBAL", chunk, offset);
+    case ROP_EQ:     return regABCInstruction("ROP_EQ", chunk, offset);
+    case ROP_NOT_EQ: return regABCInstruction("ROP_NOT_EQ", chunk, offset);
+    case ROP_GREATER: return regABCInstruction("ROP_GREATER", chunk, offset);
+    case ROP_GREATER_EQ:
+      return regABCInstruction("ROP_GREATER_EQ", chunk, offset);
+    case ROP_LESS:     return regABCInstruction("ROP_LESS", chunk, offset);
+    case ROP_LESS_EQ:  return regABCInstruction("ROP_LESS_EQ", chunk, offset);
+    case ROP_ADD:      return regABCInstruction("ROP_ADD", chunk, offset);
+    case ROP_SUBTRACT: return regABCInstruction("ROP_SUBTRACT", chunk, offset);
+    case ROP_MULTIPLY: return regABCInstruction("ROP_MULTIPLY", chunk, offset);
+    case ROP_DIVIDE:   return regABCInstruction("ROP_DIVIDE", chunk, offset);
+    case ROP_NOT:      return regABCInstruction("ROP_NOT", chunk, offset);
+    case ROP_NEGATE:   return regABCInstruction("ROP_NEGATE", chunk, offset);
+    case ROP_PRINT:    return regAInstruction("ROP_PRINT", chunk, offset);
+    case ROP_JUMP:
+      return regJumpInstruction("ROP_JUMP", 1, chunk, offset);
+    case ROP_JUMP_IF_FALSE:
+      return regJumpInstruction("ROP_JUMP_IF_FALSE", 1, chunk, offset);
+    case ROP_JUMP_IF_TRUE:
+      return regJumpInstruction("ROP_JUMP_IF_TRUE", 1, chunk, offset);
+    case ROP_LOOP:   return regJumpInstruction("ROP_LOOP", -1, chunk, offset);
+    case ROP_CALL:   return regABCInstruction("ROP_CALL", chunk, offset);
+    case ROP_RETURN: return regAInstruction("ROP_RETURN", chunk, offset);
+    case ROP_RETURN_NIL:
+      return regAInstruction("ROP_RETURN_NIL", chunk, offset);
+    default:
+      printf("Unknown opcode %d\n", instruction);
+      return offset + REG_INSTRUCTION_BYTES;
+  }
+}
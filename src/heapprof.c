@@ -0,0 +1,248 @@
+#include "heapprof.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SITES_MAX_LOAD 0.75
+
+// Number of groups printed by printHeapSnapshot.
+#define SNAPSHOT_TOP 20
+
+HeapProfile *newHeapProfile(MemStats *stats) {
+  HeapProfile *profile = ALLOCATE(stats, HeapProfile, 1);
+  profile->sites       = NULL;
+  profile->count       = 0;
+  profile->capacity    = 0;
+  profile->stats       = stats;
+  return profile;
+}
+
+void freeHeapProfile(HeapProfile *profile) {
+  MemStats *stats = profile->stats;
+  FREE_ARRAY(stats, AllocSite, profile->sites, profile->capacity);
+  FREE(stats, HeapProfile, profile);
+}
+
+static uint32_t hashPointer(Obj *obj) {
+  uintptr_t bits = (uintptr_t)obj >> 3;
+  return (uint32_t)(bits ^ (bits >> 32)) * 2654435761u;
+}
+
+static AllocSite *findSite(AllocSite *sites, int capacity, Obj *obj) {
+  uint32_t index = hashPointer(obj) & (capacity - 1);
+
+  while (sites[index].obj != NULL && sites[index].obj != obj) {
+    index = (index + 1) & (capacity - 1);
+  }
+
+  return &sites[index];
+}
+
+static void growSites(HeapProfile *profile) {
+  int capacity     = GROW_CAPACITY(profile->capacity);
+  AllocSite *sites = ALLOCATE(profile->stats, AllocSite, capacity);
+  memset(sites, 0, sizeof(AllocSite) * capacity);
+
+  for (int i = 0; i < profile->capacity; i++) {
+    AllocSite *site = &profile->sites[i];
+    if (site->obj != NULL)
+      *findSite(sites, capacity, site->obj) = *site;
+  }
+
+  FREE_ARRAY(profile->stats, AllocSite, profile->sites, profile->capacity);
+  profile->sites    = sites;
+  profile->capacity = capacity;
+}
+
+void recordAllocation(HeapProfile *profile, VM *vm, Obj *obj) {
+  if (profile->count + 1 > profile->capacity * SITES_MAX_LOAD)
+    growSites(profile);
+
+  ObjFunction *func = NULL;
+  int line          = 0;
+
+  // Frames only exist while running; the compiler allocates with none
+  if (vm->frameCount > 0) {
+    CallFrame *frame = &vm->frames[vm->frameCount - 1];
+    long index       = frame->ip - frame->function->chunk.code - 1;
+    func             = frame->function;
+    if (index >= 0 && index < func->chunk.count)
+      line = getLine(&func->chunk, index);
+  }
+
+  AllocSite *site = findSite(profile->sites, profile->capacity, obj);
+  if (site->obj == NULL)
+    profile->count++;
+  *site = (AllocSite){obj, func, line};
+}
+
+// Bytes the object keeps alive, including the arrays it owns.
+static size_t retainedSize(Obj *obj) {
+  switch (obj->type) {
+    case OBJ_STRING:
+      return sizeof(ObjString) + ((ObjString *)obj)->length + 1;
+    case OBJ_FUNCTION: {
+      // Packed chunks have no spare capacity, so count what's in use
+      Chunk *chunk = &((ObjFunction *)obj)->chunk;
+      return sizeof(ObjFunction) + chunk->count +
+             chunk->lineCount * sizeof(LineRun) +
+             chunk->constants.count * sizeof(Value);
+    }
+    case OBJ_NATIVE: return sizeof(ObjNative);
+  }
+
+  return 0;
+}
+
+static const char *typeName(ObjType type) {
+  switch (type) {
+    case OBJ_STRING:   return "string";
+    case OBJ_FUNCTION: return "function";
+    case OBJ_NATIVE:   return "native";
+  }
+
+  return "?";
+}
+
+// Live objects of one type allocated at one site.
+typedef struct heap_group {
+  ObjType type;
+  bool known;        // False for objects allocated before profiling started
+  ObjFunction *func; // NULL for the compiler
+  int line;
+  unsigned long objects;
+  size_t bytes;
+} HeapGroup;
+
+typedef struct heap_groups {
+  HeapGroup *groups;
+  int count;
+  int capacity;
+  size_t bytes;
+  unsigned long objects;
+  MemStats *stats;
+} HeapGroups;
+
+static int compareGroups(const void *a, const void *b) {
+  const HeapGroup *groupA = a, *groupB = b;
+  if (groupA->bytes != groupB->bytes)
+    return groupA->bytes < groupB->bytes ? 1 : -1;
+  return groupA->objects < groupB->objects   ? 1
+         : groupA->objects > groupB->objects ? -1
+                                             : 0;
+}
+
+static void takeSnapshot(VM *vm, HeapGroups *snapshot) {
+  HeapProfile *profile = vm->heapProfile;
+  memset(snapshot, 0, sizeof(HeapGroups));
+  snapshot->stats = &vm->memStats;
+
+  for (Obj *obj = vm->objects; obj != NULL; obj = obj->next) {
+    AllocSite *site = profile->capacity == 0
+                          ? NULL
+                          : findSite(profile->sites, profile->capacity, obj);
+    bool known        = site != NULL && site->obj == obj;
+    ObjFunction *func = known ? site->func : NULL;
+    int line          = known ? site->line : 0;
+    size_t bytes      = retainedSize(obj);
+
+    snapshot->objects++;
+    snapshot->bytes += bytes;
+
+    // Groups are few next to objects, so a linear search does
+    int i = 0;
+    while (i < snapshot->count) {
+      HeapGroup *group = &snapshot->groups[i];
+      if (group->type == obj->type && group->known == known &&
+          group->func == func && group->line == line)
+        break;
+      i++;
+    }
+
+    if (i == snapshot->count) {
+      if (snapshot->count >= snapshot->capacity) {
+        int oldCap         = snapshot->capacity;
+        snapshot->capacity = GROW_CAPACITY(oldCap);
+        snapshot->groups   = GROW_ARRAY(snapshot->stats, HeapGroup,
+                                        snapshot->groups, oldCap,
+                                        snapshot->capacity);
+      }
+      snapshot->groups[snapshot->count++] =
+          (HeapGroup){obj->type, known, func, line, 0, 0};
+    }
+
+    snapshot->groups[i].objects++;
+    snapshot->groups[i].bytes += bytes;
+  }
+
+  qsort(snapshot->groups, snapshot->count, sizeof(HeapGroup), compareGroups);
+}
+
+static void freeSnapshot(HeapGroups *snapshot) {
+  FREE_ARRAY(snapshot->stats, HeapGroup, snapshot->groups,
+             snapshot->capacity);
+}
+
+// Formats the group's allocation site into the buffer.
+static const char *siteName(HeapGroup *group, char *buffer, size_t size) {
+  if (!group->known) {
+    snprintf(buffer, size, "<before profiling>");
+  } else if (group->func == NULL) {
+    snprintf(buffer, size, "<compile>");
+  } else {
+    snprintf(buffer, size, "%s:%d",
+             group->func->name == NULL ? "<script>"
+                                       : group->func->name->chars,
+             group->line);
+  }
+
+  return buffer;
+}
+
+void printHeapSnapshot(VM *vm, FILE *out) {
+  HeapGroups snapshot;
+  takeSnapshot(vm, &snapshot);
+
+  fprintf(out, "== Heap: %lu live objects, %zu bytes ==\n", snapshot.objects,
+          snapshot.bytes);
+  fprintf(out, "%12s %10s  %-8s  %s\n", "bytes", "objects", "type", "site");
+  for (int i = 0; i < snapshot.count && i < SNAPSHOT_TOP; i++) {
+    HeapGroup *group = &snapshot.groups[i];
+    char site[160];
+    fprintf(out, "%12zu %10lu  %-8s  %s\n", group->bytes, group->objects,
+            typeName(group->type), siteName(group, site, sizeof(site)));
+  }
+
+  freeSnapshot(&snapshot);
+}
+
+bool writeHeapSnapshot(VM *vm, const char *path) {
+  FILE *out = fopen(path, "w");
+  if (out == NULL)
+    return false;
+
+  HeapGroups snapshot;
+  takeSnapshot(vm, &snapshot);
+
+  // Sites are identifiers, a line number or <...>, so never need escaping
+  fprintf(out, "{\n  \"objects\": %lu,\n  \"bytes\": %zu,\n  \"groups\": [",
+          snapshot.objects, snapshot.bytes);
+  for (int i = 0; i < snapshot.count; i++) {
+    HeapGroup *group = &snapshot.groups[i];
+    char site[160];
+    fprintf(out,
+            "%s\n    {\"type\": \"%s\", \"site\": \"%s\", \"objects\": %lu, "
+            "\"bytes\": %zu}",
+            i == 0 ? "" : ",", typeName(group->type),
+            siteName(group, site, sizeof(site)), group->objects, group->bytes);
+  }
+  fprintf(out, "\n  ]\n}\n");
+
+  freeSnapshot(&snapshot);
+  return fclose(out) == 0;
+}
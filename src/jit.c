@@ -0,0 +1,540 @@
+#include "jit.h"
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "probes.h"
+#include "value.h"
+#include "vm.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if JIT_SUPPORTED
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * A baseline compiler from stack bytecode to x86-64 machine code.
+ *
+ * Every instruction is translated on its own into a template that works on
+ * the VM stack in memory, exactly like the interpreter. Moving values, jumps
+ * and arithmetic or comparisons on numbers are done inline; everything else
+ * calls the vm* helper of the same instruction. Throughout the code:
+ *
+ *   rbx = VM *, r12 = CallFrame *, r13 = the frame's slots
+ *
+ * The compiled function is entered as
+ *   InterpretResult code(VM *vm, CallFrame *frame, void *entry)
+ * and jumps straight to `entry`, the code of some bytecode instruction.
+ */
+
+typedef InterpretResult (*JitFn)(VM *vm, CallFrame *frame, void *entry);
+
+// A rel32 jump operand waiting for the address of a bytecode instruction.
+typedef struct fixup {
+  int at;     // Offset of the operand in the machine code
+  int target; // Bytecode offset being jumped to
+} Fixup;
+
+typedef struct assembler {
+  uint8_t *code;
+  int count;
+  int capacity;
+  Fixup *fixups;
+  int fixupCount;
+  int fixupCapacity;
+  int errorExit; // Returns INTERPRET_RUNTIME_ERR
+  int okExit;    // Returns INTERPRET_OK
+  MemStats *stats;
+} Assembler;
+
+#define VM_TOP      ((int32_t)offsetof(VM, stackTop))
+#define FRAME_IP    ((int32_t)offsetof(CallFrame, ip))
+#define FRAME_SLOTS ((int32_t)offsetof(CallFrame, slots))
+
+// Offsets of a value's type tag and payload, relative to the stack top.
+#define TOP_TYPE(n) ((int8_t)(-(n) * (int)sizeof(Value)))
+#define TOP_AS(n)   ((int8_t)(-(n) * (int)sizeof(Value) + 8))
+
+_Static_assert(sizeof(Value) == 16, "JIT expects 16-byte values");
+_Static_assert(offsetof(Value, as) == 8, "JIT expects the payload at 8");
+_Static_assert(sizeof(ValueType) == 4, "JIT expects 32-bit type tags");
+
+#define EMIT(as, ...)                                    \
+  emitBytes(as, (const uint8_t[]){__VA_ARGS__},          \
+            sizeof((const uint8_t[]){__VA_ARGS__}))
+
+static void emitBytes(Assembler *as, const uint8_t *bytes, int n) {
+  if (as->count + n > as->capacity) {
+    int oldCap    = as->capacity;
+    as->capacity  = GROW_CAPACITY(oldCap);
+    while (as->capacity < as->count + n)
+      as->capacity *= 2;
+    as->code = GROW_ARRAY(as->stats, uint8_t, as->code, oldCap, as->capacity);
+  }
+
+  memcpy(&as->code[as->count], bytes, n);
+  as->count += n;
+}
+
+static void emit32(Assembler *as, uint32_t value) {
+  emitBytes(as, (const uint8_t *)&value, 4);
+}
+
+static void emit64(Assembler *as, uint64_t value) {
+  emitBytes(as, (const uint8_t *)&value, 8);
+}
+
+static void patch32(Assembler *as, int at, int32_t value) {
+  memcpy(&as->code[at], &value, 4);
+}
+
+// Emits a rel8 jump placeholder, returning its operand offset for patch8.
+static int emitShortJump(Assembler *as, uint8_t opcode) {
+  EMIT(as, opcode, 0);
+  return as->count - 1;
+}
+
+// Points a rel8 jump at the next instruction to be emitted.
+static void patch8(Assembler *as, int at) {
+  as->code[at] = (uint8_t)(as->count - (at + 1));
+}
+
+// Emits a rel32 jump to machine code that has already been emitted.
+static void emitJumpBack(Assembler *as, const uint8_t *op, int opLen,
+                         int target) {
+  emitBytes(as, op, opLen);
+  emit32(as, (uint32_t)(target - (as->count + 4)));
+}
+
+static void jumpToError(Assembler *as) {
+  emitJumpBack(as, (const uint8_t[]){0x0f, 0x84}, 2, as->errorExit); // jz
+}
+
+// Emits a rel32 jump to the code of a bytecode instruction.
+static void emitJumpTo(Assembler *as, const uint8_t *op, int opLen,
+                       int bytecodeTarget) {
+  emitBytes(as, op, opLen);
+
+  if (as->fixupCount >= as->fixupCapacity) {
+    int oldCap        = as->fixupCapacity;
+    as->fixupCapacity = GROW_CAPACITY(oldCap);
+    as->fixups =
+        GROW_ARRAY(as->stats, Fixup, as->fixups, oldCap, as->fixupCapacity);
+  }
+
+  as->fixups[as->fixupCount++] = (Fixup){as->count, bytecodeTarget};
+  emit32(as, 0);
+}
+
+static void loadTop(Assembler *as) {
+  EMIT(as, 0x48, 0x8b, 0x83); // mov rax, [rbx + VM_TOP]
+  emit32(as, VM_TOP);
+}
+
+static void storeTop(Assembler *as) {
+  EMIT(as, 0x48, 0x89, 0x83); // mov [rbx + VM_TOP], rax
+  emit32(as, VM_TOP);
+}
+
+// Adjusts rax, holding the stack top, by a number of values.
+static void moveTop(Assembler *as, int values) {
+  if (values > 0) {
+    EMIT(as, 0x48, 0x83, 0xc0, (uint8_t)(values * sizeof(Value))); // add
+  } else {
+    EMIT(as, 0x48, 0x83, 0xe8, (uint8_t)(-values * sizeof(Value))); // sub
+  }
+}
+
+// Records where the instruction ends, as runtime errors and calls need it.
+static void saveIp(Assembler *as, uint8_t *ip) {
+  EMIT(as, 0x48, 0xb8); // mov rax, imm64
+  emit64(as, (uint64_t)(uintptr_t)ip);
+  EMIT(as, 0x49, 0x89, 0x84, 0x24); // mov [r12 + FRAME_IP], rax
+  emit32(as, FRAME_IP);
+}
+
+static void callHelper(Assembler *as, void *helper) {
+  EMIT(as, 0x48, 0x89, 0xdf); // mov rdi, rbx
+  EMIT(as, 0x48, 0xb8);       // mov rax, imm64
+  emit64(as, (uint64_t)(uintptr_t)helper);
+  EMIT(as, 0xff, 0xd0); // call rax
+}
+
+static void callHelperWith(Assembler *as, void *helper, uint64_t arg) {
+  EMIT(as, 0x48, 0xbe); // mov rsi, imm64
+  emit64(as, arg);
+  callHelper(as, helper);
+}
+
+// Calls a helper returning false on a runtime error.
+static void callChecked(Assembler *as, uint8_t *ip, void *helper) {
+  saveIp(as, ip);
+  callHelper(as, helper);
+  EMIT(as, 0x84, 0xc0); // test al, al
+  jumpToError(as);
+}
+
+static void pushValue(Assembler *as, Value value) {
+  uint64_t words[2];
+  memcpy(words, &value, sizeof(Value));
+
+  loadTop(as);
+  EMIT(as, 0x48, 0xb9); // mov rcx, imm64
+  emit64(as, words[0]);
+  EMIT(as, 0x48, 0x89, 0x08); // mov [rax], rcx
+  EMIT(as, 0x48, 0xb9);       // mov rcx, imm64
+  emit64(as, words[1]);
+  EMIT(as, 0x48, 0x89, 0x48, 0x08); // mov [rax + 8], rcx
+  moveTop(as, 1);
+  storeTop(as);
+}
+
+// Jumps to the returned rel8 operand unless the top two values are numbers.
+// Leaves the stack top in rax.
+static void checkNumbers(Assembler *as, int slowJumps[2]) {
+  loadTop(as);
+  EMIT(as, 0x83, 0x78, TOP_TYPE(2), VAL_NUM); // cmp dword [rax - 32], NUM
+  slowJumps[0] = emitShortJump(as, 0x75);     // jne slow
+  EMIT(as, 0x83, 0x78, TOP_TYPE(1), VAL_NUM); // cmp dword [rax - 16], NUM
+  slowJumps[1] = emitShortJump(as, 0x75);     // jne slow
+}
+
+// Emits a binary operator with an inline path for two numbers. `sseOp` is
+// the scalar double instruction (addsd, subsd, ...), or 0 for comparisons
+// which use `setcc` instead.
+static void binaryOp(Assembler *as, uint8_t *ip, void *helper, uint8_t sseOp,
+                     uint8_t setcc, bool swapped) {
+  int slow[2];
+  checkNumbers(as, slow);
+
+  if (sseOp != 0) {
+    EMIT(as, 0xf2, 0x0f, 0x10, 0x40, TOP_AS(2)); // movsd xmm0, [a]
+    EMIT(as, 0xf2, 0x0f, sseOp, 0x40, TOP_AS(1)); // OPsd xmm0, [b]
+    EMIT(as, 0xf2, 0x0f, 0x11, 0x40, TOP_AS(2)); // movsd [a], xmm0
+  } else {
+    // a < b and a <= b are computed as b > a and b >= a, which are also
+    // false when either side is NaN.
+    int8_t lhs = swapped ? TOP_AS(1) : TOP_AS(2);
+    int8_t rhs = swapped ? TOP_AS(2) : TOP_AS(1);
+    EMIT(as, 0xf2, 0x0f, 0x10, 0x40, lhs); // movsd xmm0, [lhs]
+    EMIT(as, 0x66, 0x0f, 0x2e, 0x40, rhs); // ucomisd xmm0, [rhs]
+    EMIT(as, 0x0f, setcc, 0xc1);           // setcc cl
+    EMIT(as, 0xc7, 0x40, TOP_TYPE(2));     // mov dword [a.type], BOOL
+    emit32(as, VAL_BOOL);
+    EMIT(as, 0x88, 0x48, TOP_AS(2)); // mov byte [a.as], cl
+  }
+
+  moveTop(as, -1);
+  storeTop(as);
+  int done = emitShortJump(as, 0xeb); // jmp done
+
+  patch8(as, slow[0]);
+  patch8(as, slow[1]);
+  callChecked(as, ip, helper);
+  patch8(as, done);
+}
+
+static void negate(Assembler *as, uint8_t *ip) {
+  loadTop(as);
+  EMIT(as, 0x83, 0x78, TOP_TYPE(1), VAL_NUM); // cmp dword [rax - 16], NUM
+  int slow = emitShortJump(as, 0x75);         // jne slow
+  EMIT(as, 0x48, 0x0f, 0xba, 0x78, TOP_AS(1), 63); // btc qword [rax - 8], 63
+  int done = emitShortJump(as, 0xeb);              // jmp done
+
+  patch8(as, slow);
+  callChecked(as, ip, (void *)vmNegate);
+  patch8(as, done);
+}
+
+static void jumpIfFalse(Assembler *as, int target) {
+  loadTop(as);
+  EMIT(as, 0x83, 0x78, TOP_TYPE(1), VAL_NIL); // cmp dword [rax - 16], NIL
+  emitJumpTo(as, (const uint8_t[]){0x0f, 0x84}, 2, target); // je target
+  EMIT(as, 0x83, 0x78, TOP_TYPE(1), VAL_BOOL); // cmp dword [rax - 16], BOOL
+  int next = emitShortJump(as, 0x75);          // jne next
+  EMIT(as, 0x80, 0x78, TOP_AS(1), 0);          // cmp byte [rax - 8], 0
+  emitJumpTo(as, (const uint8_t[]){0x0f, 0x84}, 2, target); // je target
+  patch8(as, next);
+}
+
+static void prologue(Assembler *as) {
+  EMIT(as, 0x53, 0x41, 0x54, 0x41, 0x55); // push rbx; push r12; push r13
+  EMIT(as, 0x48, 0x89, 0xfb);             // mov rbx, rdi
+  EMIT(as, 0x49, 0x89, 0xf4);             // mov r12, rsi
+  EMIT(as, 0x4d, 0x8b, 0xac, 0x24);       // mov r13, [r12 + FRAME_SLOTS]
+  emit32(as, FRAME_SLOTS);
+  EMIT(as, 0xff, 0xe2); // jmp rdx
+
+  as->okExit = as->count;
+  EMIT(as, 0xb8); // mov eax, INTERPRET_OK
+  emit32(as, INTERPRET_OK);
+  int exit = emitShortJump(as, 0xeb);
+
+  as->errorExit = as->count;
+  EMIT(as, 0xb8); // mov eax, INTERPRET_RUNTIME_ERR
+  emit32(as, INTERPRET_RUNTIME_ERR);
+
+  patch8(as, exit);
+  EMIT(as, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3); // pop r13, r12, rbx; ret
+}
+
+// Translates the instruction at `offset`, returning the next offset or -1 if
+// the instruction is not supported.
+static int compileInstruction(Assembler *as, Chunk *chunk, int offset) {
+  uint8_t *ip   = &chunk->code[offset];
+  Value *consts = chunk->constants.values;
+
+#define OPERAND()  (ip[1])
+#define JUMP_LEN() ((uint16_t)(ip[1] << 8 | ip[2]))
+
+  // Constant-taking instructions, short or _LONG form
+#define CONSTANT() (consts[constantOperand(ip)])
+#define NEXT_IP()  (ip + constantInstructionBytes(ip[0]))
+#define NEXT()     (offset + constantInstructionBytes(ip[0]))
+
+  switch (ip[0]) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG: pushValue(as, CONSTANT()); return NEXT();
+    case OP_NIL:      pushValue(as, NIL_VAL); return offset + 1;
+    case OP_TRUE:     pushValue(as, BOOL_VAL(true)); return offset + 1;
+    case OP_FALSE:    pushValue(as, BOOL_VAL(false)); return offset + 1;
+    case OP_POP:
+      EMIT(as, 0x48, 0x83, 0xab); // sub qword [rbx + VM_TOP], 16
+      emit32(as, VM_TOP);
+      EMIT(as, (uint8_t)sizeof(Value));
+      return offset + 1;
+    case OP_GET_LOCAL:
+      loadTop(as);
+      EMIT(as, 0x41, 0x0f, 0x10, 0x85); // movups xmm0, [r13 + slot]
+      emit32(as, OPERAND() * sizeof(Value));
+      EMIT(as, 0x0f, 0x11, 0x00); // movups [rax], xmm0
+      moveTop(as, 1);
+      storeTop(as);
+      return offset + 2;
+    case OP_SET_LOCAL:
+      loadTop(as);
+      EMIT(as, 0x0f, 0x10, 0x40, TOP_TYPE(1)); // movups xmm0, [rax - 16]
+      EMIT(as, 0x41, 0x0f, 0x11, 0x85);        // movups [r13 + slot], xmm0
+      emit32(as, OPERAND() * sizeof(Value));
+      return offset + 2;
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG:
+      saveIp(as, NEXT_IP());
+      callHelperWith(as, (void *)vmGetGlobal,
+                     (uint64_t)(uintptr_t)AS_OBJ(CONSTANT()));
+      EMIT(as, 0x84, 0xc0); // test al, al
+      jumpToError(as);
+      return NEXT();
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_LONG:
+      saveIp(as, NEXT_IP());
+      callHelperWith(as, (void *)vmSetGlobal,
+                     (uint64_t)(uintptr_t)AS_OBJ(CONSTANT()));
+      EMIT(as, 0x84, 0xc0); // test al, al
+      jumpToError(as);
+      return NEXT();
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_GLOBAL_LONG:
+      callHelperWith(as, (void *)vmDefineGlobal,
+                     (uint64_t)(uintptr_t)AS_OBJ(CONSTANT()));
+      return NEXT();
+    case OP_EQ:     callHelper(as, (void *)vmEqual); return offset + 1;
+    case OP_NOT_EQ: callHelper(as, (void *)vmNotEqual); return offset + 1;
+    case OP_GREATER:
+      binaryOp(as, ip + 1, (void *)vmGreater, 0, 0x97, false); // seta
+      return offset + 1;
+    case OP_GREATER_EQ:
+      binaryOp(as, ip + 1, (void *)vmGreaterEq, 0, 0x93, false); // setae
+      return offset + 1;
+    case OP_LESS:
+      binaryOp(as, ip + 1, (void *)vmLess, 0, 0x97, true);
+      return offset + 1;
+    case OP_LESS_EQ:
+      binaryOp(as, ip + 1, (void *)vmLessEq, 0, 0x93, true);
+      return offset + 1;
+    case OP_ADD:
+      binaryOp(as, ip + 1, (void *)vmAdd, 0x58, 0, false); // addsd
+      return offset + 1;
+    case OP_SUBTRACT:
+      binaryOp(as, ip + 1, (void *)vmSubtract, 0x5c, 0, false); // subsd
+      return offset + 1;
+    case OP_MULTIPLY:
+      binaryOp(as, ip + 1, (void *)vmMultiply, 0x59, 0, false); // mulsd
+      return offset + 1;
+    case OP_DIVIDE:
+      binaryOp(as, ip + 1, (void *)vmDivide, 0x5e, 0, false); // divsd
+      return offset + 1;
+    case OP_NOT:    callHelper(as, (void *)vmNot); return offset + 1;
+    case OP_NEGATE: negate(as, ip + 1); return offset + 1;
+    case OP_PRINT:  callHelper(as, (void *)vmPrint); return offset + 1;
+    case OP_JUMP:
+      emitJumpTo(as, (const uint8_t[]){0xe9}, 1, offset + 3 + JUMP_LEN());
+      return offset + 3;
+    case OP_JUMP_IF_FALSE:
+      jumpIfFalse(as, offset + 3 + JUMP_LEN());
+      return offset + 3;
+    case OP_LOOP:
+      emitJumpTo(as, (const uint8_t[]){0xe9}, 1, offset + 3 - JUMP_LEN());
+      return offset + 3;
+    case OP_CALL:
+      saveIp(as, ip + 2);
+      EMIT(as, 0xbe); // mov esi, argCount
+      emit32(as, OPERAND());
+      callHelper(as, (void *)vmCall);
+      EMIT(as, 0x84, 0xc0); // test al, al
+      jumpToError(as);
+      return offset + 2;
+    case OP_RETURN:
+      callHelper(as, (void *)vmReturn);
+      emitJumpBack(as, (const uint8_t[]){0xe9}, 1, as->okExit);
+      return offset + 1;
+    default: return -1;
+  }
+
+#undef OPERAND
+#undef JUMP_LEN
+#undef CONSTANT
+#undef NEXT_IP
+#undef NEXT
+}
+
+/*
+ * Lists the code in /tmp/perf-<pid>.map, where `perf report` looks up symbols
+ * for anonymous executable memory. The file is left behind for perf to read
+ * after the process has exited.
+ */
+static void writePerfMap(ObjFunction *func, void *start, int size) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+
+  FILE *map = fopen(path, "a");
+  if (map == NULL)
+    return;
+
+  fprintf(map, "%lx %x lox:%s\n", (unsigned long)(uintptr_t)start, size,
+          PROBE_NAME(func));
+  fclose(map);
+}
+
+static void freeAssembler(Assembler *as) {
+  FREE_ARRAY(as->stats, uint8_t, as->code, as->capacity);
+  FREE_ARRAY(as->stats, Fixup, as->fixups, as->fixupCapacity);
+}
+
+bool jitCompile(VM *vm, ObjFunction *func) {
+  Chunk *chunk = &func->chunk;
+  PROBE1(jit__start, PROBE_NAME(func));
+
+  MemStats *stats = &vm->memStats;
+  Assembler as    = {.stats = stats};
+  prologue(&as);
+
+  // Machine code offset of every bytecode offset that starts an instruction.
+  int *nativeOffsets = ALLOCATE(stats, int, chunk->count);
+  for (int i = 0; i < chunk->count; i++) {
+    nativeOffsets[i] = -1;
+  }
+
+  int offset = 0;
+  while (offset < chunk->count && offset != -1) {
+    nativeOffsets[offset] = as.count;
+    offset                = compileInstruction(&as, chunk, offset);
+  }
+
+  bool ok = offset != -1;
+  for (int i = 0; ok && i < as.fixupCount; i++) {
+    Fixup *fixup = &as.fixups[i];
+    if (fixup->target < 0 || fixup->target >= chunk->count ||
+        nativeOffsets[fixup->target] == -1) {
+      ok = false;
+      break;
+    }
+
+    patch32(&as, fixup->at,
+            nativeOffsets[fixup->target] - (fixup->at + 4));
+  }
+
+  long pageSize = sysconf(_SC_PAGESIZE);
+  size_t size   = ((size_t)as.count + pageSize - 1) / pageSize * pageSize;
+  void *memory  = MAP_FAILED;
+
+  if (ok) {
+    memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+
+  // Where W^X is enforced memory may never become executable, so the
+  // function stays interpreted
+  if (memory != MAP_FAILED) {
+    memcpy(memory, as.code, as.count);
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+      munmap(memory, size);
+      memory = MAP_FAILED;
+    }
+  }
+
+  if (memory == MAP_FAILED) {
+    FREE_ARRAY(stats, int, nativeOffsets, chunk->count);
+    freeAssembler(&as);
+    PROBE2(jit__end, PROBE_NAME(func), false);
+    return false;
+  }
+
+  JitCode *code    = ALLOCATE(stats, JitCode, 1);
+  code->memory     = memory;
+  code->size       = size;
+  code->entryCount = chunk->count;
+  code->entries    = ALLOCATE(stats, void *, chunk->count);
+  for (int i = 0; i < chunk->count; i++) {
+    code->entries[i] = nativeOffsets[i] == -1
+                           ? NULL
+                           : (uint8_t *)memory + nativeOffsets[i];
+  }
+
+  if (vm->perfMap)
+    writePerfMap(func, memory, as.count);
+
+  FREE_ARRAY(stats, int, nativeOffsets, chunk->count);
+  freeAssembler(&as);
+
+  func->jit = code;
+  PROBE2(jit__end, PROBE_NAME(func), true);
+  return true;
+}
+
+InterpretResult jitEnter(VM *vm, CallFrame *frame, int offset) {
+  JitCode *code = frame->function->jit;
+  JitFn fn      = (JitFn)code->memory;
+  return fn(vm, frame, code->entries[offset]);
+}
+
+void jitFree(VM *vm, JitCode *code) {
+  if (code == NULL)
+    return;
+
+  munmap(code->memory, code->size);
+  FREE_ARRAY(&vm->memStats, void *, code->entries, code->entryCount);
+  FREE(&vm->memStats, JitCode, code);
+}
+
+#else
+
+bool jitCompile(VM __attribute__((unused)) * vm,
+                ObjFunction __attribute__((unused)) * func) {
+  return false;
+}
+
+InterpretResult jitEnter(VM __attribute__((unused)) * vm,
+                         CallFrame __attribute__((unused)) * frame,
+                         int __attribute__((unused)) offset) {
+  return INTERPRET_RUNTIME_ERR;
+}
+
+void jitFree(VM __attribute__((unused)) * vm,
+             JitCode __attribute__((unused)) * code) {}
+
+#endif
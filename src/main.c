@@ -1,19 +1,161 @@
 #include "vm.h"
+#include "aot.h"
+#include "compiler.h"
+#include "heapprof.h"
+#include "jit.h"
+#include "perfcount.h"
+#include "profile.h"
+#include "sampler.h"
+#include "scriptcache.h"
+#include "server.h"
+#include "snapshot.h"
+#include "trace.h"
 
+#include <getopt.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 
-void repl() {
+// Settings given on the command line, applied to every VM we create.
+typedef struct options {
+  VMMode mode;
+  bool jit;
+  unsigned long hotThreshold;
+  bool emitC;               // Print the script compiled to C, don't run it
+  bool lazy;                // Compile function bodies on their first call
+  bool hotReport;           // Print call and loop counters at exit
+  const char *profilePath;  // Where --profile-ops writes JSON, or NULL
+  const char *samplePath;   // Where --sample writes collapsed stacks, or NULL
+  long sampleInterval;      // Microseconds between samples
+  bool perfMap;             // Describe JIT code to perf
+  const char *tracePath;    // Where --trace writes instructions, or NULL
+  const char *traceFunction;
+  int traceFrom, traceTo;   // Traced lines, all of them when traceTo is 0
+  bool memStats;            // Print memory statistics at exit
+  const char *heapPath;     // Where --heap-profile writes JSON, or NULL
+  bool perfCounters;        // Count hardware events per phase
+  int scriptCacheSize;      // Compiled scripts kept for reuse, 0 for none
+  const char *servePath;    // Socket to serve script runs on, or NULL
+  const char *connectPath;  // Socket of a server to run the script on, or NULL
+  const char *snapshotPath; // Globals restored into every VM, or NULL
+  const char *savePath;     // Where the script's globals are saved, or NULL
+} Options;
+
+#define DEFAULT_PROFILE_PATH "clox-profile.json"
+#define DEFAULT_SAMPLE_PATH  "clox-samples.folded"
+#define DEFAULT_TRACE_PATH   "clox-trace.bin"
+#define DEFAULT_HEAP_PATH    "clox-heap.json"
+
+static void configureVM(VM *vm, Options *opts) {
+  vm->mode         = opts->mode;
+  vm->jitEnabled   = vm->jitEnabled && opts->jit;
+  vm->hotThreshold = opts->hotThreshold;
+  vm->perfMap      = opts->perfMap;
+  vm->lazyCompile  = opts->lazy;
+
+  freeScriptCache(vm->scriptCache);
+  vm->scriptCache = opts->scriptCacheSize > 0
+                        ? newScriptCache(&vm->memStats, opts->scriptCacheSize)
+                        : NULL;
+
+  if (opts->snapshotPath != NULL && !loadSnapshot(vm, opts->snapshotPath)) {
+    fprintf(stderr, "Could not load snapshot '%s'\n", opts->snapshotPath);
+    exit(EXIT_FAILURE);
+  }
+
+  // Machine code isn't counted, so profiling keeps everything interpreted
+  if (opts->profilePath != NULL) {
+    vm->profile    = newOpProfile(&vm->memStats);
+    vm->jitEnabled = false;
+  }
+
+  if (opts->tracePath != NULL) {
+    vm->trace = openTrace(&vm->memStats, opts->tracePath, opts->traceFunction,
+                          opts->traceFrom, opts->traceTo);
+    if (vm->trace == NULL) {
+      perror("Could not open trace file");
+      exit(EXIT_FAILURE);
+    }
+    vm->jitEnabled = false;
+  }
+
+  if (opts->heapPath != NULL)
+    vm->heapProfile = newHeapProfile(&vm->memStats);
+
+  if (opts->perfCounters) {
+    vm->perfCounters = newPerfCounters(&vm->memStats);
+    if (vm->perfCounters == NULL)
+      perror("Could not open hardware performance counters");
+  }
+
+  if (opts->samplePath != NULL && !startSampler(vm, opts->sampleInterval)) {
+    perror("Could not start the sampling profiler");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Prints the reports asked for on the command line, before the VM is freed.
+static void reportVM(VM *vm, Options *opts) {
+  if (opts->hotReport)
+    printHotnessReport(vm, stderr);
+  if (opts->memStats) {
+    printMemStats(&vm->memStats, stderr);
+    if (vm->scriptCache != NULL)
+      printScriptCacheStats(vm->scriptCache, stderr);
+  }
+
+  if (vm->perfCounters != NULL) {
+    // Machine code doesn't count its instructions, so the per-instruction
+    // row is left out when it may have run
+    bool interpreted = !vm->jitEnabled || vm->mode != VM_STACK;
+    printPerfCounters(vm->perfCounters, interpreted ? vm->dispatchCount : 0,
+                      stderr);
+    freePerfCounters(vm->perfCounters);
+    vm->perfCounters = NULL;
+  }
+
+  if (vm->profile != NULL) {
+    printOpProfile(vm, stderr);
+    if (!writeOpProfile(vm, opts->profilePath))
+      fprintf(stderr, "Could not write profile '%s'\n", opts->profilePath);
+
+    freeOpProfile(vm->profile);
+    vm->profile = NULL;
+  }
+
+  if (vm->heapProfile != NULL) {
+    printHeapSnapshot(vm, stderr);
+    if (!writeHeapSnapshot(vm, opts->heapPath))
+      fprintf(stderr, "Could not write heap snapshot '%s'\n", opts->heapPath);
+
+    freeHeapProfile(vm->heapProfile);
+    vm->heapProfile = NULL;
+  }
+
+  if (vm->trace != NULL) {
+    closeTrace(vm->trace);
+    vm->trace = NULL;
+  }
+
+  if (opts->samplePath != NULL && !stopSampler(opts->samplePath))
+    fprintf(stderr, "Could not write samples '%s'\n", opts->samplePath);
+}
+
+void repl(Options *opts) {
   char *line = NULL;
   size_t len = 0;
   ssize_t nread;
 
   VM vm;
   initVM(&vm);
+  configureVM(&vm, opts);
+  vm.output.lineBuffered = true;
 
   while (true) {
+    // Printed output bypasses stdio, so the prompt must not wait in it
     printf("clox> ");
+    fflush(stdout);
     if ((nread = getline(&line, &len, stdin)) == -1) {
       break;
     }
@@ -25,6 +167,7 @@ void repl() {
     interpret(&vm, line);
   }
 
+  reportVM(&vm, opts);
   freeVM(&vm);
   free(line);
 }
@@ -73,13 +216,32 @@ static char *readFile(const char *path) {
   return source;
 }
 
-void runFile(const char *path) {
+void runFile(const char *path, Options *opts) {
   VM vm;
   initVM(&vm);
+  configureVM(&vm, opts);
 
   char *source = readFile(path);
 
-  InterpretResult result = interpret(&vm, source);
+  InterpretResult result;
+  if (opts->emitC) {
+    vm.mode           = VM_STACK;
+    vm.lazyCompile    = false;
+    ObjFunction *func = compile(&vm, source);
+    if (func != NULL)
+      emitC(func, stdout);
+    result = func == NULL ? INTERPRET_COMPILE_ERR : INTERPRET_OK;
+  } else {
+    result = interpret(&vm, source);
+  }
+
+  if (result == INTERPRET_OK && opts->savePath != NULL &&
+      !writeSnapshot(&vm, opts->savePath)) {
+    perror("Could not write snapshot");
+    result = INTERPRET_RUNTIME_ERR;
+  }
+
+  reportVM(&vm, opts);
 
   freeVM(&vm);
   free(source);
@@ -88,13 +250,236 @@ void runFile(const char *path) {
     exit(EXIT_FAILURE);
 }
 
-void usage() { printf("Usage: clox [path]\n"); }
+void runServer(Options *opts) {
+  VM vm;
+  initVM(&vm);
+  configureVM(&vm, opts);
+
+  bool served = serve(&vm, opts->servePath);
+  if (!served)
+    perror("Could not serve scripts");
+
+  reportVM(&vm, opts);
+  freeVM(&vm);
+
+  if (!served)
+    exit(EXIT_FAILURE);
+}
+
+void usage() {
+  printf("Usage: clox [options] [path]\n");
+  printf("\n");
+  printf("Options:\n");
+  printf("  --register    Compile to and run register-based bytecode\n");
+  printf("  --wordcode    Compile to and run fixed-width 32-bit wordcode\n");
+  printf("  --emit-c      Print the script compiled to C, to be built with\n");
+  printf("                the runtime library (make runtime)\n");
+  printf("  --lazy        Only check function bodies for errors up front,\n");
+  printf("                compiling each on its first call\n");
+  printf("  --serve=SOCKET\n");
+  printf("                Keep a warm VM running scripts sent to the Unix\n");
+  printf("                socket, each in a fresh copy of the VM\n");
+  printf("  --connect=SOCKET\n");
+  printf("                Run the script on the server at SOCKET\n");
+  printf("  --save-snapshot=FILE\n");
+  printf("                Save the globals the script defines, compiled\n");
+  printf("                functions included, to FILE\n");
+  printf("  --snapshot=FILE\n");
+  printf("                Restore the globals saved in FILE before running,\n");
+  printf("                instead of running the script that defined them\n");
+  printf("  --no-jit      Never compile hot functions to machine code\n");
+  printf("  --jit-threshold=N\n");
+  printf("                Calls and loop iterations before a function is\n");
+  printf("                compiled to machine code (default %d)\n",
+         JIT_DEFAULT_THRESHOLD);
+  printf("  --script-cache=N\n");
+  printf("                Keep the N most recently run scripts compiled\n");
+  printf("                for reuse, 0 to disable (default %d). Only\n",
+         SCRIPT_CACHE_DEFAULT_SIZE);
+  printf("                the cache is bounded: evicted scripts stay in\n");
+  printf("                memory until exit\n");
+  printf("  --perf-map    Name JIT code for perf in /tmp/perf-<pid>.map\n");
+  printf("  --mem-stats   Print memory use by category and script cache\n");
+  printf("                hits at exit\n");
+  printf("  --heap-profile[=FILE]\n");
+  printf("                Tag objects with the line allocating them, print\n");
+  printf("                live objects by type and site at exit and write\n");
+  printf("                them as JSON to FILE (default %s)\n",
+         DEFAULT_HEAP_PATH);
+  printf("  --perf-counters\n");
+  printf("                Count CPU instructions, cycles, branch and cache\n");
+  printf("                misses while compiling and running, and per\n");
+  printf("                bytecode instruction with --no-jit\n");
+  printf("  --hot-report  Print function call and loop counters at exit\n");
+  printf("  --profile-ops[=FILE]\n");
+  printf("                Count executed instructions and print the mix at\n");
+  printf("                exit, writing JSON to FILE (default %s); not\n",
+         DEFAULT_PROFILE_PATH);
+  printf("                with --register\n");
+  printf("  --trace[=FILE] Write every executed instruction to FILE in a\n");
+  printf("                compact binary format (default %s); not\n",
+         DEFAULT_TRACE_PATH);
+  printf("                with --register\n");
+  printf("  --trace-function=NAME\n");
+  printf("                Only trace the function NAME (<script> for the\n");
+  printf("                top level)\n");
+  printf("  --trace-lines=FROM[-TO]\n");
+  printf("                Only trace the given source lines\n");
+  printf("  --decode-trace=FILE\n");
+  printf("                Print a trace file as text and exit\n");
+  printf("  --sample[=FILE]\n");
+  printf("                Sample the Lox call stack on a CPU timer, writing\n");
+  printf("                collapsed stacks for flamegraphs to FILE at exit\n");
+  printf("                (default %s)\n", DEFAULT_SAMPLE_PATH);
+  printf("  --sample-interval=US\n");
+  printf("                Microseconds of CPU time between samples\n");
+  printf("                (default %d)\n", SAMPLER_DEFAULT_INTERVAL);
+}
 
-int main(int argc, const char *argv[]) {
-  if (argc == 1) {
-    repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
+// Parses a positive integer option argument, exiting if it isn't one.
+static long parsePositive(const char *arg, const char *what) {
+  char *end;
+  long n = strtol(arg, &end, 10);
+  if (*arg == '\0' || *end != '\0' || n < 1) {
+    fprintf(stderr, "invalid %s '%s'\n", what, arg);
+    exit(2);
+  }
+
+  return n;
+}
+
+static long parseCount(const char *arg, const char *what) {
+  char *end;
+  long n = strtol(arg, &end, 10);
+  if (*arg == '\0' || *end != '\0' || n < 0 || n > INT_MAX) {
+    fprintf(stderr, "invalid %s '%s'\n", what, arg);
+    exit(2);
+  }
+
+  return n;
+}
+
+// Parses a FROM-TO line range, or a single line, exiting if it isn't one.
+static void parseLines(const char *arg, int *from, int *to) {
+  char *end;
+  *from = (int)strtol(arg, &end, 10);
+  *to   = *end == '-' ? (int)strtol(end + 1, &end, 10) : *from;
+
+  if (*end != '\0' || *from < 1 || *to < *from) {
+    fprintf(stderr, "invalid line range '%s'\n", arg);
+    exit(2);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  Options opts = {
+      .mode            = VM_STACK,
+      .jit             = true,
+      .hotThreshold    = JIT_DEFAULT_THRESHOLD,
+      .sampleInterval  = SAMPLER_DEFAULT_INTERVAL,
+      .scriptCacheSize = SCRIPT_CACHE_DEFAULT_SIZE,
+  };
+
+  static struct option longOptions[] = {
+      {"register",        no_argument,       NULL, 'r'},
+      {"wordcode",        no_argument,       NULL, 'w'},
+      {"emit-c",          no_argument,       NULL, 'c'},
+      {"lazy",            no_argument,       NULL, 'L'},
+      {"serve",           required_argument, NULL, 'V'},
+      {"connect",         required_argument, NULL, 'X'},
+      {"snapshot",        required_argument, NULL, 'n'},
+      {"save-snapshot",   required_argument, NULL, 'N'},
+      {"no-jit",          no_argument,       NULL, 'J'},
+      {"jit-threshold",   required_argument, NULL, 't'},
+      {"script-cache",    required_argument, NULL, 'S'},
+      {"perf-map",        no_argument,       NULL, 'P'},
+      {"mem-stats",       no_argument,       NULL, 'm'},
+      {"heap-profile",    optional_argument, NULL, 'M'},
+      {"perf-counters",   no_argument,       NULL, 'C'},
+      {"hot-report",      no_argument,       NULL, 'H'},
+      {"profile-ops",     optional_argument, NULL, 'p'},
+      {"trace",           optional_argument, NULL, 'T'},
+      {"trace-function",  required_argument, NULL, 'f'},
+      {"trace-lines",     required_argument, NULL, 'l'},
+      {"decode-trace",    required_argument, NULL, 'd'},
+      {"sample",          optional_argument, NULL, 's'},
+      {"sample-interval", required_argument, NULL, 'i'},
+      {"help",            no_argument,       NULL, 'h'},
+      {NULL,              0,                 NULL, 0  },
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "h", longOptions, NULL)) != -1) {
+    switch (opt) {
+      case 'r': opts.mode = VM_REGISTER; break;
+      case 'w': opts.mode = VM_WORDCODE; break;
+      case 'c': opts.emitC = true; break;
+      case 'L': opts.lazy = true; break;
+      case 'V': opts.servePath = optarg; break;
+      case 'X': opts.connectPath = optarg; break;
+      case 'n': opts.snapshotPath = optarg; break;
+      case 'N': opts.savePath = optarg; break;
+      case 'J': opts.jit = false; break;
+      case 't':
+        opts.hotThreshold = parsePositive(optarg, "JIT threshold");
+        break;
+      case 'S':
+        opts.scriptCacheSize = (int)parseCount(optarg, "script cache size");
+        break;
+      case 'P': opts.perfMap = true; break;
+      case 'm': opts.memStats = true; break;
+      case 'M':
+        opts.heapPath = optarg != NULL ? optarg : DEFAULT_HEAP_PATH;
+        break;
+      case 'C': opts.perfCounters = true; break;
+      case 'H': opts.hotReport = true; break;
+      case 'p':
+        opts.profilePath = optarg != NULL ? optarg : DEFAULT_PROFILE_PATH;
+        break;
+      case 'T':
+        opts.tracePath = optarg != NULL ? optarg : DEFAULT_TRACE_PATH;
+        break;
+      case 'f': opts.traceFunction = optarg; break;
+      case 'l': parseLines(optarg, &opts.traceFrom, &opts.traceTo); break;
+      case 'd':
+        if (!decodeTrace(optarg, stdout)) {
+          fprintf(stderr, "Could not decode trace '%s'\n", optarg);
+          return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+      case 's':
+        opts.samplePath = optarg != NULL ? optarg : DEFAULT_SAMPLE_PATH;
+        break;
+      case 'i':
+        opts.sampleInterval = parsePositive(optarg, "sample interval");
+        break;
+      case 'h': usage(); return EXIT_SUCCESS;
+      default:  usage(); exit(2);
+    }
+  }
+
+  // Profiles and traces record OpCode instructions, which register code
+  // doesn't run
+  if (opts.mode == VM_REGISTER && opts.profilePath != NULL) {
+    fprintf(stderr, "--profile-ops can't be used with --register\n");
+    exit(2);
+  }
+  if (opts.mode == VM_REGISTER && opts.tracePath != NULL) {
+    fprintf(stderr, "--trace can't be used with --register\n");
+    exit(2);
+  }
+
+  if (opts.servePath != NULL && optind == argc) {
+    runServer(&opts);
+  } else if (opts.connectPath != NULL && optind == argc - 1) {
+    return runRemote(opts.connectPath, argv[optind]);
+  } else if (opts.servePath != NULL || opts.connectPath != NULL) {
+    usage();
+    exit(2);
+  } else if (optind == argc && !opts.emitC) {
+    repl(&opts);
+  } else if (optind == argc - 1) {
+    runFile(argv[optind], &opts);
   } else {
     usage();
     exit(2);
@@ -1,10 +1,49 @@
 #include "memory.h"
+#include "jit.h"
 #include "object.h"
 #include "vm.h"
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+static const char *categoryNames[MEM_CATEGORY_COUNT] = {
+    [MEM_STRING]      = "strings",
+    [MEM_FUNCTION]    = "functions",
+    [MEM_NATIVE]      = "natives",
+    [MEM_CHUNK]       = "chunks",
+    [MEM_TABLE]       = "tables",
+    [MEM_VALUE_ARRAY] = "arrays",
+    [MEM_OTHER]       = "other",
+};
+
+static void countAllocation(MemStats *stats, MemCategory category,
+                            size_t oldSize, size_t newSize) {
+  if (oldSize == 0 && newSize > 0)
+    stats->allocations++;
+  if (newSize == 0 && oldSize > 0)
+    stats->frees++;
+  if (newSize > oldSize)
+    stats->total += newSize - oldSize;
+
+  stats->current         += newSize - oldSize;
+  stats->bytes[category] += newSize - oldSize;
+
+  if (stats->current > stats->peak)
+    stats->peak = stats->current;
+  if (stats->bytes[category] > stats->peakBytes[category])
+    stats->peakBytes[category] = stats->bytes[category];
+}
+
+void *reallocateIn(MemStats *stats, MemCategory category, void *ptr,
+                   size_t oldSize, size_t newSize) {
+  // Freeing arrays that were never allocated is allowed
+  if (ptr == NULL)
+    oldSize = 0;
+
+  if (stats != NULL)
+    countAllocation(stats, category, oldSize, newSize);
 
-void *reallocate(void *ptr, size_t oldSize, size_t newSize) {
   if (newSize == 0) {
     free(ptr);
     return NULL;
@@ -18,22 +57,93 @@ void *reallocate(void *ptr, size_t oldSize, size_t newSize) {
   return result;
 }
 
-void freeObject(Obj *obj) {
+void *reallocate(MemStats *stats, void *ptr, size_t oldSize, size_t newSize) {
+  return reallocateIn(stats, MEM_OTHER, ptr, oldSize, newSize);
+}
+
+bool getMemStat(MemStats *memStats, const char *name, double *value) {
+  if (strcmp(name, "current") == 0) {
+    *value = memStats->current;
+  } else if (strcmp(name, "peak") == 0) {
+    *value = memStats->peak;
+  } else if (strcmp(name, "total") == 0) {
+    *value = memStats->total;
+  } else if (strcmp(name, "allocations") == 0) {
+    *value = memStats->allocations;
+  } else if (strcmp(name, "frees") == 0) {
+    *value = memStats->frees;
+  } else {
+    for (int i = 0; i < MEM_CATEGORY_COUNT; i++) {
+      if (strcmp(name, categoryNames[i]) == 0) {
+        *value = memStats->bytes[i];
+        return true;
+      }
+    }
+    return false;
+  }
+
+  return true;
+}
+
+// The process's peak resident set size in kilobytes, or -1 where /proc isn't
+// available. Unlike getrusage, this isn't inherited from the parent process.
+static long peakRSS(void) {
+  FILE *status = fopen("/proc/self/status", "r");
+  if (status == NULL)
+    return -1;
+
+  char line[128];
+  long kb = -1;
+  while (fgets(line, sizeof(line), status) != NULL) {
+    if (sscanf(line, "VmHWM: %ld kB", &kb) == 1)
+      break;
+  }
+
+  fclose(status);
+  return kb;
+}
+
+void printMemStats(MemStats *memStats, FILE *out) {
+  fprintf(out, "== Memory ==\n");
+  fprintf(out, "%-12s %12zu bytes\n", "current", memStats->current);
+  fprintf(out, "%-12s %12zu bytes\n", "peak", memStats->peak);
+  fprintf(out, "%-12s %12zu bytes\n", "total", memStats->total);
+  fprintf(out, "%-12s %12lu\n", "allocations", memStats->allocations);
+  fprintf(out, "%-12s %12lu\n", "frees", memStats->frees);
+
+  long rss = peakRSS();
+  if (rss >= 0)
+    fprintf(out, "%-12s %12ld kB\n", "peak RSS", rss);
+
+  fprintf(out, "%-12s %12s %12s\n", "category", "current", "peak");
+  for (int i = 0; i < MEM_CATEGORY_COUNT; i++) {
+    fprintf(out, "%-12s %12zu %12zu\n", categoryNames[i], memStats->bytes[i],
+            memStats->peakBytes[i]);
+  }
+}
+
+static void freeObject(VM *vm, Obj *obj) {
+  MemStats *stats = &vm->memStats;
+
   switch (obj->type) {
     case OBJ_FUNCTION: {
       ObjFunction *func = (ObjFunction *)obj;
+      FREE_ARRAY(stats, unsigned long, func->loopCounts, func->chunk.count);
+      FREE_ARRAY(stats, unsigned long, func->opCounts, func->chunk.count);
+      FREE_ARRAY(stats, char, func->lazySource, func->lazyLength + 1);
       freeChunk(&func->chunk);
-      FREE(ObjFunction, obj);
+      jitFree(vm, func->jit);
+      FREE_IN(stats, MEM_FUNCTION, ObjFunction, obj);
       break;
     }
     case OBJ_NATIVE: {
-      FREE(ObjNative, obj);
+      FREE_IN(stats, MEM_NATIVE, ObjNative, obj);
       break;
     }
     case OBJ_STRING: {
       ObjString *str = (ObjString *)obj;
-      FREE_ARRAY(char, str->chars, str->length + 1);
-      FREE(ObjString, obj);
+      FREE_ARRAY_IN(stats, MEM_STRING, char, str->chars, str->length + 1);
+      FREE_IN(stats, MEM_STRING, ObjString, obj);
       break;
     }
   }
@@ -44,7 +154,7 @@ void freeObjects(VM *vm) {
 
   while (obj != NULL) {
     Obj *next = obj->next;
-    freeObject(obj);
+    freeObject(vm, obj);
     obj = next;
   }
 }
@@ -0,0 +1,431 @@
+#include "number.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Shortest round-trip formatting with the Grisu2 algorithm (Loitsch,
+ * "Printing Floating-Point Numbers Quickly and Accurately with Integers",
+ * PLDI 2010). The double is scaled by a cached power of ten into a 64-bit
+ * fixed-point number, whose digits are generated until they fall between the
+ * neighbouring doubles' midpoints. Output always reads back exactly; for a
+ * tiny fraction of doubles it is a digit longer than the shortest.
+ */
+
+// A floating-point number f * 2^e with a 64-bit significand.
+typedef struct diy_fp {
+  uint64_t f;
+  int e;
+} DiyFp;
+
+#define SIGNIFICAND_BITS 52
+#define HIDDEN_BIT       ((uint64_t)1 << SIGNIFICAND_BITS)
+#define SIGNIFICAND_MASK (HIDDEN_BIT - 1)
+#define EXPONENT_MASK    0x7FF0000000000000ull
+#define EXPONENT_BIAS    (0x3FF + SIGNIFICAND_BITS)
+
+// Normalized powers 1e-348, 1e-340, ... 1e340.
+static const DiyFp cachedPowers[] = {
+    {0xfa8fd5a0081c0288, -1220}, // 1e-348
+    {0xbaaee17fa23ebf76, -1193}, // 1e-340
+    {0x8b16fb203055ac76, -1166}, // 1e-332
+    {0xcf42894a5dce35ea, -1140}, // 1e-324
+    {0x9a6bb0aa55653b2d, -1113}, // 1e-316
+    {0xe61acf033d1a45df, -1087}, // 1e-308
+    {0xab70fe17c79ac6ca, -1060}, // 1e-300
+    {0xff77b1fcbebcdc4f, -1034}, // 1e-292
+    {0xbe5691ef416bd60c, -1007}, // 1e-284
+    {0x8dd01fad907ffc3c,  -980}, // 1e-276
+    {0xd3515c2831559a83,  -954}, // 1e-268
+    {0x9d71ac8fada6c9b5,  -927}, // 1e-260
+    {0xea9c227723ee8bcb,  -901}, // 1e-252
+    {0xaecc49914078536d,  -874}, // 1e-244
+    {0x823c12795db6ce57,  -847}, // 1e-236
+    {0xc21094364dfb5637,  -821}, // 1e-228
+    {0x9096ea6f3848984f,  -794}, // 1e-220
+    {0xd77485cb25823ac7,  -768}, // 1e-212
+    {0xa086cfcd97bf97f4,  -741}, // 1e-204
+    {0xef340a98172aace5,  -715}, // 1e-196
+    {0xb23867fb2a35b28e,  -688}, // 1e-188
+    {0x84c8d4dfd2c63f3b,  -661}, // 1e-180
+    {0xc5dd44271ad3cdba,  -635}, // 1e-172
+    {0x936b9fcebb25c996,  -608}, // 1e-164
+    {0xdbac6c247d62a584,  -582}, // 1e-156
+    {0xa3ab66580d5fdaf6,  -555}, // 1e-148
+    {0xf3e2f893dec3f126,  -529}, // 1e-140
+    {0xb5b5ada8aaff80b8,  -502}, // 1e-132
+    {0x87625f056c7c4a8b,  -475}, // 1e-124
+    {0xc9bcff6034c13053,  -449}, // 1e-116
+    {0x964e858c91ba2655,  -422}, // 1e-108
+    {0xdff9772470297ebd,  -396}, // 1e-100
+    {0xa6dfbd9fb8e5b88f,  -369}, // 1e-92
+    {0xf8a95fcf88747d94,  -343}, // 1e-84
+    {0xb94470938fa89bcf,  -316}, // 1e-76
+    {0x8a08f0f8bf0f156b,  -289}, // 1e-68
+    {0xcdb02555653131b6,  -263}, // 1e-60
+    {0x993fe2c6d07b7fac,  -236}, // 1e-52
+    {0xe45c10c42a2b3b06,  -210}, // 1e-44
+    {0xaa242499697392d3,  -183}, // 1e-36
+    {0xfd87b5f28300ca0e,  -157}, // 1e-28
+    {0xbce5086492111aeb,  -130}, // 1e-20
+    {0x8cbccc096f5088cc,  -103}, // 1e-12
+    {0xd1b71758e219652c,   -77}, // 1e-4
+    {0x9c40000000000000,   -50}, // 1e4
+    {0xe8d4a51000000000,   -24}, // 1e12
+    {0xad78ebc5ac620000,     3}, // 1e20
+    {0x813f3978f8940984,    30}, // 1e28
+    {0xc097ce7bc90715b3,    56}, // 1e36
+    {0x8f7e32ce7bea5c70,    83}, // 1e44
+    {0xd5d238a4abe98068,   109}, // 1e52
+    {0x9f4f2726179a2245,   136}, // 1e60
+    {0xed63a231d4c4fb27,   162}, // 1e68
+    {0xb0de65388cc8ada8,   189}, // 1e76
+    {0x83c7088e1aab65db,   216}, // 1e84
+    {0xc45d1df942711d9a,   242}, // 1e92
+    {0x924d692ca61be758,   269}, // 1e100
+    {0xda01ee641a708dea,   295}, // 1e108
+    {0xa26da3999aef774a,   322}, // 1e116
+    {0xf209787bb47d6b85,   348}, // 1e124
+    {0xb454e4a179dd1877,   375}, // 1e132
+    {0x865b86925b9bc5c2,   402}, // 1e140
+    {0xc83553c5c8965d3d,   428}, // 1e148
+    {0x952ab45cfa97a0b3,   455}, // 1e156
+    {0xde469fbd99a05fe3,   481}, // 1e164
+    {0xa59bc234db398c25,   508}, // 1e172
+    {0xf6c69a72a3989f5c,   534}, // 1e180
+    {0xb7dcbf5354e9bece,   561}, // 1e188
+    {0x88fcf317f22241e2,   588}, // 1e196
+    {0xcc20ce9bd35c78a5,   614}, // 1e204
+    {0x98165af37b2153df,   641}, // 1e212
+    {0xe2a0b5dc971f303a,   667}, // 1e220
+    {0xa8d9d1535ce3b396,   694}, // 1e228
+    {0xfb9b7cd9a4a7443c,   720}, // 1e236
+    {0xbb764c4ca7a44410,   747}, // 1e244
+    {0x8bab8eefb6409c1a,   774}, // 1e252
+    {0xd01fef10a657842c,   800}, // 1e260
+    {0x9b10a4e5e9913129,   827}, // 1e268
+    {0xe7109bfba19c0c9d,   853}, // 1e276
+    {0xac2820d9623bf429,   880}, // 1e284
+    {0x80444b5e7aa7cf85,   907}, // 1e292
+    {0xbf21e44003acdd2d,   933}, // 1e300
+    {0x8e679c2f5e44ff8f,   960}, // 1e308
+    {0xd433179d9c8cb841,   986}, // 1e316
+    {0x9e19db92b4e31ba9,  1013}, // 1e324
+    {0xeb96bf6ebadf77d9,  1039}, // 1e332
+    {0xaf87023b9bf0ee6b,  1066}, // 1e340
+};
+
+static const uint64_t powersOf10[] = {
+    1ull,
+    10ull,
+    100ull,
+    1000ull,
+    10000ull,
+    100000ull,
+    1000000ull,
+    10000000ull,
+    100000000ull,
+    1000000000ull,
+    10000000000ull,
+    100000000000ull,
+    1000000000000ull,
+    10000000000000ull,
+    100000000000000ull,
+    1000000000000000ull,
+    10000000000000000ull,
+    100000000000000000ull,
+    1000000000000000000ull,
+    10000000000000000000ull,
+};
+
+static DiyFp fromDouble(double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+
+  int biased        = (int)((bits & EXPONENT_MASK) >> SIGNIFICAND_BITS);
+  uint64_t fraction = bits & SIGNIFICAND_MASK;
+  if (biased != 0)
+    return (DiyFp){fraction + HIDDEN_BIT, biased - EXPONENT_BIAS};
+  return (DiyFp){fraction, 1 - EXPONENT_BIAS}; // Subnormal
+}
+
+static DiyFp normalize(DiyFp x) {
+  int shift = __builtin_clzll(x.f);
+  return (DiyFp){x.f << shift, x.e - shift};
+}
+
+// The rounded upper 64 bits of the product.
+static DiyFp multiply(DiyFp x, DiyFp y) {
+  unsigned __int128 product = (unsigned __int128)x.f * y.f;
+  uint64_t high             = (uint64_t)(product >> 64);
+  uint64_t low              = (uint64_t)product;
+  return (DiyFp){high + (low >> 63), x.e + y.e + 64};
+}
+
+// The midpoints between the value and its neighbouring doubles, normalized to
+// the same exponent.
+static void boundaries(DiyFp v, DiyFp *minus, DiyFp *plus) {
+  *plus = normalize((DiyFp){(v.f << 1) + 1, v.e - 1});
+
+  // The gap below a power of two is half as wide as the gap above it
+  if (v.f == HIDDEN_BIT)
+    *minus = (DiyFp){(v.f << 2) - 1, v.e - 2};
+  else
+    *minus = (DiyFp){(v.f << 1) - 1, v.e - 1};
+
+  minus->f <<= minus->e - plus->e;
+  minus->e = plus->e;
+}
+
+// Picks a cached power c = 10^-k so that e + c.e + 64 lies in [-60, -32].
+static DiyFp cachedPower(int e, int *k) {
+  double dk = (-61 - e) * 0.30102999566398114 + 347; // log10(2)
+  int ceil  = (int)dk;
+  if (dk - ceil > 0.0)
+    ceil++;
+
+  int index = (ceil >> 3) + 1;
+  *k        = -(-348 + index * 8);
+  return cachedPowers[index];
+}
+
+static int countDigits(uint32_t n) {
+  int digits = 1;
+  while (digits < 10 && n >= powersOf10[digits])
+    digits++;
+  return digits;
+}
+
+// Moves the last digit towards the exact value while it stays in range.
+static void roundWeed(char *digits, int length, uint64_t delta, uint64_t rest,
+                      uint64_t tenKappa, uint64_t distance) {
+  while (rest < distance && delta - rest >= tenKappa &&
+         (rest + tenKappa < distance ||
+          distance - rest > rest + tenKappa - distance)) {
+    digits[length - 1]--;
+    rest += tenKappa;
+  }
+}
+
+// Generates the digits of `high`, stopping once they're within `delta` of it.
+static int generateDigits(DiyFp w, DiyFp high, uint64_t delta, char *digits,
+                          int *k) {
+  DiyFp one         = {(uint64_t)1 << -high.e, high.e};
+  uint64_t distance = high.f - w.f;
+  uint32_t integral = (uint32_t)(high.f >> -one.e);
+  uint64_t fraction = high.f & (one.f - 1);
+  int length        = 0;
+
+  for (int kappa = countDigits(integral); kappa > 0;) {
+    uint32_t divisor = (uint32_t)powersOf10[kappa - 1];
+    uint32_t digit   = integral / divisor;
+    integral %= divisor;
+    if (digit != 0 || length != 0)
+      digits[length++] = (char)('0' + digit);
+    kappa--;
+
+    uint64_t rest = ((uint64_t)integral << -one.e) + fraction;
+    if (rest <= delta) {
+      *k += kappa;
+      roundWeed(digits, length, delta, rest, powersOf10[kappa] << -one.e,
+                distance);
+      return length;
+    }
+  }
+
+  for (int kappa = 0;;) {
+    fraction *= 10;
+    delta *= 10;
+    char digit = (char)(fraction >> -one.e);
+    if (digit != 0 || length != 0)
+      digits[length++] = (char)('0' + digit);
+    fraction &= one.f - 1;
+    kappa--;
+
+    if (fraction < delta) {
+      *k += kappa;
+      uint64_t scale = -kappa < 20 ? powersOf10[-kappa] : 0;
+      roundWeed(digits, length, delta, fraction, one.f, distance * scale);
+      return length;
+    }
+  }
+}
+
+// Writes the digits of a positive, finite value, with value = digits * 10^k.
+static int grisu2(double value, char *digits, int *k) {
+  DiyFp v = fromDouble(value);
+  DiyFp minus, plus;
+  boundaries(v, &minus, &plus);
+
+  DiyFp power = cachedPower(plus.e, k);
+  DiyFp w     = multiply(normalize(v), power);
+  DiyFp high  = multiply(plus, power);
+  DiyFp low   = multiply(minus, power);
+
+  // Stay strictly inside the boundaries, whatever the rounding above did
+  high.f--;
+  low.f++;
+  return generateDigits(w, high, high.f - low.f, digits, k);
+}
+
+static int writeExponent(char *buffer, int exponent) {
+  char *start = buffer;
+  *buffer++   = 'e';
+  *buffer++   = exponent < 0 ? '-' : '+';
+  if (exponent < 0)
+    exponent = -exponent;
+  if (exponent >= 100)
+    *buffer++ = (char)('0' + exponent / 100);
+  if (exponent >= 10)
+    *buffer++ = (char)('0' + exponent / 10 % 10);
+  *buffer++ = (char)('0' + exponent % 10);
+  return (int)(buffer - start);
+}
+
+// Lays out `length` digits with value = digits * 10^k, returning the length.
+static int layoutDigits(char *buffer, char *digits, int length, int k) {
+  int point = length + k; // Position of the decimal point in the digits
+
+  if (k >= 0 && point <= 21) {
+    // Whole number: 1234e2 -> 123400
+    memcpy(buffer, digits, length);
+    memset(buffer + length, '0', k);
+    return point;
+  }
+
+  if (point > 0 && point <= 21) {
+    // 1234e-2 -> 12.34
+    memcpy(buffer, digits, point);
+    buffer[point] = '.';
+    memcpy(buffer + point + 1, digits + point, length - point);
+    return length + 1;
+  }
+
+  if (point > -6 && point <= 0) {
+    // 1234e-6 -> 0.001234
+    buffer[0] = '0';
+    buffer[1] = '.';
+    memset(buffer + 2, '0', -point);
+    memcpy(buffer + 2 - point, digits, length);
+    return length + 2 - point;
+  }
+
+  // 1234e30 -> 1.234e+33
+  int n       = 0;
+  buffer[n++] = digits[0];
+  if (length > 1) {
+    buffer[n++] = '.';
+    memcpy(buffer + n, digits + 1, length - 1);
+    n += length - 1;
+  }
+  return n + writeExponent(buffer + n, point - 1);
+}
+
+// Writes a whole number below 2^53 without any floating-point work.
+static int formatInteger(uint64_t n, char *buffer) {
+  char digits[20];
+  int length = 0;
+  do {
+    digits[length++] = (char)('0' + n % 10);
+    n /= 10;
+  } while (n > 0);
+
+  for (int i = 0; i < length; i++)
+    buffer[i] = digits[length - 1 - i];
+  return length;
+}
+
+int formatNumber(double value, char *buffer) {
+  int length = 0;
+
+  if (isnan(value)) {
+    memcpy(buffer, "nan", 4);
+    return 3;
+  }
+
+  if (signbit(value)) {
+    buffer[length++] = '-';
+    value            = -value;
+  }
+
+  if (isinf(value)) {
+    memcpy(buffer + length, "inf", 4);
+    return length + 3;
+  }
+
+  if (value < 9007199254740992.0 && value == (double)(uint64_t)value) {
+    length += formatInteger((uint64_t)value, buffer + length);
+  } else {
+    char digits[NUMBER_BUFFER_SIZE];
+    int k;
+    int count = grisu2(value, digits, &k);
+    length += layoutDigits(buffer + length, digits, count, k);
+  }
+
+  buffer[length] = '\0';
+  return length;
+}
+
+// Powers of ten that are exactly representable as doubles.
+static const double exactPowersOf10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+#define MAX_EXACT_MANTISSA ((uint64_t)1 << 53)
+#define MAX_EXACT_POWER    22
+
+// Parses the literal with strtod, which needs it NUL-terminated rather than
+// followed by the rest of the source.
+static double parseSlow(const char *chars, int length) {
+  char buffer[64];
+  char *copy = length < (int)sizeof(buffer) ? buffer : malloc(length + 1);
+  if (copy == NULL)
+    exit(EXIT_FAILURE);
+
+  memcpy(copy, chars, length);
+  copy[length] = '\0';
+  double value = strtod(copy, NULL);
+
+  if (copy != buffer)
+    free(copy);
+  return value;
+}
+
+/*
+ * Literals are parsed with Clinger's fast path: when the digits, read as an
+ * integer, and the power of ten they're scaled by are both exact doubles, one
+ * correctly rounded division gives the correctly rounded result. That covers
+ * whole numbers below 2^53 and decimals with up to 15 or so significant
+ * digits. Anything longer falls back to strtod.
+ */
+double parseNumber(const char *chars, int length) {
+  uint64_t mantissa = 0;
+  int digits        = 0; // Significant digits read into the mantissa
+  int fraction      = 0; // Digits after the point
+  bool afterPoint   = false;
+
+  for (int i = 0; i < length; i++) {
+    char c = chars[i];
+    if (c == '.') {
+      afterPoint = true;
+      continue;
+    }
+
+    if (digits == 19)
+      return parseSlow(chars, length); // Would overflow the mantissa
+    mantissa = mantissa * 10 + (uint64_t)(c - '0');
+    if (mantissa != 0)
+      digits++;
+    if (afterPoint)
+      fraction++;
+  }
+
+  if (mantissa > MAX_EXACT_MANTISSA || fraction > MAX_EXACT_POWER)
+    return parseSlow(chars, length);
+
+  return (double)mantissa / exactPowersOf10[fraction];
+}
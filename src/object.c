@@ -1,4 +1,5 @@
 #include "object.h"
+#include "heapprof.h"
 #include "memory.h"
 #include "value.h"
 #include "vm.h"
@@ -9,14 +10,28 @@
 #define ALLOCATE_OBJ(vm, type, objType) \
   (type *)allocateObj(vm, sizeof(type), objType)
 
+static MemCategory objCategory(ObjType type) {
+  switch (type) {
+    case OBJ_FUNCTION: return MEM_FUNCTION;
+    case OBJ_NATIVE:   return MEM_NATIVE;
+    case OBJ_STRING:   return MEM_STRING;
+  }
+
+  return MEM_OTHER;
+}
+
 static Obj *allocateObj(VM *vm, size_t size, ObjType type) {
-  Obj *obj  = (Obj *)reallocate(NULL, 0, size);
+  Obj *obj =
+      (Obj *)reallocateIn(&vm->memStats, objCategory(type), NULL, 0, size);
   obj->type = type;
 
   // Prepend new object to VM's tracked linked list of objects
   obj->next   = vm->objects;
   vm->objects = obj;
 
+  if (vm->heapProfile != NULL)
+    recordAllocation(vm->heapProfile, vm, obj);
+
   return obj;
 }
 
@@ -47,11 +62,56 @@ static uint32_t hashString(const char *key, int length) {
 ObjFunction *newFunction(VM *vm) {
   ObjFunction *func = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
   func->arity       = 0;
+  func->maxSlots    = 0;
   func->name        = NULL;
-  initChunk(&func->chunk);
+  func->calls       = 0;
+  func->loopCounts  = NULL;
+  func->opCounts    = NULL;
+  func->jit         = NULL;
+  func->compiled    = NULL;
+  func->lazySource  = NULL;
+  func->lazyLength  = 0;
+  func->lazyLine    = 0;
+  initChunk(&func->chunk, &vm->memStats);
   return func;
 }
 
+typedef struct chunk_list {
+  int count;
+  int capacity;
+  Chunk **chunks;
+  MemStats *stats;
+} ChunkList;
+
+static void collectChunks(ChunkList *list, ObjFunction *func) {
+  // Lazy functions are packed once they have been compiled
+  if (func->chunk.packed || func->lazySource != NULL)
+    return;
+
+  if (list->count >= list->capacity) {
+    int oldCap     = list->capacity;
+    list->capacity = GROW_CAPACITY(oldCap);
+    list->chunks   = GROW_ARRAY(list->stats, Chunk *, list->chunks, oldCap,
+                                list->capacity);
+  }
+  list->chunks[list->count++] = &func->chunk;
+
+  // Nested functions follow their enclosing function
+  for (int i = 0; i < func->chunk.constants.count; i++) {
+    Value constant = func->chunk.constants.values[i];
+    if (IS_FUNCTION(constant))
+      collectChunks(list, AS_FUNCTION(constant));
+  }
+}
+
+void packFunctions(VM *vm, ObjFunction *script) {
+  ChunkList list = {.stats = &vm->memStats};
+  collectChunks(&list, script);
+  if (list.count > 0)
+    packChunks(&vm->memStats, &vm->chunkArenas, list.chunks, list.count);
+  FREE_ARRAY(list.stats, Chunk *, list.chunks, list.capacity);
+}
+
 ObjNative *newNative(VM *vm, NativeFn function) {
   ObjNative *native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
   native->function  = function;
@@ -65,7 +125,7 @@ ObjString *takeString(VM *vm, char *chars, int length) {
 
   ObjString *interned = tableFindString(&vm->strings, chars, length, hash);
   if (interned != NULL) {
-    FREE_ARRAY(char, (void *)chars, length + 1);
+    FREE_ARRAY_IN(&vm->memStats, MEM_STRING, char, (void *)chars, length + 1);
     return interned;
   }
 
@@ -81,7 +141,7 @@ ObjString *copyString(VM *vm, const char *chars, int length) {
   if (interned != NULL)
     return interned;
 
-  char *buffer = ALLOCATE(char, length + 1);
+  char *buffer = ALLOCATE_IN(&vm->memStats, MEM_STRING, char, length + 1);
   strncpy(buffer, chars, length);
   buffer[length] = '\0';
 
@@ -0,0 +1,123 @@
+#include "output.h"
+#include "number.h"
+#include "object.h"
+#include "value.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void initOutput(Output *out, int fd, bool lineBuffered) {
+  out->fd           = fd;
+  out->lineBuffered = lineBuffered;
+  out->length       = 0;
+}
+
+// Writes all of the bytes, giving up on the rest if the descriptor fails.
+static void writeAll(int fd, const char *chars, size_t length) {
+  while (length > 0) {
+    ssize_t written = write(fd, chars, length);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+
+    chars += written;
+    length -= written;
+  }
+}
+
+void flushOutput(Output *out) {
+  writeAll(out->fd, out->buffer, out->length);
+  out->length = 0;
+}
+
+void writeOutput(Output *out, const char *chars, size_t length) {
+  if (out->length + length > OUTPUT_BUFFER_SIZE) {
+    flushOutput(out);
+
+    // Too big to be worth copying
+    if (length > OUTPUT_BUFFER_SIZE / 2) {
+      writeAll(out->fd, chars, length);
+      return;
+    }
+  }
+
+  memcpy(out->buffer + out->length, chars, length);
+  out->length += length;
+}
+
+void writeOutputf(Output *out, const char *format, ...) {
+  char chars[256];
+  va_list args, retry;
+  va_start(args, format);
+  va_copy(retry, args);
+  int length = vsnprintf(chars, sizeof(chars), format, args);
+  va_end(args);
+
+  if (length >= 0 && (size_t)length < sizeof(chars)) {
+    writeOutput(out, chars, (size_t)length);
+  } else if (length >= 0) {
+    // Formatted again into a buffer big enough for all of it
+    char *heap = malloc((size_t)length + 1);
+    if (heap != NULL) {
+      vsnprintf(heap, (size_t)length + 1, format, retry);
+      writeOutput(out, heap, (size_t)length);
+      free(heap);
+    }
+  }
+  va_end(retry);
+}
+
+#define WRITE_LITERAL(out, literal) \
+  writeOutput(out, literal, sizeof(literal) - 1)
+
+static void writeObject(Output *out, Value value) {
+  switch (OBJ_TYPE(value)) {
+    case OBJ_FUNCTION: {
+      ObjFunction *func = AS_FUNCTION(value);
+      if (func->name == NULL) {
+        WRITE_LITERAL(out, "<script>");
+      } else {
+        WRITE_LITERAL(out, "<fn ");
+        writeOutput(out, func->name->chars, func->name->length);
+        WRITE_LITERAL(out, ">");
+      }
+      break;
+    }
+    case OBJ_NATIVE: WRITE_LITERAL(out, "<native fn>"); break;
+    case OBJ_STRING:
+      writeOutput(out, AS_CSTRING(value), AS_STRING(value)->length);
+      break;
+  }
+}
+
+void writeValue(Output *out, Value value) {
+  switch (value.type) {
+    case VAL_BOOL:
+      if (AS_BOOL(value))
+        WRITE_LITERAL(out, "true");
+      else
+        WRITE_LITERAL(out, "false");
+      break;
+    case VAL_NIL: WRITE_LITERAL(out, "nil"); break;
+    case VAL_NUM: {
+      char buffer[NUMBER_BUFFER_SIZE];
+      writeOutput(out, buffer, formatNumber(AS_NUM(value), buffer));
+      break;
+    }
+    case VAL_OBJ: writeObject(out, value); break;
+  }
+}
+
+void printLine(Output *out, Value value) {
+  writeValue(out, value);
+  WRITE_LITERAL(out, "\n");
+
+  if (out->lineBuffered)
+    flushOutput(out);
+}
@@ -0,0 +1,154 @@
+#include "perfcount.h"
+#include "memory.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#if PERF_COUNTERS_SUPPORTED
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+static const char *eventNames[PERF_EVENT_COUNT] = {
+    [PERF_INSTRUCTIONS]  = "instructions",
+    [PERF_CYCLES]        = "cycles",
+    [PERF_BRANCH_MISSES] = "branch-misses",
+    [PERF_L1D_MISSES]    = "L1D-misses",
+    [PERF_LLC_MISSES]    = "LLC-misses",
+};
+
+static const char *phaseNames[PERF_PHASE_COUNT] = {
+    [PERF_COMPILE] = "compile",
+    [PERF_RUN]     = "run",
+};
+
+#if PERF_COUNTERS_SUPPORTED
+
+static int openEvent(PerfEvent event) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size           = sizeof(attr);
+  attr.type           = PERF_TYPE_HARDWARE;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv     = 1;
+
+  switch (event) {
+    case PERF_INSTRUCTIONS:
+      attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+      break;
+    case PERF_CYCLES: attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+    case PERF_BRANCH_MISSES:
+      attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+      break;
+    case PERF_L1D_MISSES:
+      attr.type   = PERF_TYPE_HW_CACHE;
+      attr.config = PERF_COUNT_HW_CACHE_L1D |
+                    PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                    PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+      break;
+    case PERF_LLC_MISSES: attr.config = PERF_COUNT_HW_CACHE_MISSES; break;
+    case PERF_EVENT_COUNT: return -1;
+  }
+
+  // This process on any CPU
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+#else
+
+static int openEvent(PerfEvent event) {
+  (void)event;
+  errno = ENOSYS;
+  return -1;
+}
+
+#endif
+
+// Reads an event's running count, or 0 if it isn't being counted.
+static uint64_t readEvent(PerfCounters *counters, PerfEvent event) {
+  uint64_t value;
+  if (counters->fds[event] < 0 ||
+      read(counters->fds[event], &value, sizeof(value)) != sizeof(value))
+    return 0;
+  return value;
+}
+
+PerfCounters *newPerfCounters(MemStats *stats) {
+  PerfCounters *counters = ALLOCATE(stats, PerfCounters, 1);
+  memset(counters, 0, sizeof(PerfCounters));
+  counters->stats = stats;
+
+  bool opened = false;
+  int error   = 0;
+  for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+    counters->fds[i] = openEvent(i);
+    if (counters->fds[i] >= 0)
+      opened = true;
+    else if (error == 0)
+      error = errno;
+  }
+
+  if (!opened) {
+    FREE(stats, PerfCounters, counters);
+    errno = error;
+    return NULL;
+  }
+
+  return counters;
+}
+
+void freePerfCounters(PerfCounters *counters) {
+  for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+    if (counters->fds[i] >= 0)
+      close(counters->fds[i]);
+  }
+  FREE(counters->stats, PerfCounters, counters);
+}
+
+void perfPhaseStart(PerfCounters *counters) {
+  for (int i = 0; i < PERF_EVENT_COUNT; i++)
+    counters->start[i] = readEvent(counters, i);
+}
+
+void perfPhaseEnd(PerfCounters *counters, PerfPhase phase) {
+  for (int i = 0; i < PERF_EVENT_COUNT; i++)
+    counters->counts[phase][i] += readEvent(counters, i) - counters->start[i];
+}
+
+// Prints the counts, divided by `ops` unless it's 0.
+static void printRow(PerfCounters *counters, const char *label,
+                     const uint64_t counts[], unsigned long ops, FILE *out) {
+  fprintf(out, "%-10s", label);
+  for (int i = 0; i < PERF_EVENT_COUNT; i++) {
+    if (counters->fds[i] < 0)
+      fprintf(out, " %14s", "-");
+    else if (ops == 0)
+      fprintf(out, " %14lu", (unsigned long)counts[i]);
+    else
+      fprintf(out, " %14.3f", (double)counts[i] / ops);
+  }
+  fprintf(out, "\n");
+}
+
+void printPerfCounters(PerfCounters *counters, unsigned long ops, FILE *out) {
+  fprintf(out, "== Perf counters ==\n");
+  fprintf(out, "%-10s", "phase");
+  for (int i = 0; i < PERF_EVENT_COUNT; i++)
+    fprintf(out, " %14s", eventNames[i]);
+  fprintf(out, "\n");
+
+  uint64_t total[PERF_EVENT_COUNT] = {0};
+  for (int phase = 0; phase < PERF_PHASE_COUNT; phase++) {
+    printRow(counters, phaseNames[phase], counters->counts[phase], 0, out);
+    for (int i = 0; i < PERF_EVENT_COUNT; i++)
+      total[i] += counters->counts[phase][i];
+  }
+  printRow(counters, "total", total, 0, out);
+
+  if (ops > 0) {
+    printRow(counters, "run/op", counters->counts[PERF_RUN], ops, out);
+    fprintf(out, "(%lu bytecode instructions run)\n", ops);
+  }
+}
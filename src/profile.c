@@ -0,0 +1,342 @@
+#include "profile.h"
+#include "chunk.h"
+#include "debug.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct hot_site {
+  ObjFunction *func;
+  int loop; // Loop header offset, or -1 for the function itself
+  unsigned long count;
+} HotSite;
+
+typedef struct hot_sites {
+  HotSite *sites;
+  int count;
+  int capacity;
+  MemStats *stats;
+} HotSites;
+
+static void addSite(HotSites *sites, ObjFunction *func, int loop,
+                    unsigned long count) {
+  if (sites->count >= sites->capacity) {
+    int oldCap      = sites->capacity;
+    sites->capacity = GROW_CAPACITY(oldCap);
+    sites->sites    = GROW_ARRAY(sites->stats, HotSite, sites->sites, oldCap,
+                                 sites->capacity);
+  }
+
+  sites->sites[sites->count++] = (HotSite){func, loop, count};
+}
+
+static int compareSites(const void *a, const void *b) {
+  unsigned long countA = ((const HotSite *)a)->count;
+  unsigned long countB = ((const HotSite *)b)->count;
+  return countA < countB ? 1 : countA > countB ? -1 : 0;
+}
+
+static void printSites(HotSites *sites, VM *vm, FILE *out) {
+  qsort(sites->sites, sites->count, sizeof(HotSite), compareSites);
+
+  for (int i = 0; i < sites->count; i++) {
+    HotSite *site     = &sites->sites[i];
+    ObjFunction *func = site->func;
+
+    fprintf(out, "%12lu  ", site->count);
+    if (func->name == NULL) {
+      fprintf(out, "<script>");
+    } else {
+      fprintf(out, "%s()", func->name->chars);
+    }
+
+    if (site->loop != -1)
+      fprintf(out, " loop at line %d", getLine(&func->chunk, site->loop));
+    if (site->count >= vm->hotThreshold)
+      fprintf(out, " (hot%s)", func->jit != NULL ? ", compiled" : "");
+    fprintf(out, "\n");
+  }
+}
+
+void printHotnessReport(VM *vm, FILE *out) {
+  HotSites calls = {.stats = &vm->memStats}, loops = {.stats = &vm->memStats};
+
+  for (Obj *obj = vm->objects; obj != NULL; obj = obj->next) {
+    if (obj->type != OBJ_FUNCTION)
+      continue;
+
+    ObjFunction *func = (ObjFunction *)obj;
+    if (func->calls > 0)
+      addSite(&calls, func, -1, func->calls);
+
+    if (func->loopCounts == NULL)
+      continue;
+    for (int offset = 0; offset < func->chunk.count; offset++) {
+      if (func->loopCounts[offset] > 0)
+        addSite(&loops, func, offset, func->loopCounts[offset]);
+    }
+  }
+
+  fprintf(out, "== Hotness (threshold %lu) ==\n", vm->hotThreshold);
+  fprintf(out, "%12s  function\n", "calls");
+  printSites(&calls, vm, out);
+  fprintf(out, "%12s  loop\n", "back-edges");
+  printSites(&loops, vm, out);
+
+  FREE_ARRAY(calls.stats, HotSite, calls.sites, calls.capacity);
+  FREE_ARRAY(loops.stats, HotSite, loops.sites, loops.capacity);
+}
+
+// Number of entries printed in each section of the text report.
+#define REPORT_TOP 20
+
+OpProfile *newOpProfile(MemStats *stats) {
+  OpProfile *profile = ALLOCATE(stats, OpProfile, 1);
+  memset(profile, 0, sizeof(OpProfile));
+  profile->previous = -1;
+  profile->stats    = stats;
+  return profile;
+}
+
+void freeOpProfile(OpProfile *profile) {
+  FREE(profile->stats, OpProfile, profile);
+}
+
+void profileInstruction(OpProfile *profile, ObjFunction *func, int offset,
+                        uint8_t instruction) {
+  if (func->opCounts == NULL) {
+    func->opCounts = ALLOCATE(profile->stats, unsigned long, func->chunk.count);
+    memset(func->opCounts, 0, sizeof(unsigned long) * func->chunk.count);
+  }
+
+  func->opCounts[offset]++;
+  profile->total++;
+  profile->counts[instruction]++;
+  if (profile->previous != -1)
+    profile->pairs[profile->previous][instruction]++;
+  profile->previous = instruction;
+}
+
+typedef struct count_entry {
+  int key;     // Opcode, opcode pair (first * OP_COUNT + second) or line
+  void *owner; // Function the entry belongs to, if any
+  unsigned long count;
+} CountEntry;
+
+typedef struct count_list {
+  CountEntry *entries;
+  int count;
+  int capacity;
+  MemStats *stats;
+} CountList;
+
+static void addCount(CountList *list, int key, void *owner,
+                     unsigned long count) {
+  if (list->count >= list->capacity) {
+    int oldCap     = list->capacity;
+    list->capacity = GROW_CAPACITY(oldCap);
+    list->entries  = GROW_ARRAY(list->stats, CountEntry, list->entries, oldCap,
+                                list->capacity);
+  }
+
+  list->entries[list->count++] = (CountEntry){key, owner, count};
+}
+
+static void freeCounts(CountList *list) {
+  FREE_ARRAY(list->stats, CountEntry, list->entries, list->capacity);
+}
+
+static int compareCounts(const void *a, const void *b) {
+  const CountEntry *entryA = a, *entryB = b;
+  if (entryA->count != entryB->count)
+    return entryA->count < entryB->count ? 1 : -1;
+  return entryA->key - entryB->key;
+}
+
+static int compareKeys(const void *a, const void *b) {
+  return ((const CountEntry *)a)->key - ((const CountEntry *)b)->key;
+}
+
+static const char *functionName(ObjFunction *func) {
+  return func->name == NULL ? "<script>" : func->name->chars;
+}
+
+static void collectOpcodes(OpProfile *profile, CountList *opcodes,
+                           CountList *pairs) {
+  for (int op = 0; op < OP_COUNT; op++) {
+    if (profile->counts[op] > 0)
+      addCount(opcodes, op, NULL, profile->counts[op]);
+
+    for (int next = 0; next < OP_COUNT; next++) {
+      if (profile->pairs[op][next] > 0)
+        addCount(pairs, op * OP_COUNT + next, NULL, profile->pairs[op][next]);
+    }
+  }
+
+  qsort(opcodes->entries, opcodes->count, sizeof(CountEntry), compareCounts);
+  qsort(pairs->entries, pairs->count, sizeof(CountEntry), compareCounts);
+}
+
+// Lists the functions that ran, with their instruction counts.
+static void collectFunctions(VM *vm, CountList *functions) {
+  for (Obj *obj = vm->objects; obj != NULL; obj = obj->next) {
+    ObjFunction *func = (ObjFunction *)obj;
+    if (obj->type != OBJ_FUNCTION || func->opCounts == NULL)
+      continue;
+
+    unsigned long total = 0;
+    for (int i = 0; i < func->chunk.count; i++) {
+      total += func->opCounts[i];
+    }
+    addCount(functions, 0, func, total);
+  }
+
+  qsort(functions->entries, functions->count, sizeof(CountEntry),
+        compareCounts);
+}
+
+// Sums the function's instruction counts by source line, in line order, adding
+// them to the end of `lines`.
+static void collectLines(ObjFunction *func, CountList *lines) {
+  Chunk *chunk = &func->chunk;
+  int first    = lines->count;
+  int offset   = 0;
+
+  // Each run of the line table covers the offsets up to the next run
+  for (int run = 0; run < chunk->lineCount; run++) {
+    int end = run + 1 < chunk->lineCount ? chunk->lines[run + 1].offset
+                                         : chunk->count;
+    unsigned long count = 0;
+    for (; offset < end; offset++)
+      count += func->opCounts[offset];
+
+    if (count > 0)
+      addCount(lines, chunk->lines[run].line, func, count);
+  }
+
+  // A line split into several runs, like a loop's condition, is merged
+  CountEntry *added = lines->entries + first;
+  int addedCount    = lines->count - first;
+  qsort(added, addedCount, sizeof(CountEntry), compareKeys);
+
+  int merged = 0;
+  for (int i = 0; i < addedCount; i++) {
+    if (merged > 0 && added[merged - 1].key == added[i].key) {
+      added[merged - 1].count += added[i].count;
+    } else {
+      added[merged++] = added[i];
+    }
+  }
+  lines->count = first + merged;
+}
+
+static double percent(unsigned long count, unsigned long total) {
+  return total == 0 ? 0 : 100.0 * count / total;
+}
+
+void printOpProfile(VM *vm, FILE *out) {
+  OpProfile *profile = vm->profile;
+  MemStats *stats    = &vm->memStats;
+  CountList opcodes = {.stats = stats}, pairs = {.stats = stats};
+  CountList functions = {.stats = stats}, lines = {.stats = stats};
+
+  collectOpcodes(profile, &opcodes, &pairs);
+  collectFunctions(vm, &functions);
+  for (int i = 0; i < functions.count; i++) {
+    collectLines(functions.entries[i].owner, &lines);
+  }
+  qsort(lines.entries, lines.count, sizeof(CountEntry), compareCounts);
+
+  fprintf(out, "== Opcode profile: %lu instructions ==\n", profile->total);
+  for (int i = 0; i < opcodes.count; i++) {
+    CountEntry *entry = &opcodes.entries[i];
+    fprintf(out, "%12lu %6.2f%%  %s\n", entry->count,
+            percent(entry->count, profile->total), opcodeName(entry->key));
+  }
+
+  fprintf(out, "== Opcode pairs ==\n");
+  for (int i = 0; i < pairs.count && i < REPORT_TOP; i++) {
+    CountEntry *entry = &pairs.entries[i];
+    fprintf(out, "%12lu %6.2f%%  %s -> %s\n", entry->count,
+            percent(entry->count, profile->total),
+            opcodeName(entry->key / OP_COUNT), opcodeName(entry->key % OP_COUNT));
+  }
+
+  fprintf(out, "== Functions ==\n");
+  for (int i = 0; i < functions.count && i < REPORT_TOP; i++) {
+    CountEntry *entry = &functions.entries[i];
+    fprintf(out, "%12lu %6.2f%%  %s\n", entry->count,
+            percent(entry->count, profile->total),
+            functionName(entry->owner));
+  }
+
+  fprintf(out, "== Lines ==\n");
+  for (int i = 0; i < lines.count && i < REPORT_TOP; i++) {
+    CountEntry *entry = &lines.entries[i];
+    fprintf(out, "%12lu %6.2f%%  line %d in %s\n", entry->count,
+            percent(entry->count, profile->total), entry->key,
+            functionName(entry->owner));
+  }
+
+  freeCounts(&opcodes);
+  freeCounts(&pairs);
+  freeCounts(&functions);
+  freeCounts(&lines);
+}
+
+bool writeOpProfile(VM *vm, const char *path) {
+  FILE *out = fopen(path, "w");
+  if (out == NULL)
+    return false;
+
+  OpProfile *profile = vm->profile;
+  MemStats *stats    = &vm->memStats;
+  CountList opcodes = {.stats = stats}, pairs = {.stats = stats};
+  CountList functions = {.stats = stats};
+  collectOpcodes(profile, &opcodes, &pairs);
+  collectFunctions(vm, &functions);
+
+  fprintf(out, "{\n  \"total\": %lu,\n  \"opcodes\": {", profile->total);
+  for (int i = 0; i < opcodes.count; i++) {
+    CountEntry *entry = &opcodes.entries[i];
+    fprintf(out, "%s\n    \"%s\": %lu", i == 0 ? "" : ",",
+            opcodeName(entry->key), entry->count);
+  }
+
+  fprintf(out, "\n  },\n  \"pairs\": [");
+  for (int i = 0; i < pairs.count; i++) {
+    CountEntry *entry = &pairs.entries[i];
+    fprintf(out, "%s\n    [\"%s\", \"%s\", %lu]", i == 0 ? "" : ",",
+            opcodeName(entry->key / OP_COUNT), opcodeName(entry->key % OP_COUNT),
+            entry->count);
+  }
+
+  // Function names are identifiers, so they never need escaping
+  fprintf(out, "\n  ],\n  \"functions\": [");
+  for (int i = 0; i < functions.count; i++) {
+    CountEntry *entry = &functions.entries[i];
+    CountList lines   = {.stats = stats};
+    collectLines(entry->owner, &lines);
+
+    fprintf(out, "%s\n    {\"name\": \"%s\", \"count\": %lu, \"lines\": {",
+            i == 0 ? "" : ",", functionName(entry->owner), entry->count);
+    for (int j = 0; j < lines.count; j++) {
+      fprintf(out, "%s\"%d\": %lu", j == 0 ? "" : ", ", lines.entries[j].key,
+              lines.entries[j].count);
+    }
+    fprintf(out, "}}");
+
+    freeCounts(&lines);
+  }
+  fprintf(out, "\n  ]\n}\n");
+
+  freeCounts(&opcodes);
+  freeCounts(&pairs);
+  freeCounts(&functions);
+
+  return fclose(out) == 0;
+}
@@ -0,0 +1,1025 @@
+#include "chunk.h"
+#include "compiler.h"
+#include "debug.h"
+#include "number.h"
+#include "object.h"
+#include "scanner.h"
+#include "value.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Compiler backend for the register-based instruction set (see RegOpCode).
+ *
+ * The front end mirrors compiler.c, but instead of leaving every value on the
+ * stack each expression is described by an ExpDesc naming the register that
+ * holds its result. Locals are pinned to the register matching their slot, so
+ * reading one costs no instruction at all, and temporaries are allocated in
+ * stack order above the locals.
+ */
+
+#define REG_MAX   UINT8_MAX
+#define BX_MAX    UINT16_MAX
+#define OPERAND_A 1
+
+typedef struct local {
+  Token name;
+  int depth;
+} Local;
+
+typedef enum function_type { TYPE_FUNCTION, TYPE_SCRIPT } FunctionType;
+
+typedef struct reg_compiler {
+  struct reg_compiler *enclosing;
+  ObjFunction *function;
+  FunctionType type;
+  Local locals[UINT8_MAX + 1];
+  int localCount;
+  int scopeDepth;
+  int freeReg;           // First register not holding a local or live temporary
+  int maxRegs;           // Peak registers in use, the frame's slot count
+  int localWrites;       // Bumped on every assignment to a local's register
+  ConstantMap constants; // Indexes the function's constants by value
+} RegCompiler;
+
+typedef struct reg_parser {
+  Token current;
+  Token previous;
+  bool hadError;
+  bool panicMode;
+  Scanner *scanner;
+  RegCompiler *currentCompiler;
+  VM *vm;
+} RegParser;
+
+typedef enum exp_kind {
+  EXP_LOCAL, // Value lives in a local's register, which must not be freed
+  EXP_TEMP   // Value lives in the topmost allocated temporary register
+} ExpKind;
+
+// Describes where the result of a compiled expression can be found.
+typedef struct exp_desc {
+  ExpKind kind;
+  int reg;
+  // Offset of the single instruction that produced a temporary, whose A
+  // operand may be retargeted to write straight into another register.
+  // Set to -1 if the value was produced by more than one instruction.
+  int pc;
+} ExpDesc;
+
+typedef enum precedence {
+  PREC_NONE,
+  PREC_ASSIGNMENT, // =
+  PREC_OR,         // or
+  PREC_AND,        // and
+  PREC_EQUALITY,   // == !=
+  PREC_COMPARISON, // < > <= >=
+  PREC_TERM,       // + -
+  PREC_FACTOR,     // * /
+  PREC_UNARY,      // ! -
+  PREC_CALL,       // . ()
+  PREC_PRIMARY
+} Precedence;
+
+typedef void (*ParseFn)(RegParser *parser, ExpDesc *e, bool canAssign);
+
+typedef struct parse_rule {
+  ParseFn prefix;
+  ParseFn infix;
+  Precedence precedence;
+} ParseRule;
+
+static void initCompiler(RegParser *parser, RegCompiler *compiler,
+                         FunctionType type) {
+  compiler->enclosing   = parser->currentCompiler;
+  compiler->type        = type;
+  compiler->localCount  = 0;
+  compiler->scopeDepth  = 0;
+  compiler->localWrites = 0;
+  compiler->function    = newFunction(parser->vm);
+  initConstantMap(&compiler->constants, &parser->vm->memStats);
+
+  parser->currentCompiler = compiler;
+
+  if (type != TYPE_SCRIPT) {
+    compiler->function->name =
+        copyString(parser->vm, parser->previous.start, parser->previous.length);
+  }
+
+  // Register 0 holds the function being called.
+  Local *local       = &compiler->locals[compiler->localCount++];
+  local->depth       = 0;
+  local->name.start  = "";
+  local->name.length = 0;
+  compiler->freeReg  = 1;
+  compiler->maxRegs  = 1;
+}
+
+static Chunk *currentChunk(RegParser *parser) {
+  return &parser->currentCompiler->function->chunk;
+}
+
+static void errorAt(RegParser *parser, Token *token, const char *message) {
+  if (parser->panicMode)
+    return;
+
+  parser->panicMode = true;
+
+  fprintf(stderr, "[line %d], Error", token->line);
+
+  if (token->type == TOK_EOF) {
+    fprintf(stderr, " at end");
+  } else if (token->type == TOK_ERR) {
+  } else {
+    fprintf(stderr, " at '%.*s'", token->length, token->start);
+  }
+
+  fprintf(stderr, ": %s\n", message);
+  parser->hadError = true;
+}
+
+static void errorAtPrevious(RegParser *parser, const char *message) {
+  errorAt(parser, &parser->previous, message);
+}
+
+static void errorAtCurrent(RegParser *parser, const char *message) {
+  errorAt(parser, &parser->current, message);
+}
+
+static void advance(RegParser *parser) {
+  parser->previous = parser->current;
+
+  while (true) {
+    parser->current = scanToken(parser->scanner);
+
+    if (parser->current.type != TOK_ERR)
+      break;
+
+    errorAtCurrent(parser, parser->current.start);
+  }
+}
+
+static void consume(RegParser *parser, TokenType type, const char *message) {
+  if (parser->current.type != type) {
+    errorAtCurrent(parser, message);
+    return;
+  }
+
+  advance(parser);
+}
+
+static bool check(RegParser *parser, TokenType type) {
+  return parser->current.type == type;
+}
+
+static bool match(RegParser *parser, TokenType type) {
+  if (!check(parser, type))
+    return false;
+
+  advance(parser);
+  return true;
+}
+
+// Emits an instruction and returns its offset in the current chunk.
+static int emitABC(RegParser *parser, RegOpCode op, int a, int b, int c) {
+  Chunk *chunk = currentChunk(parser);
+  int line     = parser->previous.line;
+  int offset   = chunk->count;
+
+  writeChunk(chunk, op, line);
+  writeChunk(chunk, a, line);
+  writeChunk(chunk, b, line);
+  writeChunk(chunk, c, line);
+  return offset;
+}
+
+static int emitABx(RegParser *parser, RegOpCode op, int a, int bx) {
+  return emitABC(parser, op, a, (bx >> 8) & 0xff, bx & 0xff);
+}
+
+static int emitJump(RegParser *parser, RegOpCode op, int reg) {
+  return emitABx(parser, op, reg, 0xffff);
+}
+
+static void patchJump(RegParser *parser, int offset) {
+  Chunk *chunk = currentChunk(parser);
+
+  int bytesToJump = chunk->count - offset - REG_INSTRUCTION_BYTES;
+  if (bytesToJump > BX_MAX) {
+    errorAtPrevious(parser, "too much code to jump over");
+  }
+
+  chunk->code[offset + 2] = (bytesToJump >> 8) & 0xff;
+  chunk->code[offset + 3] = bytesToJump & 0xff;
+}
+
+static void emitLoop(RegParser *parser, int loopStart) {
+  int offset = currentChunk(parser)->count - loopStart + REG_INSTRUCTION_BYTES;
+  if (offset > BX_MAX) {
+    errorAtPrevious(parser, "Loop body too large.");
+  }
+
+  emitABx(parser, ROP_LOOP, 0, offset);
+}
+
+static int makeConstant(RegParser *parser, Value value) {
+  Chunk *chunk     = currentChunk(parser);
+  ConstantMap *map = &parser->currentCompiler->constants;
+
+  // Repeated numbers and strings share a constant
+  int index = findConstant(map, value);
+  if (index != -1)
+    return index;
+
+  if (chunk->constants.count > BX_MAX) {
+    errorAtPrevious(parser, "Too many constants in one chunk.");
+    return 0;
+  }
+
+  index = addConstant(chunk, value);
+  mapConstant(map, value, index);
+  return index;
+}
+
+static int identifierConstant(RegParser *parser, Token *name) {
+  Value nameVal = OBJ_VAL(copyString(parser->vm, name->start, name->length));
+  return makeConstant(parser, nameVal);
+}
+
+static bool identifiersEqual(Token *a, Token *b) {
+  return a->length == b->length && strncmp(a->start, b->start, a->length) == 0;
+}
+
+// Raises the function's slot count to cover the first `count` registers.
+static void useRegs(RegCompiler *compiler, int count) {
+  if (count > compiler->maxRegs)
+    compiler->maxRegs = count;
+}
+
+static int allocReg(RegParser *parser) {
+  RegCompiler *compiler = parser->currentCompiler;
+
+  if (compiler->freeReg > REG_MAX) {
+    errorAtPrevious(parser, "Expression needs too many registers.");
+    return REG_MAX;
+  }
+
+  useRegs(compiler, compiler->freeReg + 1);
+  return compiler->freeReg++;
+}
+
+static void freeExp(RegParser *parser, ExpDesc *e) {
+  if (e->kind == EXP_TEMP) {
+    parser->currentCompiler->freeReg--;
+  }
+}
+
+static void setTemp(ExpDesc *e, int reg, int pc) {
+  e->kind = EXP_TEMP;
+  e->reg  = reg;
+  e->pc   = pc;
+}
+
+// Makes sure the expression's value is in a freshly allocated top register.
+static void toNextReg(RegParser *parser, ExpDesc *e) {
+  if (e->kind == EXP_TEMP)
+    return;
+
+  int reg = allocReg(parser);
+  setTemp(e, reg, emitABC(parser, ROP_MOVE, reg, e->reg, 0));
+}
+
+// Stores the expression's value into the given register, releasing its temp.
+static void toReg(RegParser *parser, ExpDesc *e, int dest) {
+  Chunk *chunk = currentChunk(parser);
+
+  if (e->kind == EXP_TEMP && e->pc != -1 &&
+      e->pc == chunk->count - REG_INSTRUCTION_BYTES) {
+    // Retarget the instruction producing the value instead of adding a move.
+    chunk->code[e->pc + OPERAND_A] = dest;
+  } else if (e->reg != dest) {
+    emitABC(parser, ROP_MOVE, dest, e->reg, 0);
+  }
+
+  freeExp(parser, e);
+}
+
+// Bumps a register operand up by one if it's at or above `base`.
+static void shiftOperand(RegParser *parser, uint8_t *operand, int base) {
+  if (*operand < base)
+    return;
+
+  if (*operand >= REG_MAX) {
+    errorAtPrevious(parser, "Expression needs too many registers.");
+    return;
+  }
+  (*operand)++;
+  useRegs(parser->currentCompiler, *operand + 1);
+}
+
+/*
+ * Moves every register from `base` up one in the code from `start` on, which
+ * only ever uses registers above `base` as temporaries, to free `base` for a
+ * value computed before that code.
+ */
+static void shiftRegisters(RegParser *parser, int start, int base) {
+  Chunk *chunk = currentChunk(parser);
+
+  for (int offset = start; offset < chunk->count;
+       offset += REG_INSTRUCTION_BYTES) {
+    uint8_t *ip = &chunk->code[offset];
+
+    switch (ip[0]) {
+      case ROP_JUMP:
+      case ROP_LOOP:
+      case ROP_RETURN_NIL: break;
+      case ROP_LOADK:
+      case ROP_NIL:
+      case ROP_TRUE:
+      case ROP_FALSE:
+      case ROP_GET_GLOBAL:
+      case ROP_DEFINE_GLOBAL:
+      case ROP_SET_GLOBAL:
+      case ROP_PRINT:
+      case ROP_JUMP_IF_FALSE:
+      case ROP_JUMP_IF_TRUE:
+      case ROP_CALL:
+      case ROP_RETURN:        shiftOperand(parser, &ip[1], base); break;
+      case ROP_MOVE:
+      case ROP_NOT:
+      case ROP_NEGATE:
+        shiftOperand(parser, &ip[1], base);
+        shiftOperand(parser, &ip[2], base);
+        break;
+      default:
+        shiftOperand(parser, &ip[1], base);
+        shiftOperand(parser, &ip[2], base);
+        shiftOperand(parser, &ip[3], base);
+        break;
+    }
+  }
+}
+
+static ObjFunction *endCompiler(RegParser *parser) {
+  emitABC(parser, ROP_RETURN_NIL, 0, 0, 0);
+  ObjFunction *func = parser->currentCompiler->function;
+  func->maxSlots    = parser->currentCompiler->maxRegs;
+
+#ifdef DEBUG_PRINT_CODE
+  if (!parser->hadError) {
+    char *name = func->name == NULL ? "<script>" : func->name->chars;
+    disassembleRegChunk(currentChunk(parser), name);
+  }
+#endif
+
+  freeConstantMap(&parser->currentCompiler->constants);
+  parser->currentCompiler = parser->currentCompiler->enclosing;
+  return func;
+}
+
+static void beginScope(RegParser *parser) {
+  parser->currentCompiler->scopeDepth++;
+}
+
+static void endScope(RegParser *parser) {
+  RegCompiler *compiler = parser->currentCompiler;
+
+  compiler->scopeDepth--;
+
+  // Locals going out of scope simply give their registers back.
+  while (compiler->localCount > 0 &&
+         compiler->locals[compiler->localCount - 1].depth >
+             compiler->scopeDepth) {
+    compiler->localCount--;
+  }
+
+  compiler->freeReg = compiler->localCount;
+}
+
+static bool inGlobalScope(RegParser *parser) {
+  return parser->currentCompiler->scopeDepth == 0;
+}
+
+static void addLocal(RegParser *parser, Token name) {
+  RegCompiler *compiler = parser->currentCompiler;
+
+  if (compiler->localCount > UINT8_MAX) {
+    errorAtPrevious(parser, "Too many local variables in function.");
+    return;
+  }
+
+  Local *local = &compiler->locals[compiler->localCount++];
+  local->name  = name;
+  local->depth = -1;
+  useRegs(compiler, compiler->localCount);
+}
+
+static int resolveLocal(RegParser *parser, Token *name) {
+  RegCompiler *compiler = parser->currentCompiler;
+
+  for (int i = compiler->localCount - 1; i >= 0; i--) {
+    Local *local = &compiler->locals[i];
+
+    if (identifiersEqual(name, &local->name)) {
+      if (local->depth == -1) {
+        errorAtPrevious(parser,
+                        "Can't read local variable int its own initializer.");
+      }
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static void expression(RegParser *parser, ExpDesc *e);
+static void statement(RegParser *parser);
+static void declarationStatement(RegParser *parser);
+static void parsePrecedence(RegParser *parser, Precedence precedence,
+                            ExpDesc *e);
+static ParseRule *getRule(TokenType type);
+
+static void loadConstant(RegParser *parser, ExpDesc *e, Value value) {
+  int constantIndex = makeConstant(parser, value);
+  int reg           = allocReg(parser);
+  setTemp(e, reg, emitABx(parser, ROP_LOADK, reg, constantIndex));
+}
+
+static void number(RegParser *parser, ExpDesc *e,
+                   bool __attribute__((unused)) canAssign) {
+  double value = parseNumber(parser->previous.start, parser->previous.length);
+  loadConstant(parser, e, NUM_VAL(value));
+}
+
+static void string(RegParser *parser, ExpDesc *e,
+                   bool __attribute__((unused)) canAssign) {
+  ObjString *s = copyString(parser->vm, parser->previous.start + 1,
+                            parser->previous.length - 2);
+  loadConstant(parser, e, OBJ_VAL(s));
+}
+
+static void literal(RegParser *parser, ExpDesc *e,
+                    bool __attribute__((unused)) canAssign) {
+  RegOpCode op;
+
+  switch (parser->previous.type) {
+    case TOK_FALSE: op = ROP_FALSE; break;
+    case TOK_TRUE:  op = ROP_TRUE; break;
+    default:        op = ROP_NIL; break;
+  }
+
+  int reg = allocReg(parser);
+  setTemp(e, reg, emitABC(parser, op, reg, 0, 0));
+}
+
+static void grouping(RegParser *parser, ExpDesc *e,
+                     bool __attribute__((unused)) canAssign) {
+  expression(parser, e);
+  consume(parser, TOK_RIGHT_PAREN, "expect ')' after expression.");
+}
+
+static void unary(RegParser *parser, ExpDesc *e,
+                  bool __attribute__((unused)) canAssign) {
+  TokenType opType = parser->previous.type;
+
+  parsePrecedence(parser, PREC_UNARY, e);
+
+  RegOpCode op = opType == TOK_MINUS ? ROP_NEGATE : ROP_NOT;
+  int src      = e->reg;
+  freeExp(parser, e);
+
+  int reg = allocReg(parser);
+  setTemp(e, reg, emitABC(parser, op, reg, src, 0));
+}
+
+static void binary(RegParser *parser, ExpDesc *e,
+                   bool __attribute__((unused)) canAssign) {
+  TokenType opType = parser->previous.type;
+  ParseRule *rule  = getRule(opType);
+
+  RegCompiler *compiler = parser->currentCompiler;
+  int start             = currentChunk(parser)->count;
+  int base              = compiler->freeReg;
+  int localWrites       = compiler->localWrites;
+
+  ExpDesc right;
+  parsePrecedence(parser, rule->precedence + 1, &right);
+
+  // The left operand is read straight from its local's register, which is
+  // only sound if the right operand doesn't assign to a local. If it did,
+  // copy the left operand into a temporary ahead of the right operand's code,
+  // moving that code's registers up to make room.
+  if (e->kind == EXP_LOCAL && compiler->localWrites != localWrites) {
+    shiftRegisters(parser, start, base);
+    if (right.kind == EXP_TEMP)
+      right.reg++;
+    if (right.pc != -1)
+      right.pc += REG_INSTRUCTION_BYTES;
+    compiler->freeReg++;
+    useRegs(compiler, compiler->freeReg);
+
+    uint8_t move[] = {ROP_MOVE, base, e->reg, 0};
+    insertChunk(currentChunk(parser), start, move, REG_INSTRUCTION_BYTES);
+    setTemp(e, base, -1);
+  }
+
+  RegOpCode op;
+  switch (opType) {
+    case TOK_PLUS:       op = ROP_ADD; break;
+    case TOK_MINUS:      op = ROP_SUBTRACT; break;
+    case TOK_STAR:       op = ROP_MULTIPLY; break;
+    case TOK_SLASH:      op = ROP_DIVIDE; break;
+    case TOK_BANG_EQ:    op = ROP_NOT_EQ; break;
+    case TOK_EQ_EQ:      op = ROP_EQ; break;
+    case TOK_GREATER:    op = ROP_GREATER; break;
+    case TOK_GREATER_EQ: op = ROP_GREATER_EQ; break;
+    case TOK_LESS:       op = ROP_LESS; break;
+    case TOK_LESS_EQ:    op = ROP_LESS_EQ; break;
+    default:             return;
+  }
+
+  int leftReg = e->reg, rightReg = right.reg;
+  freeExp(parser, &right);
+  freeExp(parser, e);
+
+  int reg = allocReg(parser);
+  setTemp(e, reg, emitABC(parser, op, reg, leftReg, rightReg));
+}
+
+static void namedVariable(RegParser *parser, ExpDesc *e, Token *name,
+                          bool canAssign) {
+  int localReg = resolveLocal(parser, name);
+
+  if (localReg != -1) {
+    if (canAssign && match(parser, TOK_EQ)) {
+      expression(parser, e);
+      toReg(parser, e, localReg);
+      parser->currentCompiler->localWrites++;
+    }
+
+    e->kind = EXP_LOCAL;
+    e->reg  = localReg;
+    e->pc   = -1;
+    return;
+  }
+
+  int nameIndex = identifierConstant(parser, name);
+
+  if (canAssign && match(parser, TOK_EQ)) {
+    // The assigned value is also the value of the assignment expression.
+    expression(parser, e);
+    emitABx(parser, ROP_SET_GLOBAL, e->reg, nameIndex);
+    e->pc = -1;
+    return;
+  }
+
+  int reg = allocReg(parser);
+  setTemp(e, reg, emitABx(parser, ROP_GET_GLOBAL, reg, nameIndex));
+}
+
+static void variable(RegParser *parser, ExpDesc *e, bool canAssign) {
+  namedVariable(parser, e, &parser->previous, canAssign);
+}
+
+static void declareVariable(RegParser *parser) {
+  if (inGlobalScope(parser))
+    return;
+
+  Token name            = parser->previous;
+  RegCompiler *compiler = parser->currentCompiler;
+
+  for (int i = compiler->localCount - 1; i >= 0; i--) {
+    Local *local = &compiler->locals[i];
+
+    if (local->depth != -1 && local->depth < compiler->scopeDepth)
+      break;
+
+    if (identifiersEqual(&name, &local->name)) {
+      errorAtPrevious(parser,
+                      "already a variable with this name in this scope.");
+    }
+  }
+
+  addLocal(parser, name);
+}
+
+static void logicalAnd(RegParser *parser, ExpDesc *e,
+                       bool __attribute__((unused)) canAssign) {
+  toNextReg(parser, e);
+  int endJump = emitJump(parser, ROP_JUMP_IF_FALSE, e->reg);
+
+  ExpDesc right;
+  parsePrecedence(parser, PREC_AND, &right);
+  toReg(parser, &right, e->reg);
+
+  patchJump(parser, endJump);
+  e->pc = -1;
+}
+
+static void logicalOr(RegParser *parser, ExpDesc *e,
+                      bool __attribute__((unused)) canAssign) {
+  toNextReg(parser, e);
+  int endJump = emitJump(parser, ROP_JUMP_IF_TRUE, e->reg);
+
+  ExpDesc right;
+  parsePrecedence(parser, PREC_OR, &right);
+  toReg(parser, &right, e->reg);
+
+  patchJump(parser, endJump);
+  e->pc = -1;
+}
+
+static void call(RegParser *parser, ExpDesc *e,
+                 bool __attribute__((unused)) canAssign) {
+  // The callee and its arguments occupy consecutive registers, which become
+  // the start of the callee's register window.
+  toNextReg(parser, e);
+  int base = e->reg;
+
+  uint8_t argCount = 0;
+  if (!check(parser, TOK_RIGHT_PAREN)) {
+    do {
+      ExpDesc arg;
+      expression(parser, &arg);
+      toNextReg(parser, &arg);
+
+      if (argCount == UINT8_MAX) {
+        errorAtPrevious(parser, "can't have more than 255 arguments");
+      }
+
+      argCount++;
+    } while (match(parser, TOK_COMMA));
+  }
+
+  consume(parser, TOK_RIGHT_PAREN, "expect ')' after arguments");
+
+  emitABC(parser, ROP_CALL, base, argCount, 0);
+  parser->currentCompiler->freeReg = base + 1;
+  setTemp(e, base, -1);
+}
+
+static ParseRule regRules[] = {
+    [TOK_LEFT_PAREN]  = {grouping, call,       PREC_CALL      },
+    [TOK_RIGHT_PAREN] = {NULL,     NULL,       PREC_NONE      },
+    [TOK_LEFT_BRACE]  = {NULL,     NULL,       PREC_NONE      },
+    [TOK_RIGHT_BRACE] = {NULL,     NULL,       PREC_NONE      },
+    [TOK_COMMA]       = {NULL,     NULL,       PREC_NONE      },
+    [TOK_DOT]         = {NULL,     NULL,       PREC_NONE      },
+    [TOK_MINUS]       = {unary,    binary,     PREC_TERM      },
+    [TOK_PLUS]        = {NULL,     binary,     PREC_TERM      },
+    [TOK_SEMICOLON]   = {NULL,     NULL,       PREC_NONE      },
+    [TOK_SLASH]       = {NULL,     binary,     PREC_FACTOR    },
+    [TOK_STAR]        = {NULL,     binary,     PREC_FACTOR    },
+    [TOK_BANG]        = {unary,    NULL,       PREC_UNARY     },
+    [TOK_BANG_EQ]     = {NULL,     binary,     PREC_COMPARISON},
+    [TOK_EQ]          = {NULL,     NULL,       PREC_NONE      },
+    [TOK_EQ_EQ]       = {NULL,     binary,     PREC_COMPARISON},
+    [TOK_GREATER]     = {NULL,     binary,     PREC_COMPARISON},
+    [TOK_GREATER_EQ]  = {NULL,     binary,     PREC_COMPARISON},
+    [TOK_LESS]        = {NULL,     binary,     PREC_COMPARISON},
+    [TOK_LESS_EQ]     = {NULL,     binary,     PREC_COMPARISON},
+    [TOK_IDENTIFIER]  = {variable, NULL,       PREC_NONE      },
+    [TOK_STRING]      = {string,   NULL,       PREC_NONE      },
+    [TOK_NUMBER]      = {number,   NULL,       PREC_NONE      },
+    [TOK_AND]         = {NULL,     logicalAnd, PREC_AND       },
+    [TOK_CLASS]       = {NULL,     NULL,       PREC_NONE      },
+    [TOK_ELSE]        = {NULL,     NULL,       PREC_NONE      },
+    [TOK_FALSE]       = {literal,  NULL,       PREC_NONE      },
+    [TOK_FOR]         = {NULL,     NULL,       PREC_NONE      },
+    [TOK_FUN]         = {NULL,     NULL,       PREC_NONE      },
+    [TOK_IF]          = {NULL,     NULL,       PREC_NONE      },
+    [TOK_NIL]         = {literal,  NULL,       PREC_NONE      },
+    [TOK_OR]          = {NULL,     logicalOr,  PREC_OR        },
+    [TOK_PRINT]       = {NULL,     NULL,       PREC_NONE      },
+    [TOK_RETURN]      = {NULL,     NULL,       PREC_NONE      },
+    [TOK_SUPER]       = {NULL,     NULL,       PREC_NONE      },
+    [TOK_THIS]        = {NULL,     NULL,       PREC_NONE      },
+    [TOK_TRUE]        = {literal,  NULL,       PREC_NONE      },
+    [TOK_VAR]         = {NULL,     NULL,       PREC_NONE      },
+    [TOK_WHILE]       = {NULL,     NULL,       PREC_NONE      },
+    [TOK_ERR]         = {NULL,     NULL,       PREC_NONE      },
+    [TOK_EOF]         = {NULL,     NULL,       PREC_NONE      },
+};
+
+static ParseRule *getRule(TokenType type) { return &regRules[type]; }
+
+static void parsePrecedence(RegParser *parser, Precedence precedence,
+                            ExpDesc *e) {
+  advance(parser);
+
+  ParseFn prefixRule = getRule(parser->previous.type)->prefix;
+  if (prefixRule == NULL) {
+    errorAtPrevious(parser, "expect expression");
+    setTemp(e, allocReg(parser), -1);
+    return;
+  }
+
+  bool canAssign = precedence <= PREC_ASSIGNMENT;
+  prefixRule(parser, e, canAssign);
+
+  while (precedence <= getRule(parser->current.type)->precedence) {
+    advance(parser);
+    ParseFn infixRule = getRule(parser->previous.type)->infix;
+    infixRule(parser, e, canAssign);
+  }
+
+  if (canAssign && match(parser, TOK_EQ)) {
+    errorAtPrevious(parser, "Invalid assignment target.");
+  }
+}
+
+static void expression(RegParser *parser, ExpDesc *e) {
+  parsePrecedence(parser, PREC_ASSIGNMENT, e);
+}
+
+static void markInitialized(RegCompiler *compiler) {
+  if (compiler->scopeDepth == 0)
+    return;
+
+  compiler->locals[compiler->localCount - 1].depth = compiler->scopeDepth;
+}
+
+// Parses a variable name. Globals return the constant index of their name,
+// locals return the register reserved for them.
+static int parseVariable(RegParser *parser, const char *errorMessage) {
+  consume(parser, TOK_IDENTIFIER, errorMessage);
+
+  if (inGlobalScope(parser))
+    return identifierConstant(parser, &parser->previous);
+
+  declareVariable(parser);
+  return allocReg(parser);
+}
+
+// Binds the value of the given expression to a freshly parsed variable.
+static void defineVariable(RegParser *parser, int variable, ExpDesc *e) {
+  if (inGlobalScope(parser)) {
+    emitABx(parser, ROP_DEFINE_GLOBAL, e->reg, variable);
+    freeExp(parser, e);
+    return;
+  }
+
+  toReg(parser, e, variable);
+  markInitialized(parser->currentCompiler);
+}
+
+static void synchronize(RegParser *parser) {
+  parser->panicMode = false;
+
+  while (parser->current.type != TOK_EOF) {
+    if (parser->previous.type == TOK_SEMICOLON)
+      return;
+
+    switch (parser->current.type) {
+      case TOK_CLASS:
+      case TOK_FUN:
+      case TOK_VAR:
+      case TOK_FOR:
+      case TOK_IF:
+      case TOK_WHILE:
+      case TOK_PRINT:
+      case TOK_RETURN: return;
+      default:         advance(parser);
+    }
+  }
+}
+
+static void blockStatement(RegParser *parser) {
+  while (!check(parser, TOK_RIGHT_BRACE) && !check(parser, TOK_EOF)) {
+    declarationStatement(parser);
+  }
+
+  consume(parser, TOK_RIGHT_BRACE, "Expect '}' after block.");
+}
+
+static void function(RegParser *parser, ExpDesc *e, FunctionType type) {
+  RegCompiler compiler;
+  initCompiler(parser, &compiler, type);
+  beginScope(parser);
+
+  consume(parser, TOK_LEFT_PAREN, "expect '(' after function name");
+  if (!check(parser, TOK_RIGHT_PAREN)) {
+    do {
+      compiler.function->arity++;
+      if (compiler.function->arity > UINT8_MAX) {
+        errorAtCurrent(parser, "can't have more than 255 parameters");
+      }
+      parseVariable(parser, "expect parameter name");
+      markInitialized(&compiler);
+    } while (match(parser, TOK_COMMA));
+  }
+
+  consume(parser, TOK_RIGHT_PAREN, "expect ')' after parameters");
+  consume(parser, TOK_LEFT_BRACE, "expect '{' after function body");
+  blockStatement(parser);
+
+  ObjFunction *func = endCompiler(parser);
+  loadConstant(parser, e, OBJ_VAL(func));
+}
+
+static void funDeclaration(RegParser *parser) {
+  int variable = parseVariable(parser, "expect function name");
+  markInitialized(parser->currentCompiler);
+
+  ExpDesc e;
+  function(parser, &e, TYPE_FUNCTION);
+  defineVariable(parser, variable, &e);
+}
+
+static void varDeclaration(RegParser *parser) {
+  int variable = parseVariable(parser, "Expect variable name.");
+
+  ExpDesc e;
+  if (match(parser, TOK_EQ)) {
+    expression(parser, &e);
+  } else {
+    int reg = allocReg(parser);
+    setTemp(&e, reg, emitABC(parser, ROP_NIL, reg, 0, 0));
+  }
+
+  consume(parser, TOK_SEMICOLON, "Expect ';' after variable declaration.");
+
+  defineVariable(parser, variable, &e);
+}
+
+static void expressionStatement(RegParser *parser) {
+  ExpDesc e;
+  expression(parser, &e);
+  consume(parser, TOK_SEMICOLON, "expect ';' after expresssion");
+  freeExp(parser, &e);
+}
+
+// Compiles a condition and emits a jump taken when it is falsy.
+static int condition(RegParser *parser) {
+  ExpDesc e;
+  expression(parser, &e);
+  int jump = emitJump(parser, ROP_JUMP_IF_FALSE, e.reg);
+  freeExp(parser, &e);
+  return jump;
+}
+
+static void ifStatement(RegParser *parser) {
+  consume(parser, TOK_LEFT_PAREN, "expect '(' after 'if'");
+  int thenJump = condition(parser);
+  consume(parser, TOK_RIGHT_PAREN, "expect ')' after condition");
+
+  statement(parser);
+
+  if (match(parser, TOK_ELSE)) {
+    int elseJump = emitJump(parser, ROP_JUMP, 0);
+    patchJump(parser, thenJump);
+    statement(parser);
+    patchJump(parser, elseJump);
+  } else {
+    patchJump(parser, thenJump);
+  }
+}
+
+static void whileStatement(RegParser *parser) {
+  int loopStart = currentChunk(parser)->count;
+
+  consume(parser, TOK_LEFT_PAREN, "expect '(' after while");
+  int exitJump = condition(parser);
+  consume(parser, TOK_RIGHT_PAREN, "expect ')' after while");
+
+  statement(parser);
+  emitLoop(parser, loopStart);
+
+  patchJump(parser, exitJump);
+}
+
+static void forStatement(RegParser *parser) {
+  beginScope(parser);
+
+  consume(parser, TOK_LEFT_PAREN, "expect '(' after 'for'");
+  if (match(parser, TOK_SEMICOLON)) {
+    // No initializer
+  } else if (match(parser, TOK_VAR)) {
+    varDeclaration(parser);
+  } else {
+    expressionStatement(parser);
+  }
+
+  int loopStart = currentChunk(parser)->count;
+  int exitJump  = -1;
+  if (!match(parser, TOK_SEMICOLON)) {
+    exitJump = condition(parser);
+    consume(parser, TOK_SEMICOLON, "expect ';'");
+  }
+
+  if (!match(parser, TOK_RIGHT_PAREN)) {
+    int bodyJump       = emitJump(parser, ROP_JUMP, 0);
+    int incrementStart = currentChunk(parser)->count;
+
+    ExpDesc increment;
+    expression(parser, &increment);
+    freeExp(parser, &increment);
+    consume(parser, TOK_RIGHT_PAREN, "expect ')' after for clauses.");
+
+    emitLoop(parser, loopStart);
+    loopStart = incrementStart;
+    patchJump(parser, bodyJump);
+  }
+
+  statement(parser);
+  emitLoop(parser, loopStart);
+
+  if (exitJump != -1) {
+    patchJump(parser, exitJump);
+  }
+
+  endScope(parser);
+}
+
+static void printStatement(RegParser *parser) {
+  ExpDesc e;
+  expression(parser, &e);
+  consume(parser, TOK_SEMICOLON, "expect ';' after value");
+  emitABC(parser, ROP_PRINT, e.reg, 0, 0);
+  freeExp(parser, &e);
+}
+
+static void returnStatement(RegParser *parser) {
+  if (parser->currentCompiler->type == TYPE_SCRIPT) {
+    errorAtPrevious(parser, "can't return from top level code");
+  }
+
+  if (match(parser, TOK_SEMICOLON)) {
+    emitABC(parser, ROP_RETURN_NIL, 0, 0, 0);
+  } else {
+    ExpDesc e;
+    expression(parser, &e);
+    consume(parser, TOK_SEMICOLON, "expect ';' after return value");
+    emitABC(parser, ROP_RETURN, e.reg, 0, 0);
+    freeExp(parser, &e);
+  }
+}
+
+static void declarationStatement(RegParser *parser) {
+  if (match(parser, TOK_FUN)) {
+    funDeclaration(parser);
+  } else if (match(parser, TOK_VAR)) {
+    varDeclaration(parser);
+  } else {
+    statement(parser);
+  }
+
+  if (parser->panicMode) {
+    synchronize(parser);
+  }
+
+  // Every temporary is dead at a statement boundary.
+  parser->currentCompiler->freeReg = parser->currentCompiler->localCount;
+}
+
+static void statement(RegParser *parser) {
+  if (match(parser, TOK_PRINT)) {
+    printStatement(parser);
+  } else if (match(parser, TOK_IF)) {
+    ifStatement(parser);
+  } else if (match(parser, TOK_RETURN)) {
+    returnStatement(parser);
+  } else if (match(parser, TOK_WHILE)) {
+    whileStatement(parser);
+  } else if (match(parser, TOK_FOR)) {
+    forStatement(parser);
+  } else if (match(parser, TOK_LEFT_BRACE)) {
+    beginScope(parser);
+    blockStatement(parser);
+    endScope(parser);
+  } else {
+    expressionStatement(parser);
+  }
+}
+
+ObjFunction *compileRegister(VM *vm, const char *source) {
+  Scanner scanner;
+  initScanner(&scanner, source);
+
+  RegCompiler compiler;
+
+  RegParser parser;
+  parser.vm              = vm;
+  parser.hadError        = false;
+  parser.panicMode       = false;
+  parser.scanner         = &scanner;
+  parser.currentCompiler = NULL;
+  initCompiler(&parser, &compiler, TYPE_SCRIPT);
+
+  advance(&parser);
+
+  while (!match(&parser, TOK_EOF)) {
+    declarationStatement(&parser);
+  }
+
+  ObjFunction *func = endCompiler(&parser);
+  if (parser.hadError)
+    return NULL;
+
+  packFunctions(vm, func);
+  return func;
+}
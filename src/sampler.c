@@ -0,0 +1,163 @@
+#include "sampler.h"
+#include "object.h"
+#include "vm.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define SAMPLE_CAPACITY 16384
+
+typedef struct sample_frame {
+  ObjFunction *function;
+  int line;
+} SampleFrame;
+
+typedef struct sample {
+  int depth;
+  SampleFrame frames[FRAMES_MAX]; // Outermost first
+} Sample;
+
+typedef struct sampler {
+  VM *vm;
+  Sample *samples;              // Ring buffer of SAMPLE_CAPACITY samples
+  volatile unsigned long taken; // Samples written, including overwritten
+  struct sigaction previous;    // Handler to restore when sampling stops
+} Sampler;
+
+static Sampler sampler;
+
+// Runs in the signal handler, so it only reads VM state and writes into the
+// preallocated buffer.
+static void takeSample(int __attribute__((unused)) signal) {
+  VM *vm    = sampler.vm;
+  int depth = vm->frameCount;
+  if (depth <= 0 || depth > FRAMES_MAX)
+    return;
+
+  Sample *sample = &sampler.samples[sampler.taken % SAMPLE_CAPACITY];
+  sample->depth  = depth;
+
+  for (int i = 0; i < depth; i++) {
+    CallFrame *frame  = &vm->frames[i];
+    ObjFunction *func = frame->function;
+
+    // Frames are filled in before they're counted, but the ip of one that
+    // hasn't run an instruction yet points at its first
+    long index = frame->ip - func->chunk.code - 1;
+    bool valid = index >= 0 && index < func->chunk.count;
+
+    sample->frames[i].function = func;
+    sample->frames[i].line     = valid ? getLine(&func->chunk, index) : 0;
+  }
+
+  sampler.taken++;
+}
+
+bool startSampler(VM *vm, long intervalMicros) {
+  sampler.vm      = vm;
+  sampler.taken   = 0;
+  sampler.samples = calloc(SAMPLE_CAPACITY, sizeof(Sample));
+  if (sampler.samples == NULL)
+    return false;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = takeSample;
+  action.sa_flags   = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+
+  struct itimerval timer;
+  timer.it_interval.tv_sec  = intervalMicros / 1000000;
+  timer.it_interval.tv_usec = intervalMicros % 1000000;
+  timer.it_value            = timer.it_interval;
+
+  if (sigaction(SIGPROF, &action, &sampler.previous) == -1 ||
+      setitimer(ITIMER_PROF, &timer, NULL) == -1) {
+    free(sampler.samples);
+    sampler.samples = NULL;
+    return false;
+  }
+
+  return true;
+}
+
+// Formats the sample's stack in collapsed form, in a buffer to be freed.
+static char *formatStack(Sample *sample) {
+  int capacity = 64, length = 0;
+  char *stack  = malloc(capacity);
+
+  for (int i = 0; i < sample->depth; i++) {
+    ObjFunction *func = sample->frames[i].function;
+    char frame[128];
+    int n;
+    if (func->name == NULL) {
+      n = snprintf(frame, sizeof(frame), "%s<script>:%d", i == 0 ? "" : ";",
+                   sample->frames[i].line);
+    } else {
+      n = snprintf(frame, sizeof(frame), "%s%.100s:%d", i == 0 ? "" : ";",
+                   func->name->chars, sample->frames[i].line);
+    }
+
+    while (length + n + 1 > capacity) {
+      capacity *= 2;
+      stack = realloc(stack, capacity);
+    }
+    memcpy(stack + length, frame, n);
+    length += n;
+  }
+
+  stack[length] = '\0';
+  return stack;
+}
+
+static int compareStacks(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+bool stopSampler(const char *path) {
+  struct itimerval off;
+  memset(&off, 0, sizeof(off));
+  setitimer(ITIMER_PROF, &off, NULL);
+  sigaction(SIGPROF, &sampler.previous, NULL);
+
+  unsigned long taken = sampler.taken;
+  int count = taken < SAMPLE_CAPACITY ? (int)taken : SAMPLE_CAPACITY;
+
+  // Sorting the stacks brings identical ones together to be counted
+  char **stacks = malloc(sizeof(char *) * (count > 0 ? count : 1));
+  for (int i = 0; i < count; i++) {
+    stacks[i] = formatStack(&sampler.samples[i]);
+  }
+  qsort(stacks, count, sizeof(char *), compareStacks);
+
+  FILE *out = fopen(path, "w");
+  for (int i = 0; i < count;) {
+    int j = i + 1;
+    while (j < count && strcmp(stacks[i], stacks[j]) == 0)
+      j++;
+
+    if (out != NULL)
+      fprintf(out, "%s %d\n", stacks[i], j - i);
+    i = j;
+  }
+
+  for (int i = 0; i < count; i++) {
+    free(stacks[i]);
+  }
+  free(stacks);
+  free(sampler.samples);
+  sampler.samples = NULL;
+  sampler.vm      = NULL;
+
+  if (out == NULL || fclose(out) != 0)
+    return false;
+
+  fprintf(stderr, "[%d samples written to %s", count, path);
+  if (taken > SAMPLE_CAPACITY)
+    fprintf(stderr, ", %lu older ones dropped", taken - SAMPLE_CAPACITY);
+  fprintf(stderr, "]\n");
+  return true;
+}
@@ -45,9 +45,9 @@ static void skipWhitespace(Scanner *scanner) {
       case '/':
         if (peekNext(scanner) == '/') {
           CONSUME_INLINE_COMMENT();
-          return;
+          continue;
         }
-        continue;
+        return;
       case ' ':
       case '\r':
       case '\t': advance(scanner); continue;
@@ -0,0 +1,97 @@
+#include "scriptcache.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+ScriptCache *newScriptCache(MemStats *stats, int capacity) {
+  ScriptCache *cache = ALLOCATE(stats, ScriptCache, 1);
+  cache->entries     = ALLOCATE(stats, ScriptEntry, capacity);
+  cache->count       = 0;
+  cache->capacity    = capacity;
+  cache->lookups     = 0;
+  cache->hits        = 0;
+  cache->evictions   = 0;
+  cache->stats       = stats;
+  return cache;
+}
+
+void freeScriptCache(ScriptCache *cache) {
+  if (cache == NULL)
+    return;
+
+  for (int i = 0; i < cache->count; i++) {
+    ScriptEntry *entry = &cache->entries[i];
+    FREE_ARRAY(cache->stats, char, entry->source, entry->length + 1);
+  }
+  FREE_ARRAY(cache->stats, ScriptEntry, cache->entries, cache->capacity);
+  FREE(cache->stats, ScriptCache, cache);
+}
+
+// 64-bit FNV-1a, so that different scripts almost never share a hash. The
+// length is found in the same pass over the source.
+static uint64_t hashSource(const char *source, size_t *length) {
+  uint64_t hash = 14695981039346656037ull;
+  const char *c = source;
+  for (; *c != '\0'; c++) {
+    hash ^= (uint8_t)*c;
+    hash *= 1099511628211ull;
+  }
+  *length = (size_t)(c - source);
+  return hash;
+}
+
+ObjFunction *findScript(ScriptCache *cache, const char *source, VMMode mode) {
+  size_t length;
+  uint64_t hash = hashSource(source, &length);
+  cache->lookups++;
+
+  // Caches are small, so a linear scan over the hashes is enough. Only an
+  // equal hash is worth comparing the text for.
+  for (int i = 0; i < cache->count; i++) {
+    ScriptEntry *entry = &cache->entries[i];
+    if (entry->hash == hash && entry->mode == mode &&
+        entry->length == length &&
+        memcmp(entry->source, source, length) == 0) {
+      entry->lastUsed = cache->lookups;
+      cache->hits++;
+      return entry->script;
+    }
+  }
+
+  return NULL;
+}
+
+void addScript(ScriptCache *cache, const char *source, VMMode mode,
+               ObjFunction *script) {
+  ScriptEntry *entry;
+  if (cache->count < cache->capacity) {
+    entry = &cache->entries[cache->count++];
+  } else {
+    entry = &cache->entries[0];
+    for (int i = 1; i < cache->count; i++) {
+      if (cache->entries[i].lastUsed < entry->lastUsed)
+        entry = &cache->entries[i];
+    }
+
+    FREE_ARRAY(cache->stats, char, entry->source, entry->length + 1);
+    cache->evictions++;
+  }
+
+  entry->hash   = hashSource(source, &entry->length);
+  entry->source = ALLOCATE(cache->stats, char, entry->length + 1);
+  memcpy(entry->source, source, entry->length + 1);
+  entry->mode     = mode;
+  entry->script   = script;
+  entry->lastUsed = cache->lookups;
+}
+
+void printScriptCacheStats(ScriptCache *cache, FILE *out) {
+  fprintf(out, "script cache: %lu hits, %lu misses, %lu evictions, %d/%d "
+               "entries\n",
+          cache->hits, cache->lookups - cache->hits, cache->evictions,
+          cache->count, cache->capacity);
+}
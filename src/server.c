@@ -0,0 +1,287 @@
+#include "server.h"
+#include "object.h"
+#include "scriptcache.h"
+#include "vm.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Requests carry the client's stdin, stdout and stderr.
+#define PASSED_FDS 3
+
+// Seconds a client has to send its request before the server moves on.
+#define REQUEST_TIMEOUT 5
+
+// Set by SIGINT and SIGTERM to stop serving.
+static volatile sig_atomic_t stopping = false;
+
+static void stopServing(int signal) {
+  (void)signal;
+  stopping = true;
+}
+
+// Sequenced packets keep each request and reply in one message.
+static int openSocket(const char *path, struct sockaddr_un *addr) {
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  strcpy(addr->sun_path, path);
+  return socket(AF_UNIX, SOCK_SEQPACKET, 0);
+}
+
+static int listenAt(const char *path) {
+  struct sockaddr_un addr;
+  int fd = openSocket(path, &addr);
+  if (fd == -1)
+    return -1;
+
+  // A socket left behind by a server that died is replaced, a live one isn't
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+    close(fd);
+    errno = EADDRINUSE;
+    return -1;
+  }
+  unlink(path);
+
+  // Only our own user may ask us to run scripts
+  mode_t mask = umask(077);
+  int result  = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(mask);
+
+  if (result == -1 || listen(fd, SOMAXCONN) == -1) {
+    int error = errno;
+    close(fd);
+    errno = error;
+    return -1;
+  }
+
+  return fd;
+}
+
+// Receives a request's script path and file descriptors. Returns false for
+// malformed requests.
+static bool receiveRequest(int conn, char *path, int fds[PASSED_FDS]) {
+  union {
+    struct cmsghdr header;
+    char buffer[CMSG_SPACE(sizeof(int) * PASSED_FDS)];
+  } control;
+
+  struct iovec iov = {.iov_base = path, .iov_len = PATH_MAX};
+  struct msghdr msg = {
+      .msg_iov        = &iov,
+      .msg_iovlen     = 1,
+      .msg_control    = control.buffer,
+      .msg_controllen = sizeof(control.buffer),
+  };
+
+  ssize_t length = recvmsg(conn, &msg, 0);
+  if (length <= 0 || path[length - 1] != '\0')
+    return false;
+
+  struct cmsghdr *header = CMSG_FIRSTHDR(&msg);
+  if (header == NULL || header->cmsg_type != SCM_RIGHTS ||
+      header->cmsg_len != CMSG_LEN(sizeof(int) * PASSED_FDS))
+    return false;
+
+  memcpy(fds, CMSG_DATA(header), sizeof(int) * PASSED_FDS);
+  return true;
+}
+
+static char *readSource(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+    return NULL;
+
+  char *source = NULL;
+  long size;
+  if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) != -1 &&
+      fseek(file, 0, SEEK_SET) == 0 && (source = malloc(size + 1)) != NULL) {
+    size_t read  = fread(source, 1, size, file);
+    source[read] = '\0';
+  }
+
+  fclose(file);
+  return source;
+}
+
+static void sendStatus(int conn, int status) {
+  send(conn, &status, sizeof(status), MSG_NOSIGNAL);
+}
+
+// Runs the script in a child with the client's files as its standard ones,
+// compiling the source there first if there's no script. The child replies
+// with the exit status itself.
+static void runChild(VM *vm, int conn, ObjFunction *script,
+                     const char *source) {
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("Could not start a process to run the script");
+    sendStatus(conn, EXIT_FAILURE);
+    return;
+  }
+  if (pid != 0)
+    return;
+
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+
+  InterpretResult result = INTERPRET_COMPILE_ERR;
+  if (script == NULL)
+    script = compileScript(vm, source);
+  if (script != NULL) {
+    initOutput(&vm->output, STDOUT_FILENO, isatty(STDOUT_FILENO));
+    result = interpretFunction(vm, script);
+    flushOutput(&vm->output);
+  }
+  fflush(stderr);
+
+  sendStatus(conn, result == INTERPRET_OK ? EXIT_SUCCESS : EXIT_FAILURE);
+  _exit(EXIT_SUCCESS);
+}
+
+static void handleRequest(VM *vm, int conn) {
+  char path[PATH_MAX];
+  int fds[PASSED_FDS];
+  if (!receiveRequest(conn, path, fds))
+    return;
+
+  // The client's files stand in for ours while compiling and running, so
+  // compile errors reach it too
+  int saved[PASSED_FDS];
+  for (int i = 0; i < PASSED_FDS; i++) {
+    saved[i] = dup(i);
+    dup2(fds[i], i);
+    close(fds[i]);
+  }
+
+  char *source = readSource(path);
+  if (source == NULL) {
+    fprintf(stderr, "Could not open file '%s'\n", path);
+    sendStatus(conn, EXIT_FAILURE);
+  } else {
+    // Scripts are compiled here only while the cache has room to keep them,
+    // so the server doesn't grow. The rest are compiled by the child.
+    ScriptCache *cache  = vm->scriptCache;
+    ObjFunction *script = NULL;
+    bool compiled       = true;
+    if (cache != NULL && cache->count < cache->capacity) {
+      script   = compileScript(vm, source);
+      compiled = script != NULL;
+    } else if (cache != NULL) {
+      script = findScript(cache, source, vm->mode);
+    }
+
+    if (compiled) {
+      runChild(vm, conn, script, source);
+    } else {
+      sendStatus(conn, EXIT_FAILURE);
+    }
+    free(source);
+  }
+
+  for (int i = 0; i < PASSED_FDS; i++) {
+    if (saved[i] == -1) {
+      close(i);
+    } else {
+      dup2(saved[i], i);
+      close(saved[i]);
+    }
+  }
+}
+
+bool serve(VM *vm, const char *socketPath) {
+  int fd = listenAt(socketPath);
+  if (fd == -1)
+    return false;
+
+  // Children are reaped automatically, since they report their own status
+  signal(SIGCHLD, SIG_IGN);
+
+  // Without SA_RESTART, so the signals interrupt accept
+  struct sigaction action = {.sa_handler = stopServing};
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  // A client that stalls mid-request can't hold up the others for long
+  struct timeval timeout = {.tv_sec = REQUEST_TIMEOUT};
+
+  while (!stopping) {
+    int conn = accept(fd, NULL, NULL);
+    if (conn == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      int error = errno;
+      close(fd);
+      errno = error;
+      return false;
+    }
+
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    handleRequest(vm, conn);
+    close(conn);
+  }
+
+  close(fd);
+  unlink(socketPath);
+  return true;
+}
+
+int runRemote(const char *socketPath, const char *scriptPath) {
+  char path[PATH_MAX];
+  if (realpath(scriptPath, path) == NULL) {
+    fprintf(stderr, "Could not open file '%s'\n", scriptPath);
+    return EXIT_FAILURE;
+  }
+
+  struct sockaddr_un addr;
+  int fd = openSocket(socketPath, &addr);
+  if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    perror("Could not connect to the server");
+    return EXIT_FAILURE;
+  }
+
+  union {
+    struct cmsghdr header;
+    char buffer[CMSG_SPACE(sizeof(int) * PASSED_FDS)];
+  } control;
+  memset(&control, 0, sizeof(control));
+
+  struct iovec iov  = {.iov_base = path, .iov_len = strlen(path) + 1};
+  struct msghdr msg = {
+      .msg_iov        = &iov,
+      .msg_iovlen     = 1,
+      .msg_control    = control.buffer,
+      .msg_controllen = sizeof(control.buffer),
+  };
+
+  struct cmsghdr *header = CMSG_FIRSTHDR(&msg);
+  header->cmsg_level     = SOL_SOCKET;
+  header->cmsg_type      = SCM_RIGHTS;
+  header->cmsg_len       = CMSG_LEN(sizeof(int) * PASSED_FDS);
+  int fds[PASSED_FDS]    = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  memcpy(CMSG_DATA(header), fds, sizeof(fds));
+
+  int status;
+  if (sendmsg(fd, &msg, 0) == -1 ||
+      recv(fd, &status, sizeof(status), 0) != sizeof(status)) {
+    fprintf(stderr, "The server didn't finish running '%s'\n", scriptPath);
+    status = EXIT_FAILURE;
+  }
+
+  close(fd);
+  return status;
+}
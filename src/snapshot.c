@@ -0,0 +1,529 @@
+#include "snapshot.h"
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+#include "verify.h"
+#include "vm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SNAPSHOT_MAGIC "CLOXSNAP"
+#define MAGIC_LENGTH   8
+
+#define NO_INDEX UINT32_MAX
+
+#define OBJ_MAP_MAX_LOAD 0.75
+
+#define CHECKSUM_SEED 14695981039346656037ull
+
+/*
+ * File layout, integers being 32 bits unless noted:
+ *
+ *   header     magic, version, VM mode
+ *   strings    count, then each one's length and characters
+ *   functions  count, then each one's name, arity, max slots, code, line
+ *              runs, constants and lazy source
+ *   globals    count, then each one's name and value
+ *   checksum   64-bit FNV-1a of everything before it
+ *
+ * Strings and functions refer to each other by their index in the file, so
+ * all of them exist before any is filled in.
+ */
+typedef enum snapshot_tag {
+  TAG_NIL,
+  TAG_FALSE,
+  TAG_TRUE,
+  TAG_NUM,      // 64-bit double
+  TAG_STRING,   // String index
+  TAG_FUNCTION, // Function index
+  TAG_NATIVE    // Name length and characters
+} SnapshotTag;
+
+// Objects numbered in the order they are found, with a hash map from object
+// to number.
+typedef struct obj_entry {
+  Obj *obj; // NULL for an empty slot
+  uint32_t index;
+} ObjEntry;
+
+typedef struct obj_list {
+  Obj **objs;
+  int count;
+  int capacity;
+  ObjEntry *entries;
+  int entryCapacity;
+  MemStats *stats;
+} ObjList;
+
+static uint64_t checksumBytes(uint64_t hash, const void *bytes,
+                              size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    hash ^= ((const uint8_t *)bytes)[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+static uint32_t hashObj(Obj *obj) {
+  uintptr_t bits = (uintptr_t)obj >> 3;
+  return (uint32_t)(bits ^ (bits >> 32)) * 2654435761u;
+}
+
+static ObjEntry *findEntry(ObjEntry *entries, int capacity, Obj *obj) {
+  uint32_t index = hashObj(obj) & (capacity - 1);
+  while (entries[index].obj != NULL && entries[index].obj != obj)
+    index = (index + 1) & (capacity - 1);
+  return &entries[index];
+}
+
+static uint32_t objIndex(ObjList *list, Obj *obj) {
+  if (list->entryCapacity == 0)
+    return NO_INDEX;
+
+  ObjEntry *entry = findEntry(list->entries, list->entryCapacity, obj);
+  return entry->obj == NULL ? NO_INDEX : entry->index;
+}
+
+static void growEntries(ObjList *list) {
+  int capacity      = GROW_CAPACITY(list->entryCapacity);
+  ObjEntry *entries = ALLOCATE(list->stats, ObjEntry, capacity);
+  memset(entries, 0, sizeof(ObjEntry) * capacity);
+
+  for (int i = 0; i < list->count; i++)
+    *findEntry(entries, capacity, list->objs[i]) = (ObjEntry){list->objs[i], i};
+
+  FREE_ARRAY(list->stats, ObjEntry, list->entries, list->entryCapacity);
+  list->entries       = entries;
+  list->entryCapacity = capacity;
+}
+
+// Adds the object if it's new, returning false if it was already listed.
+static bool addObj(ObjList *list, Obj *obj) {
+  if (objIndex(list, obj) != NO_INDEX)
+    return false;
+
+  if (list->count >= list->capacity) {
+    int oldCap     = list->capacity;
+    list->capacity = GROW_CAPACITY(oldCap);
+    list->objs =
+        GROW_ARRAY(list->stats, Obj *, list->objs, oldCap, list->capacity);
+  }
+  list->objs[list->count++] = obj;
+
+  if (list->count > list->entryCapacity * OBJ_MAP_MAX_LOAD) {
+    growEntries(list);
+  } else {
+    *findEntry(list->entries, list->entryCapacity, obj) =
+        (ObjEntry){obj, list->count - 1};
+  }
+  return true;
+}
+
+static void freeObjList(ObjList *list) {
+  FREE_ARRAY(list->stats, Obj *, list->objs, list->capacity);
+  FREE_ARRAY(list->stats, ObjEntry, list->entries, list->entryCapacity);
+}
+
+typedef struct writer {
+  FILE *out;
+  uint64_t checksum; // Of the bytes written so far
+  ObjList strings;
+  ObjList functions;
+} Writer;
+
+static void collectValue(Writer *writer, Value value);
+
+static void collectFunction(Writer *writer, ObjFunction *func) {
+  if (!addObj(&writer->functions, (Obj *)func))
+    return;
+
+  if (func->name != NULL)
+    addObj(&writer->strings, (Obj *)func->name);
+  for (int i = 0; i < func->chunk.constants.count; i++)
+    collectValue(writer, func->chunk.constants.values[i]);
+}
+
+static void collectValue(Writer *writer, Value value) {
+  if (IS_STRING(value)) {
+    addObj(&writer->strings, AS_OBJ(value));
+  } else if (IS_FUNCTION(value)) {
+    collectFunction(writer, AS_FUNCTION(value));
+  }
+}
+
+static void writeBytes(Writer *writer, const void *bytes, size_t length) {
+  if (length > 0)
+    fwrite(bytes, 1, length, writer->out);
+  writer->checksum = checksumBytes(writer->checksum, bytes, length);
+}
+
+static void writeU32(Writer *writer, uint32_t n) {
+  writeBytes(writer, &n, sizeof(n));
+}
+
+static void writeTag(Writer *writer, SnapshotTag tag) {
+  uint8_t byte = tag;
+  writeBytes(writer, &byte, 1);
+}
+
+static void saveValue(Writer *writer, Value value) {
+  if (IS_NIL(value)) {
+    writeTag(writer, TAG_NIL);
+  } else if (IS_BOOL(value)) {
+    writeTag(writer, AS_BOOL(value) ? TAG_TRUE : TAG_FALSE);
+  } else if (IS_NUM(value)) {
+    writeTag(writer, TAG_NUM);
+    writeBytes(writer, &value.as.number, sizeof(double));
+  } else if (IS_STRING(value)) {
+    writeTag(writer, TAG_STRING);
+    writeU32(writer, objIndex(&writer->strings, AS_OBJ(value)));
+  } else if (IS_FUNCTION(value)) {
+    writeTag(writer, TAG_FUNCTION);
+    writeU32(writer, objIndex(&writer->functions, AS_OBJ(value)));
+  } else {
+    const char *name = nativeName(AS_NATIVE(value));
+    writeTag(writer, TAG_NATIVE);
+    writeU32(writer, strlen(name));
+    writeBytes(writer, name, strlen(name));
+  }
+}
+
+static void saveFunction(Writer *writer, ObjFunction *func) {
+  Chunk *chunk = &func->chunk;
+
+  writeU32(writer, func->name == NULL
+                       ? NO_INDEX
+                       : objIndex(&writer->strings, (Obj *)func->name));
+  writeU32(writer, func->arity);
+  writeU32(writer, func->maxSlots);
+
+  writeU32(writer, chunk->count);
+  writeBytes(writer, chunk->code, chunk->count);
+  writeU32(writer, chunk->lineCount);
+  writeBytes(writer, chunk->lines, sizeof(LineRun) * chunk->lineCount);
+  writeU32(writer, chunk->constants.count);
+  for (int i = 0; i < chunk->constants.count; i++)
+    saveValue(writer, chunk->constants.values[i]);
+
+  int lazyLength = func->lazySource == NULL ? 0 : func->lazyLength;
+  writeU32(writer, lazyLength);
+  writeBytes(writer, func->lazySource, lazyLength);
+  writeU32(writer, func->lazyLine);
+}
+
+bool writeSnapshot(VM *vm, const char *path) {
+  Writer writer = {
+      .checksum  = CHECKSUM_SEED,
+      .strings   = {.stats = &vm->memStats},
+      .functions = {.stats = &vm->memStats},
+  };
+  if ((writer.out = fopen(path, "wb")) == NULL)
+    return false;
+
+  Table *globals = &vm->globals;
+  int count      = 0;
+  for (int i = 0; i < globals->capacity; i++) {
+    Entry *entry = &globals->entries[i];
+    if (entry->key == NULL)
+      continue;
+
+    addObj(&writer.strings, (Obj *)entry->key);
+    collectValue(&writer, entry->value);
+    count++;
+  }
+
+  writeBytes(&writer, SNAPSHOT_MAGIC, MAGIC_LENGTH);
+  writeU32(&writer, SNAPSHOT_VERSION);
+  writeU32(&writer, vm->mode);
+
+  writeU32(&writer, writer.strings.count);
+  for (int i = 0; i < writer.strings.count; i++) {
+    ObjString *string = (ObjString *)writer.strings.objs[i];
+    writeU32(&writer, string->length);
+    writeBytes(&writer, string->chars, string->length);
+  }
+
+  writeU32(&writer, writer.functions.count);
+  for (int i = 0; i < writer.functions.count; i++)
+    saveFunction(&writer, (ObjFunction *)writer.functions.objs[i]);
+
+  writeU32(&writer, count);
+  for (int i = 0; i < globals->capacity; i++) {
+    Entry *entry = &globals->entries[i];
+    if (entry->key == NULL)
+      continue;
+
+    writeU32(&writer, objIndex(&writer.strings, (Obj *)entry->key));
+    saveValue(&writer, entry->value);
+  }
+
+  uint64_t checksum = writer.checksum;
+  writeBytes(&writer, &checksum, sizeof(checksum));
+
+  freeObjList(&writer.strings);
+  freeObjList(&writer.functions);
+
+  bool failed = ferror(writer.out);
+  return fclose(writer.out) == 0 && !failed;
+}
+
+// Reads a mapped snapshot, failing once anything is out of bounds.
+typedef struct reader {
+  VM *vm;
+  const uint8_t *at;
+  const uint8_t *end;
+  bool ok;
+  ObjString **strings;
+  uint32_t stringCount;
+  ObjFunction **functions;
+  uint32_t functionCount;
+} Reader;
+
+static const uint8_t *readBytes(Reader *reader, size_t length) {
+  if (!reader->ok || (size_t)(reader->end - reader->at) < length) {
+    reader->ok = false;
+    return NULL;
+  }
+
+  const uint8_t *bytes = reader->at;
+  reader->at += length;
+  return bytes;
+}
+
+static uint32_t readU32(Reader *reader) {
+  uint32_t n           = 0;
+  const uint8_t *bytes = readBytes(reader, sizeof(n));
+  if (bytes != NULL)
+    memcpy(&n, bytes, sizeof(n));
+  return n;
+}
+
+// Reads a count of items taking at least `size` bytes each, so that a corrupt
+// count fails before anything that large is allocated.
+static uint32_t readCount(Reader *reader, size_t size) {
+  uint32_t count = readU32(reader);
+  if ((size_t)(reader->end - reader->at) / size < count)
+    reader->ok = false;
+  return reader->ok ? count : 0;
+}
+
+static ObjString *readString(Reader *reader) {
+  uint32_t index = readU32(reader);
+  if (index >= reader->stringCount) {
+    reader->ok = false;
+    return NULL;
+  }
+  return reader->strings[index];
+}
+
+static Value loadValue(Reader *reader) {
+  const uint8_t *tag = readBytes(reader, 1);
+  if (tag == NULL)
+    return NIL_VAL;
+
+  switch (*tag) {
+    case TAG_NIL:   return NIL_VAL;
+    case TAG_FALSE: return BOOL_VAL(false);
+    case TAG_TRUE:  return BOOL_VAL(true);
+    case TAG_NUM:   {
+      double number        = 0;
+      const uint8_t *bytes = readBytes(reader, sizeof(double));
+      if (bytes != NULL)
+        memcpy(&number, bytes, sizeof(double));
+      return NUM_VAL(number);
+    }
+    case TAG_STRING: {
+      ObjString *string = readString(reader);
+      return string == NULL ? NIL_VAL : OBJ_VAL(string);
+    }
+    case TAG_FUNCTION: {
+      uint32_t index = readU32(reader);
+      if (index >= reader->functionCount)
+        break;
+      return OBJ_VAL(reader->functions[index]);
+    }
+    case TAG_NATIVE: {
+      uint32_t length     = readU32(reader);
+      const uint8_t *name = readBytes(reader, length);
+      NativeFn native =
+          name == NULL ? NULL : findNative((const char *)name, length);
+      if (native == NULL)
+        break;
+      return OBJ_VAL(newNative(reader->vm, native));
+    }
+  }
+
+  reader->ok = false;
+  return NIL_VAL;
+}
+
+static void loadFunction(Reader *reader, ObjFunction *func) {
+  MemStats *stats = &reader->vm->memStats;
+  Chunk *chunk    = &func->chunk;
+
+  uint32_t name = readU32(reader);
+  if (name != NO_INDEX) {
+    reader->ok = reader->ok && name < reader->stringCount;
+    func->name = reader->ok ? reader->strings[name] : NULL;
+  }
+  func->arity    = readU32(reader);
+  func->maxSlots = readU32(reader);
+
+  chunk->count    = readCount(reader, 1);
+  chunk->capacity = chunk->count;
+  chunk->code     = ALLOCATE_IN(stats, MEM_CHUNK, uint8_t, chunk->count);
+  if (chunk->count > 0)
+    memcpy(chunk->code, readBytes(reader, chunk->count), chunk->count);
+
+  chunk->lineCount    = readCount(reader, sizeof(LineRun));
+  chunk->lineCapacity = chunk->lineCount;
+  chunk->lines = ALLOCATE_IN(stats, MEM_CHUNK, LineRun, chunk->lineCount);
+  if (chunk->lineCount > 0)
+    memcpy(chunk->lines, readBytes(reader, sizeof(LineRun) * chunk->lineCount),
+           sizeof(LineRun) * chunk->lineCount);
+
+  // Written straight into the array, since writeValueArray would grow it
+  int constantCount = readCount(reader, 1);
+  Value *constants  = ALLOCATE_IN(stats, MEM_VALUE_ARRAY, Value, constantCount);
+  for (int i = 0; i < constantCount; i++)
+    constants[i] = loadValue(reader);
+  chunk->constants.values   = constants;
+  chunk->constants.count    = constantCount;
+  chunk->constants.capacity = constantCount;
+
+  uint32_t lazyLength = readCount(reader, 1);
+  if (lazyLength > 0) {
+    func->lazySource = ALLOCATE(stats, char, lazyLength + 1);
+    memcpy(func->lazySource, readBytes(reader, lazyLength), lazyLength);
+    func->lazySource[lazyLength] = '\0';
+    func->lazyLength             = lazyLength;
+  }
+  func->lazyLine = readU32(reader);
+}
+
+static bool readSnapshot(Reader *reader) {
+  MemStats *stats = &reader->vm->memStats;
+
+  const uint8_t *magic = readBytes(reader, MAGIC_LENGTH);
+  if (magic == NULL || memcmp(magic, SNAPSHOT_MAGIC, MAGIC_LENGTH) != 0 ||
+      readU32(reader) != SNAPSHOT_VERSION) {
+    fprintf(stderr, "Not a version %d snapshot\n", SNAPSHOT_VERSION);
+    return false;
+  }
+
+  // The checksum covers everything before it, header included
+  uint64_t checksum;
+  if ((size_t)(reader->end - reader->at) < sizeof(checksum)) {
+    fprintf(stderr, "Snapshot is truncated or corrupt\n");
+    return false;
+  }
+  reader->end -= sizeof(checksum);
+  memcpy(&checksum, reader->end, sizeof(checksum));
+  if (checksumBytes(CHECKSUM_SEED, magic, reader->end - magic) != checksum) {
+    fprintf(stderr, "Snapshot is corrupt, its checksum doesn't match\n");
+    return false;
+  }
+
+  if (readU32(reader) != reader->vm->mode) {
+    fprintf(stderr, "Snapshot was made for another bytecode format\n");
+    return false;
+  }
+
+  reader->stringCount = readCount(reader, sizeof(uint32_t));
+  reader->strings     = ALLOCATE(stats, ObjString *, reader->stringCount);
+  for (uint32_t i = 0; i < reader->stringCount; i++) {
+    uint32_t length     = readCount(reader, 1);
+    const uint8_t *text = readBytes(reader, length);
+    reader->strings[i] =
+        text == NULL ? NULL
+                     : copyString(reader->vm, (const char *)text, length);
+  }
+
+  // Functions can refer to any function, so all are created first
+  reader->functionCount = readCount(reader, sizeof(uint32_t) * 8);
+  reader->functions     = ALLOCATE(stats, ObjFunction *, reader->functionCount);
+  for (uint32_t i = 0; i < reader->functionCount; i++)
+    reader->functions[i] = newFunction(reader->vm);
+  for (uint32_t i = 0; i < reader->functionCount && reader->ok; i++)
+    loadFunction(reader, reader->functions[i]);
+
+  // The VM trusts its bytecode, so a file's is checked before any of it runs
+  for (uint32_t i = 0; i < reader->functionCount && reader->ok; i++) {
+    if (!verifyFunction(reader->functions[i], reader->vm->mode, stats)) {
+      fprintf(stderr, "Snapshot holds invalid bytecode\n");
+      return false;
+    }
+  }
+
+  uint32_t globalCount = readCount(reader, sizeof(uint32_t) + 1);
+  for (uint32_t i = 0; i < globalCount && reader->ok; i++) {
+    ObjString *name = readString(reader);
+    Value value     = loadValue(reader);
+    if (reader->ok)
+      tableSet(&reader->vm->globals, name, value);
+  }
+
+  if (!reader->ok || reader->at != reader->end) {
+    fprintf(stderr, "Snapshot is truncated or corrupt\n");
+    return false;
+  }
+
+  // Compiled functions get packed like freshly compiled ones
+  Chunk **chunks = ALLOCATE(stats, Chunk *, reader->functionCount);
+  int count      = 0;
+  for (uint32_t i = 0; i < reader->functionCount; i++) {
+    if (reader->functions[i]->lazySource == NULL)
+      chunks[count++] = &reader->functions[i]->chunk;
+  }
+  if (count > 0)
+    packChunks(stats, &reader->vm->chunkArenas, chunks, count);
+  FREE_ARRAY(stats, Chunk *, chunks, reader->functionCount);
+
+  return true;
+}
+
+bool loadSnapshot(VM *vm, const char *path) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    perror("Could not open snapshot");
+    if (fd != -1)
+      close(fd);
+    return false;
+  }
+
+  void *data = MAP_FAILED;
+  if (st.st_size > 0)
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (data == MAP_FAILED) {
+    if (st.st_size == 0)
+      errno = EINVAL;
+    perror("Could not map snapshot");
+    return false;
+  }
+
+  Reader reader = {
+      .vm  = vm,
+      .at  = data,
+      .end = (const uint8_t *)data + st.st_size,
+      .ok  = true,
+  };
+  bool loaded = readSnapshot(&reader);
+
+  MemStats *stats = &vm->memStats;
+  FREE_ARRAY(stats, ObjString *, reader.strings, reader.stringCount);
+  FREE_ARRAY(stats, ObjFunction *, reader.functions, reader.functionCount);
+  munmap(data, st.st_size);
+  return loaded;
+}
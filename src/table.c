@@ -8,15 +8,17 @@
 
 const double TABLE_MAX_LOAD_FACTOR = 0.75;
 
-void initTable(Table *table) {
+void initTable(Table *table, MemStats *stats) {
   table->capacity = 0;
   table->count    = 0;
   table->entries  = NULL;
+  table->stats    = stats;
 }
 
 void freeTable(Table *table) {
-  FREE_ARRAY(Entry, table, table->capacity);
-  initTable(table);
+  FREE_ARRAY_IN(table->stats, MEM_TABLE, Entry, table->entries,
+                table->capacity);
+  initTable(table, table->stats);
 }
 
 static Entry *findEntry(Entry *entries, int capacity, ObjString *key) {
@@ -54,7 +56,7 @@ static Entry *findEntry(Entry *entries, int capacity, ObjString *key) {
 
 static void adjustCapacity(Table *table, int capacity) {
   // Allocate new sized table
-  Entry *entries = ALLOCATE(Entry, capacity);
+  Entry *entries = ALLOCATE_IN(table->stats, MEM_TABLE, Entry, capacity);
   for (int i = 0; i < capacity; i++) {
     entries[i].key   = NULL;
     entries[i].value = NIL_VAL;
@@ -63,7 +65,7 @@ static void adjustCapacity(Table *table, int capacity) {
   // Rebuild hash table from existing entries
   table->count = 0;
   for (int i = 0; i < table->capacity; i++) {
-    Entry *entry = &entries[i];
+    Entry *entry = &table->entries[i];
 
     if (entry->key == NULL)
       continue;
@@ -75,6 +77,8 @@ static void adjustCapacity(Table *table, int capacity) {
     table->count++;
   }
 
+  FREE_ARRAY_IN(table->stats, MEM_TABLE, Entry, table->entries,
+                table->capacity);
   table->entries  = entries;
   table->capacity = capacity;
 }
@@ -129,7 +133,7 @@ bool tableSet(Table *table, ObjString *key, Value value) {
 
 void tableCopy(Table *src, Table *dest) {
   for (int i = 0; i < src->capacity; i++) {
-    Entry *entry = &dest->entries[i];
+    Entry *entry = &src->entries[i];
 
     if (entry->key != NULL) {
       tableSet(dest, entry->key, entry->value);
@@ -0,0 +1,198 @@
+#include "trace.h"
+#include "debug.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static void writeU16(FILE *out, uint16_t value) {
+  fputc(value & 0xff, out);
+  fputc(value >> 8, out);
+}
+
+static void writeU32(FILE *out, uint32_t value) {
+  writeU16(out, value & 0xffff);
+  writeU16(out, value >> 16);
+}
+
+Trace *openTrace(MemStats *stats, const char *path, const char *function,
+                 int fromLine, int toLine) {
+  FILE *out = fopen(path, "wb");
+  if (out == NULL)
+    return NULL;
+
+  fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), out);
+
+  Trace *trace = ALLOCATE(stats, Trace, 1);
+  memset(trace, 0, sizeof(Trace));
+  trace->stats    = stats;
+  trace->out      = out;
+  trace->function = function;
+  trace->fromLine = fromLine;
+  trace->toLine   = toLine;
+  trace->last     = -1;
+  return trace;
+}
+
+void closeTrace(Trace *trace) {
+  fclose(trace->out);
+  FREE_ARRAY(trace->stats, TracedFunction, trace->functions,
+             trace->functionCapacity);
+  FREE(trace->stats, Trace, trace);
+}
+
+static const char *functionName(ObjFunction *func) {
+  return func->name == NULL ? "<script>" : func->name->chars;
+}
+
+// Finds the function's id, assigning one and writing its name if it's new.
+static int functionId(Trace *trace, ObjFunction *func) {
+  if (trace->last != -1 && trace->functions[trace->last].function == func)
+    return trace->last;
+
+  for (int i = 0; i < trace->functionCount; i++) {
+    if (trace->functions[i].function == func)
+      return trace->last = i;
+  }
+
+  if (trace->functionCount >= trace->functionCapacity) {
+    int oldCap              = trace->functionCapacity;
+    trace->functionCapacity = GROW_CAPACITY(oldCap);
+    trace->functions =
+        GROW_ARRAY(trace->stats, TracedFunction, trace->functions, oldCap,
+                   trace->functionCapacity);
+  }
+
+  const char *name     = functionName(func);
+  int id               = trace->functionCount++;
+  trace->functions[id] = (TracedFunction){
+      func, trace->function == NULL || strcmp(trace->function, name) == 0};
+
+  if (trace->functions[id].traced) {
+    uint16_t length = (uint16_t)strlen(name);
+    fputc('F', trace->out);
+    writeU16(trace->out, id);
+    writeU16(trace->out, length);
+    fwrite(name, 1, length, trace->out);
+  }
+
+  return trace->last = id;
+}
+
+void traceInstruction(Trace *trace, VM *vm, CallFrame *frame, int offset,
+                      uint8_t instruction) {
+  int id = functionId(trace, frame->function);
+  if (!trace->functions[id].traced)
+    return;
+
+  int line = getLine(&frame->function->chunk, offset);
+  if (trace->toLine != 0 && (line < trace->fromLine || line > trace->toLine))
+    return;
+
+  fputc('I', trace->out);
+  fputc(instruction, trace->out);
+  writeU16(trace->out, id);
+  writeU32(trace->out, offset);
+  writeU32(trace->out, line);
+  writeU16(trace->out, (uint16_t)(vm->stackTop - vm->stack));
+}
+
+static bool readU16(FILE *in, uint16_t *value) {
+  int low = fgetc(in), high = fgetc(in);
+  if (low == EOF || high == EOF)
+    return false;
+
+  *value = (uint16_t)(low | high << 8);
+  return true;
+}
+
+static bool readU32(FILE *in, uint32_t *value) {
+  uint16_t low, high;
+  if (!readU16(in, &low) || !readU16(in, &high))
+    return false;
+
+  *value = (uint32_t)low | (uint32_t)high << 16;
+  return true;
+}
+
+// Names of the functions in a trace being decoded, indexed by id. Decoding
+// runs without a VM, so the memory isn't counted anywhere.
+typedef struct name_list {
+  char **names;
+  int capacity;
+} NameList;
+
+static void setName(NameList *list, int id, char *name) {
+  if (id >= list->capacity) {
+    int oldCap     = list->capacity;
+    list->capacity = GROW_CAPACITY(oldCap);
+    while (list->capacity <= id)
+      list->capacity *= 2;
+
+    list->names = GROW_ARRAY(NULL, char *, list->names, oldCap, list->capacity);
+    memset(list->names + oldCap, 0, sizeof(char *) * (list->capacity - oldCap));
+  }
+
+  list->names[id] = name;
+}
+
+static void freeNames(NameList *list) {
+  for (int i = 0; i < list->capacity; i++) {
+    if (list->names[i] != NULL)
+      FREE_ARRAY(NULL, char, list->names[i], strlen(list->names[i]) + 1);
+  }
+  FREE_ARRAY(NULL, char *, list->names, list->capacity);
+}
+
+bool decodeTrace(const char *path, FILE *out) {
+  FILE *in = fopen(path, "rb");
+  if (in == NULL)
+    return false;
+
+  char magic[sizeof(TRACE_MAGIC) - 1];
+  if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) ||
+      memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+    fclose(in);
+    return false;
+  }
+
+  NameList names = {0};
+  bool ok        = true;
+  int tag;
+
+  while (ok && (tag = fgetc(in)) != EOF) {
+    uint16_t id, length, stackSize;
+    uint32_t offset, line;
+
+    if (tag == 'F') {
+      ok = readU16(in, &id) && readU16(in, &length);
+      if (!ok)
+        break;
+
+      char *name   = ALLOCATE(NULL, char, length + 1);
+      ok           = fread(name, 1, length, in) == length;
+      name[length] = '\0';
+      setName(&names, id, name);
+    } else if (tag == 'I') {
+      int instruction = fgetc(in);
+      ok = instruction != EOF && readU16(in, &id) && readU32(in, &offset) &&
+           readU32(in, &line) && readU16(in, &stackSize);
+      if (!ok)
+        break;
+
+      const char *name =
+          id < names.capacity && names.names[id] != NULL ? names.names[id]
+                                                         : "?";
+      fprintf(out, "%04u %4u %-16s stack %-4u %s\n", offset, line,
+              opcodeName(instruction), stackSize, name);
+    } else {
+      ok = false;
+    }
+  }
+
+  freeNames(&names);
+  fclose(in);
+  return ok;
+}
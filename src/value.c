@@ -1,30 +1,34 @@
 #include "value.h"
 #include "memory.h"
+#include "number.h"
 #include "object.h"
 
 #include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 
-void initValueArray(ValueArray *arr) {
+void initValueArray(ValueArray *arr, MemStats *stats) {
   arr->values   = NULL;
   arr->count    = 0;
   arr->capacity = 0;
+  arr->stats    = stats;
 }
 
 void writeValueArray(ValueArray *arr, Value value) {
   if (arr->count >= arr->capacity) {
     int oldCap    = arr->capacity;
     arr->capacity = GROW_CAPACITY(oldCap);
-    arr->values   = GROW_ARRAY(Value, arr->values, oldCap, arr->capacity);
+    arr->values   = GROW_ARRAY_IN(arr->stats, MEM_VALUE_ARRAY, Value,
+                                  arr->values, oldCap, arr->capacity);
   }
 
   arr->values[arr->count++] = value;
 }
 
 void freeValueArray(ValueArray *arr) {
-  FREE_ARRAY(Value, arr->values, arr->capacity);
-  initValueArray(arr);
+  FREE_ARRAY_IN(arr->stats, MEM_VALUE_ARRAY, Value, arr->values,
+                arr->capacity);
+  initValueArray(arr, arr->stats);
 }
 
 bool valuesEqual(Value a, Value b) {
@@ -44,7 +48,12 @@ void printValue(Value value) {
   switch (value.type) {
     case VAL_BOOL: printf(AS_BOOL(value) ? "true" : "false"); break;
     case VAL_NIL:  printf("nil"); break;
-    case VAL_NUM:  printf("%g", AS_NUM(value)); break;
+    case VAL_NUM:  {
+      char buffer[NUMBER_BUFFER_SIZE];
+      formatNumber(AS_NUM(value), buffer);
+      printf("%s", buffer);
+      break;
+    }
     case VAL_OBJ:  printObject(value); break;
   }
 }
@@ -0,0 +1,310 @@
+#include "verify.h"
+#include "chunk.h"
+#include "memory.h"
+#include "value.h"
+
+#include <stdint.h>
+#include <string.h>
+
+// Marks in the depths array, which otherwise holds the stack depth before
+// the instruction at each offset.
+#define NOT_INSTRUCTION -1 // Inside an instruction, or past the end
+#define UNREACHED       -2 // Start of an instruction not reached yet
+
+// What an instruction does, as far as checking it goes.
+typedef struct instruction {
+  int length; // Bytes, operands included
+  int target; // Offset jumped to, or -1
+  bool falls; // Whether the next instruction can run after it
+  int pops;   // Values taken off the stack
+  int pushes; // Values put on it after that
+  int slot;   // Local slot read or written, or -1
+} Instruction;
+
+static bool isConstant(Chunk *chunk, int index) {
+  return index < chunk->constants.count;
+}
+
+static bool isName(Chunk *chunk, int index) {
+  return isConstant(chunk, index) && IS_STRING(chunk->constants.values[index]);
+}
+
+// Decodes an OpCode instruction, in bytecode or wordcode, returning false if
+// it is truncated or has an unknown opcode or an operand out of range.
+static bool decodeStack(ObjFunction *func, int offset, bool wordcode,
+                        Instruction *ins) {
+  Chunk *chunk        = &func->chunk;
+  const uint8_t *code = chunk->code + offset;
+  int left            = chunk->count - offset;
+  *ins = (Instruction){.length = 1, .target = -1, .falls = true, .slot = -1};
+
+  int op, arg = 0;
+  if (wordcode) {
+    if (left < WORD_BYTES)
+      return false;
+
+    uint32_t word;
+    memcpy(&word, code, WORD_BYTES);
+    op          = WORD_OP(word);
+    arg         = WORD_ARG(word);
+    ins->length = WORD_BYTES;
+  } else {
+    op = code[0];
+  }
+
+  int operandBytes = 0;
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_CALL:          operandBytes = 1; break;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:          operandBytes = 2; break;
+    case OP_CONSTANT_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+      // Wordcode operands never need the _LONG forms
+      if (wordcode)
+        return false;
+      operandBytes = LONG_OPERAND_BYTES;
+      break;
+    default:
+      if (op >= OP_COUNT)
+        return false;
+      break;
+  }
+
+  // Bytecode operands are big-endian
+  if (!wordcode) {
+    if (left < 1 + operandBytes)
+      return false;
+
+    ins->length = 1 + operandBytes;
+    for (int i = 1; i <= operandBytes; i++)
+      arg = arg << 8 | code[i];
+  }
+  int distance = wordcode ? arg * WORD_BYTES : arg;
+
+  switch (op) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG: ins->pushes = 1; return isConstant(chunk, arg);
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:         ins->pushes = 1; return true;
+    case OP_POP:
+    case OP_PRINT:         ins->pops = 1; return true;
+    case OP_GET_LOCAL:
+      ins->pushes = 1;
+      ins->slot   = arg;
+      return arg < func->maxSlots;
+    case OP_SET_LOCAL:
+      ins->pops = ins->pushes = 1;
+      ins->slot               = arg;
+      return arg < func->maxSlots;
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG:    ins->pushes = 1; return isName(chunk, arg);
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_GLOBAL_LONG: ins->pops = 1; return isName(chunk, arg);
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_LONG:
+      ins->pops = ins->pushes = 1;
+      return isName(chunk, arg);
+    case OP_NOT:
+    case OP_NEGATE: ins->pops = ins->pushes = 1; return true;
+    case OP_JUMP:
+      ins->falls  = false;
+      ins->target = offset + ins->length + distance;
+      return true;
+    case OP_JUMP_IF_FALSE:
+      ins->pops = ins->pushes = 1;
+      ins->target             = offset + ins->length + distance;
+      return true;
+    case OP_LOOP:
+      ins->falls  = false;
+      ins->target = offset + ins->length - distance;
+      return true;
+    case OP_CALL:
+      ins->pops   = arg + 1;
+      ins->pushes = 1;
+      return true;
+    case OP_RETURN:
+      ins->pops  = 1;
+      ins->falls = false;
+      return true;
+    default:
+      // Binary operators
+      ins->pops   = 2;
+      ins->pushes = 1;
+      return true;
+  }
+}
+
+// Decodes a RegOpCode instruction. Every register it uses must be inside the
+// function's window of slots.
+static bool decodeRegister(ObjFunction *func, int offset, Instruction *ins) {
+  Chunk *chunk = &func->chunk;
+  *ins = (Instruction){.length = REG_INSTRUCTION_BYTES, .target = -1,
+                       .falls = true, .slot = -1};
+  if (chunk->count - offset < REG_INSTRUCTION_BYTES)
+    return false;
+
+  const uint8_t *code = chunk->code + offset;
+  int a = code[1], b = code[2], c = code[3];
+  int bx  = b << 8 | c;
+  int top = a; // Highest register used
+
+  switch (code[0]) {
+    case ROP_LOADK:
+      if (!isConstant(chunk, bx))
+        return false;
+      break;
+    case ROP_GET_GLOBAL:
+    case ROP_DEFINE_GLOBAL:
+    case ROP_SET_GLOBAL:
+      if (!isName(chunk, bx))
+        return false;
+      break;
+    case ROP_NIL:
+    case ROP_TRUE:
+    case ROP_FALSE:
+    case ROP_PRINT: break;
+    case ROP_MOVE:
+    case ROP_NOT:
+    case ROP_NEGATE: top = a > b ? a : b; break;
+    case ROP_JUMP:
+      ins->falls  = false;
+      ins->target = offset + ins->length + bx;
+      top         = 0;
+      break;
+    case ROP_JUMP_IF_FALSE:
+    case ROP_JUMP_IF_TRUE: ins->target = offset + ins->length + bx; break;
+    case ROP_LOOP:
+      ins->falls  = false;
+      ins->target = offset + ins->length - bx;
+      top         = 0;
+      break;
+    case ROP_CALL: top = a + b; break;
+    case ROP_RETURN: ins->falls = false; break;
+    case ROP_RETURN_NIL:
+      ins->falls = false;
+      top        = 0;
+      break;
+    default:
+      if (code[0] > ROP_RETURN_NIL)
+        return false;
+
+      // Binary operators
+      top = a > b ? a : b;
+      top = top > c ? top : c;
+      break;
+  }
+  return top < func->maxSlots;
+}
+
+static bool decode(ObjFunction *func, VMMode mode, int offset,
+                   Instruction *ins) {
+  if (mode == VM_REGISTER)
+    return decodeRegister(func, offset, ins);
+  return decodeStack(func, offset, mode == VM_WORDCODE, ins);
+}
+
+// Line runs must start inside the code, in order.
+static bool checkLines(Chunk *chunk) {
+  for (int i = 0; i < chunk->lineCount; i++) {
+    int offset = chunk->lines[i].offset;
+    if (offset < 0 || offset >= chunk->count ||
+        (i > 0 && offset < chunk->lines[i - 1].offset))
+      return false;
+  }
+  return true;
+}
+
+// Follows every path from the entry, recording the stack depth before each
+// instruction reached. `depths` has each instruction's start marked.
+static bool checkPaths(ObjFunction *func, VMMode mode, int *depths,
+                       int *work) {
+  Chunk *chunk = &func->chunk;
+  bool stack   = mode != VM_REGISTER;
+  int count    = 0;
+
+  // The callee and its arguments are on the stack on entry
+  depths[0]     = stack ? func->arity + 1 : 0;
+  work[count++] = 0;
+
+  while (count > 0) {
+    int offset = work[--count];
+    int depth  = depths[offset];
+    Instruction ins;
+    decode(func, mode, offset, &ins);
+
+    if (stack) {
+      if (depth - ins.pops < 1 || ins.slot >= depth)
+        return false;
+      depth += ins.pushes - ins.pops;
+    }
+
+    int next[2] = {ins.falls ? offset + ins.length : -1, ins.target};
+    for (int i = 0; i < 2; i++) {
+      if (next[i] == -1)
+        continue;
+      if (next[i] >= chunk->count)
+        return false;
+
+      if (depths[next[i]] == UNREACHED) {
+        depths[next[i]] = depth;
+        work[count++]   = next[i];
+      } else if (depths[next[i]] != depth) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool verifyFunction(ObjFunction *func, VMMode mode, MemStats *stats) {
+  Chunk *chunk = &func->chunk;
+
+  // A lazy function's source is compiled and checked like any other
+  if (func->lazySource != NULL)
+    return func->name != NULL && chunk->count == 0 &&
+           chunk->constants.count == 0;
+
+  // Register operands are a byte. Stack slots include temporaries, so only
+  // the VM's stack bounds them.
+  int slotsMax = mode == VM_REGISTER ? UINT8_MAX + 1 : STACK_MAX;
+  if (chunk->count == 0 || func->arity > UINT8_MAX ||
+      func->maxSlots > slotsMax || func->maxSlots < func->arity + 1 ||
+      !checkLines(chunk))
+    return false;
+
+  int *depths = ALLOCATE(stats, int, chunk->count);
+  int *work   = ALLOCATE(stats, int, chunk->count);
+  for (int i = 0; i < chunk->count; i++)
+    depths[i] = NOT_INSTRUCTION;
+
+  // Every instruction is decoded, since the JIT compiles unreachable ones too
+  bool valid = true;
+  Instruction ins;
+  for (int offset = 0; valid && offset < chunk->count; offset += ins.length) {
+    valid          = decode(func, mode, offset, &ins);
+    depths[offset] = UNREACHED;
+  }
+
+  for (int offset = 0; valid && offset < chunk->count; offset += ins.length) {
+    decode(func, mode, offset, &ins);
+    if (ins.target != -1)
+      valid = ins.target >= 0 && ins.target < chunk->count &&
+              depths[ins.target] != NOT_INSTRUCTION;
+  }
+
+  valid = valid && checkPaths(func, mode, depths, work);
+
+  FREE_ARRAY(stats, int, depths, chunk->count);
+  FREE_ARRAY(stats, int, work, chunk->count);
+  return valid;
+}
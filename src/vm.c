@@ -1,16 +1,25 @@
 #include "vm.h"
 #include "chunk.h"
 #include "compiler.h"
-#include "debug.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
+#include "perfcount.h"
+#include "probes.h"
+#include "profile.h"
+#include "scriptcache.h"
+#include "trace.h"
 #include "value.h"
 
+#include <limits.h>
+#include <math.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 static void resetStack(VM *vm) {
   vm->stackTop   = vm->stack;
@@ -18,6 +27,9 @@ static void resetStack(VM *vm) {
 }
 
 static void runtimeError(VM *vm, const char *format, ...) {
+  // Anything printed before the error comes first
+  flushOutput(&vm->output);
+
   va_list args;
   va_start(args, format);
   vfprintf(stderr, format, args);
@@ -29,7 +41,7 @@ static void runtimeError(VM *vm, const char *format, ...) {
     CallFrame *frame  = &vm->frames[i];
     ObjFunction *func = frame->function;
     size_t lineIndex  = frame->ip - frame->function->chunk.code - 1;
-    int line          = frame->function->chunk.lines[lineIndex];
+    int line          = getLine(&frame->function->chunk, lineIndex);
 
     fprintf(stderr, "[line %d] in ", line);
     if (func->name == NULL) {
@@ -42,6 +54,13 @@ static void runtimeError(VM *vm, const char *format, ...) {
   resetStack(vm);
 }
 
+// The default hot hook, compiling the function to machine code.
+static void compileHot(VM *vm, ObjFunction *func,
+                       int __attribute__((unused)) loop) {
+  if (vm->jitEnabled && vm->mode == VM_STACK && func->jit == NULL)
+    jitCompile(vm, func);
+}
+
 static void defineNative(VM *vm, const char *name, NativeFn function) {
   // We need to push and pop the name and function on the stack because
   // copyString and newNative dynamically allocate memory, triggering GC.
@@ -52,29 +71,196 @@ static void defineNative(VM *vm, const char *name, NativeFn function) {
   popStack(vm);
 }
 
-static Value clockNative(int __attribute__((unused)) argCount,
-                         Value __attribute__((unused)) * args) {
-  return NUM_VAL((double)clock() / CLOCKS_PER_SEC);
+static bool clockNative(VM __attribute__((unused)) * vm,
+                        int __attribute__((unused)) argCount,
+                        Value __attribute__((unused)) * args, Value *result) {
+  *result = NUM_VAL((double)clock() / CLOCKS_PER_SEC);
+  return true;
+}
+
+static double readClock(clockid_t clock) {
+  struct timespec now;
+  clock_gettime(clock, &now);
+  return (double)now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+// nanoTime() returns nanoseconds from a monotonic clock, for timing code.
+static bool nanoTimeNative(VM __attribute__((unused)) * vm,
+                           int __attribute__((unused)) argCount,
+                           Value __attribute__((unused)) * args,
+                           Value *result) {
+  *result = NUM_VAL(readClock(CLOCK_MONOTONIC));
+  return true;
+}
+
+// cpuTime() returns the CPU time used by the process in nanoseconds.
+static bool cpuTimeNative(VM __attribute__((unused)) * vm,
+                          int __attribute__((unused)) argCount,
+                          Value __attribute__((unused)) * args,
+                          Value *result) {
+  *result = NUM_VAL(readClock(CLOCK_PROCESS_CPUTIME_ID));
+  return true;
+}
+
+// memStats(name) returns one of the VM's memory statistics, in bytes or
+// counts, or nil if there is no such statistic. Without a name it returns the
+// bytes currently allocated.
+static bool memStatsNative(VM *vm, int argCount, Value *args, Value *result) {
+  double value;
+  if (argCount == 0) {
+    *result = NUM_VAL((double)vm->memStats.current);
+  } else if (IS_STRING(args[0]) &&
+             getMemStat(&vm->memStats, AS_CSTRING(args[0]), &value)) {
+    *result = NUM_VAL(value);
+  } else {
+    *result = NIL_VAL;
+  }
+
+  return true;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * bench(fn, iterations) calls fn with no arguments a tenth as many times to
+ * warm up, including letting the JIT compile it, then times each of the given
+ * number of calls (100 by default). It prints statistics of the calls'
+ * durations and returns the mean in nanoseconds. The times include the ~20ns
+ * it takes to read the clock.
+ */
+static bool benchNative(VM *vm, int argCount, Value *args, Value *result) {
+  if (argCount < 1 || argCount > 2 ||
+      (!IS_FUNCTION(args[0]) && !IS_NATIVE(args[0]))) {
+    runtimeError(vm, "bench() expects a function and an iteration count");
+    return false;
+  }
+
+  long iterations = 100;
+  if (argCount == 2) {
+    // Checked before the cast, which is undefined for NaN or out of range
+    double n = IS_NUM(args[1]) ? AS_NUM(args[1]) : NAN;
+    if (!isfinite(n) || n < 1) {
+      runtimeError(vm, "bench() iteration count must be a positive number");
+      return false;
+    }
+    if (n > LONG_MAX / sizeof(double)) {
+      runtimeError(vm, "bench() iteration count is too large");
+      return false;
+    }
+    iterations = (long)n;
+  }
+
+  Value fn = args[0];
+  for (long i = 0; i < iterations / 10 + 1; i++) {
+    pushStack(vm, fn);
+    if (!vmCall(vm, 0))
+      return false;
+    popStack(vm);
+  }
+
+  double *times = ALLOCATE(&vm->memStats, double, iterations);
+  double sum    = 0;
+  for (long i = 0; i < iterations; i++) {
+    double start = readClock(CLOCK_MONOTONIC);
+    pushStack(vm, fn);
+    if (!vmCall(vm, 0)) {
+      FREE_ARRAY(&vm->memStats, double, times, iterations);
+      return false;
+    }
+    popStack(vm);
+    times[i] = readClock(CLOCK_MONOTONIC) - start;
+    sum += times[i];
+  }
+
+  double mean = sum / iterations;
+  qsort(times, iterations, sizeof(double), compareDoubles);
+
+  const char *name = IS_FUNCTION(fn) && AS_FUNCTION(fn)->name != NULL
+                         ? AS_FUNCTION(fn)->name->chars
+                         : "<fn>";
+  writeOutputf(&vm->output,
+               "bench %s: %ld iterations, mean %.0fns, min %.0fns, "
+               "median %.0fns, p90 %.0fns, max %.0fns\n",
+               name, iterations, mean, times[0], times[iterations / 2],
+               times[iterations * 9 / 10], times[iterations - 1]);
+
+  FREE_ARRAY(&vm->memStats, double, times, iterations);
+  *result = NUM_VAL(mean);
+  return true;
 }
 
+static const struct {
+  const char *name;
+  NativeFn function;
+} natives[] = {
+    {"clock",    clockNative   },
+    {"nanoTime", nanoTimeNative},
+    {"cpuTime",  cpuTimeNative },
+    {"memStats", memStatsNative},
+    {"bench",    benchNative   },
+};
+
+#define NATIVE_COUNT (int)(sizeof(natives) / sizeof(natives[0]))
+
 static void defineNativeFunctions(VM *vm) {
-  defineNative(vm, "clock", clockNative);
+  for (int i = 0; i < NATIVE_COUNT; i++)
+    defineNative(vm, natives[i].name, natives[i].function);
+}
+
+NativeFn findNative(const char *name, int length) {
+  for (int i = 0; i < NATIVE_COUNT; i++) {
+    if ((int)strlen(natives[i].name) == length &&
+        memcmp(natives[i].name, name, length) == 0)
+      return natives[i].function;
+  }
+  return NULL;
+}
+
+const char *nativeName(NativeFn function) {
+  for (int i = 0; i < NATIVE_COUNT; i++) {
+    if (natives[i].function == function)
+      return natives[i].name;
+  }
+  return NULL;
 }
 
 void initVM(VM *vm) {
   resetStack(vm);
 
-  vm->objects = NULL;
-  initTable(&vm->globals);
-  initTable(&vm->strings);
+  memset(&vm->memStats, 0, sizeof(MemStats));
+
+  vm->objects       = NULL;
+  vm->chunkArenas   = NULL;
+  vm->mode          = VM_STACK;
+  vm->dispatchCount = 0;
+  vm->jitEnabled    = JIT_SUPPORTED;
+  vm->hotThreshold  = JIT_DEFAULT_THRESHOLD;
+  vm->hotHook       = compileHot;
+  vm->profile       = NULL;
+  vm->trace         = NULL;
+  vm->heapProfile   = NULL;
+  vm->perfCounters  = NULL;
+  vm->scriptCache   = newScriptCache(&vm->memStats, SCRIPT_CACHE_DEFAULT_SIZE);
+  vm->perfMap       = false;
+  vm->lazyCompile   = false;
+  initOutput(&vm->output, STDOUT_FILENO, isatty(STDOUT_FILENO));
+  initTable(&vm->globals, &vm->memStats);
+  initTable(&vm->strings, &vm->memStats);
 
   defineNativeFunctions(vm);
 }
 
 void freeVM(VM *vm) {
+  flushOutput(&vm->output);
+  freeScriptCache(vm->scriptCache);
+  vm->scriptCache = NULL;
   freeTable(&vm->strings);
   freeTable(&vm->globals);
   freeObjects(vm);
+  freeChunkArenas(&vm->memStats, &vm->chunkArenas);
 }
 
 void pushStack(VM *vm, Value value) {
@@ -91,20 +277,33 @@ Value peekStack(VM *vm, int dist) { return vm->stackTop[-(dist + 1)]; }
 
 static bool call(VM *vm, ObjFunction *func, int argCount) {
   if (argCount != func->arity) {
-    runtimeError(vm, "expected %d arguments, but got %d", argCount,
-                 func->arity);
+    runtimeError(vm, "expected %d arguments, but got %d", func->arity,
+                 argCount);
     return false;
   }
 
-  if (vm->frameCount == FRAMES_MAX) {
+  if (func->lazySource != NULL && !compileLazy(vm, func)) {
+    runtimeError(vm, "could not compile '%s'", func->name->chars);
+    return false;
+  }
+
+  if (vm->frameCount == FRAMES_MAX ||
+      vm->stackTop - argCount - 1 + func->maxSlots > vm->stack + STACK_MAX) {
     runtimeError(vm, "stack overflow");
     return false;
   }
 
-  CallFrame *frame = &vm->frames[vm->frameCount++];
+  CallFrame *frame = &vm->frames[vm->frameCount];
   frame->function  = func;
   frame->ip        = func->chunk.code;
   frame->slots     = vm->stackTop - argCount - 1;
+
+  // The sampler's signal handler reads every counted frame, so the frame
+  // must be filled in before it is counted
+  __atomic_signal_fence(__ATOMIC_RELEASE);
+  vm->frameCount++;
+
+  PROBE2(function__entry, PROBE_NAME(func), getLine(&func->chunk, 0));
   return true;
 }
 
@@ -114,7 +313,9 @@ static bool callValue(VM *vm, Value callee, int argCount) {
       case OBJ_FUNCTION: return call(vm, AS_FUNCTION(callee), argCount);
       case OBJ_NATIVE:   {
         NativeFn native = AS_NATIVE(callee);
-        Value result    = native(argCount, vm->stackTop - argCount);
+        Value result;
+        if (!native(vm, argCount, vm->stackTop - argCount, &result))
+          return false;
         vm->stackTop -= argCount + 1;
         pushStack(vm, result);
         return true;
@@ -131,31 +332,95 @@ static bool isFalsy(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate(VM *vm) {
-  ObjString *b = AS_STRING(popStack(vm)), *a = AS_STRING(popStack(vm));
-
+static ObjString *concatStrings(VM *vm, ObjString *a, ObjString *b) {
   int n        = a->length + b->length;
-  char *buffer = ALLOCATE(char, n + 1);
+  char *buffer = ALLOCATE_IN(&vm->memStats, MEM_STRING, char, n + 1);
   memcpy(buffer, a->chars, a->length);
   memcpy(buffer + a->length, b->chars, b->length);
   buffer[n] = '\0';
 
-  ObjString *res = takeString(vm, buffer, n);
-  pushStack(vm, OBJ_VAL(res));
+  return takeString(vm, buffer, n);
+}
+
+static void concatenate(VM *vm) {
+  ObjString *b = AS_STRING(popStack(vm)), *a = AS_STRING(popStack(vm));
+  pushStack(vm, OBJ_VAL(concatStrings(vm, a, b)));
+}
+
+// Counts a call of the function, returning true if it has machine code.
+static bool countCall(VM *vm, ObjFunction *func) {
+  if (++func->calls == vm->hotThreshold && vm->hotHook != NULL)
+    vm->hotHook(vm, func, -1);
+
+  return func->jit != NULL;
+}
+
+// Counts a back-edge into the loop header at `offset`, returning true if the
+// function has machine code.
+static bool countLoop(VM *vm, ObjFunction *func, int offset) {
+  if (func->loopCounts == NULL) {
+    func->loopCounts =
+        ALLOCATE(&vm->memStats, unsigned long, func->chunk.count);
+    memset(func->loopCounts, 0, sizeof(unsigned long) * func->chunk.count);
+  }
+
+  if (++func->loopCounts[offset] == vm->hotThreshold && vm->hotHook != NULL)
+    vm->hotHook(vm, func, offset);
+
+  return func->jit != NULL;
+}
+
+// Hands an instruction about to run to --profile-ops and --trace.
+static void observeInstruction(VM *vm, CallFrame *frame, int offset,
+                               uint8_t instruction) {
+  if (vm->profile != NULL)
+    profileInstruction(vm->profile, frame->function, offset, instruction);
+  if (vm->trace != NULL)
+    traceInstruction(vm->trace, vm, frame, offset, instruction);
 }
 
-static InterpretResult run(VM *vm) {
+/*
+ * The interpreter loop for OpCode instructions, in either encoding. It is
+ * always inlined into callers passing constant `wordcode` and `observed`
+ * flags, so each combination gets its own loop with the unused decoding
+ * compiled out, and the loops run without profiling, tracing or counting
+ * dispatches pay nothing for them.
+ *
+ * The loop returns once the frame count drops back to `baseFrame`, which lets
+ * machine code run a single call in the interpreter.
+ */
+static inline __attribute__((always_inline)) InterpretResult
+execute(VM *vm, int baseFrame, const bool wordcode, const bool observed) {
   CallFrame *frame = &vm->frames[vm->frameCount - 1];
+  uint32_t word    = 0; // Instruction word currently executing (wordcode only)
 
 #define READ_BYTE() (*frame->ip++)
 
-#define READ_CONSTANT() (frame->function->chunk.constants.values[READ_BYTE()])
+#define READ_OPERAND() (wordcode ? (int)WORD_ARG(word) : READ_BYTE())
+
+#define READ_CONSTANT() \
+  (frame->function->chunk.constants.values[READ_OPERAND()])
 
 #define READ_SHORT() \
   (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8 | frame->ip[-1])))
 
+// Reads a jump operand as a distance in bytes.
+#define READ_JUMP() (wordcode ? WORD_ARG(word) * WORD_BYTES : READ_SHORT())
+
+// Reads the 24-bit big-endian constant index of a _LONG instruction.
+#define READ_LONG()                                              \
+  (frame->ip += LONG_OPERAND_BYTES,                              \
+   (int)(frame->ip[-3] << 16 | frame->ip[-2] << 8 | frame->ip[-1]))
+
+#define READ_CONSTANT_LONG() \
+  (frame->function->chunk.constants.values[READ_LONG()])
+
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 
+// Reads the name operand of a global instruction, short or _LONG form.
+#define READ_GLOBAL_NAME(shortOp) \
+  (instruction == (shortOp) ? READ_STRING() : AS_STRING(READ_CONSTANT_LONG()))
+
 #define BINARY_OP(valueType, op)                                  \
   do {                                                            \
     if (!IS_NUM(peekStack(vm, 0)) || !IS_NUM(peekStack(vm, 1))) { \
@@ -166,50 +431,44 @@ static InterpretResult run(VM *vm) {
     pushStack(vm, valueType(a op b));                             \
   } while (false);
 
-#ifdef DEBUG_TRACE_EXEC
-  printf("== Trace Exec ==\n");
-#endif
-
   while (true) {
-#ifdef DEBUG_TRACE_EXEC
-
-    printf("          ");
-    if (vm->stackTop - vm->stack == 0) {
-      printf("[empty]");
+    uint8_t instruction;
+    if (wordcode) {
+      word = *(uint32_t *)frame->ip;
+      frame->ip += WORD_BYTES;
+      instruction = WORD_OP(word);
     } else {
-      for (Value *valuePtr = vm->stack; valuePtr < vm->stackTop; valuePtr++) {
-        printf("[ ");
-        printValue(*valuePtr);
-        printf(" ]");
-      }
+      instruction = READ_BYTE();
     }
-    printf("\n");
-
-    int offset = frame->ip - frame->function->chunk.code;
-    disassembleInstruction(&frame->function->chunk, offset);
-#endif
 
-    uint8_t instruction = READ_BYTE();
+    if (observed) {
+      vm->dispatchCount++;
+      uint8_t *start = frame->ip - (wordcode ? WORD_BYTES : 1);
+      observeInstruction(vm, frame, (int)(start - frame->function->chunk.code),
+                         instruction);
+    }
 
     // TODO: Assign global variables (OP_SET_GLOBAL)
     switch (instruction) {
       case OP_CONSTANT:  pushStack(vm, READ_CONSTANT()); break;
+      case OP_CONSTANT_LONG: pushStack(vm, READ_CONSTANT_LONG()); break;
       case OP_NIL:       pushStack(vm, NIL_VAL); break;
       case OP_TRUE:      pushStack(vm, BOOL_VAL(true)); break;
       case OP_FALSE:     pushStack(vm, BOOL_VAL(false)); break;
       case OP_POP:       popStack(vm); break;
       case OP_GET_LOCAL: {
-        uint8_t slotIndex = READ_BYTE();
+        int slotIndex = READ_OPERAND();
         pushStack(vm, frame->slots[slotIndex]);
         break;
       }
       case OP_SET_LOCAL: {
-        uint8_t slotIndex       = READ_BYTE();
+        int slotIndex           = READ_OPERAND();
         frame->slots[slotIndex] = peekStack(vm, 0);
         break;
       }
-      case OP_GET_GLOBAL: {
-        ObjString *name = READ_STRING();
+      case OP_GET_GLOBAL:
+      case OP_GET_GLOBAL_LONG: {
+        ObjString *name = READ_GLOBAL_NAME(OP_GET_GLOBAL);
         Value value;
 
         if (!tableGet(&vm->globals, name, &value)) {
@@ -220,14 +479,16 @@ static InterpretResult run(VM *vm) {
         pushStack(vm, value);
         break;
       }
-      case OP_DEFINE_GLOBAL: {
-        ObjString *name = READ_STRING();
+      case OP_DEFINE_GLOBAL:
+      case OP_DEFINE_GLOBAL_LONG: {
+        ObjString *name = READ_GLOBAL_NAME(OP_DEFINE_GLOBAL);
         tableSet(&vm->globals, name, peekStack(vm, 0));
         popStack(vm);
         break;
       }
-      case OP_SET_GLOBAL: {
-        ObjString *name = READ_STRING();
+      case OP_SET_GLOBAL:
+      case OP_SET_GLOBAL_LONG: {
+        ObjString *name = READ_GLOBAL_NAME(OP_SET_GLOBAL);
         if (tableSet(&vm->globals, name, peekStack(vm, 0))) {
           // tableSet returning true means a new entry into the table, so
           // the variable assigning to has not be defined which is a error
@@ -279,37 +540,53 @@ static InterpretResult run(VM *vm) {
 
         *(vm->stackTop - 1) = NUM_VAL(-AS_NUM(peekStack(vm, 0)));
         break;
-      case OP_PRINT: {
-        printValue(popStack(vm));
-        printf("\n");
-        break;
-      }
+      case OP_PRINT: printLine(&vm->output, popStack(vm)); break;
       case OP_JUMP: {
-        uint16_t offset = READ_SHORT();
+        uint32_t offset = READ_JUMP();
         frame->ip += offset;
         break;
       }
       case OP_JUMP_IF_FALSE: {
-        uint16_t offset = READ_SHORT();
+        uint32_t offset = READ_JUMP();
         if (isFalsy(peekStack(vm, 0))) {
           frame->ip += offset;
         }
         break;
       }
       case OP_LOOP: {
-        uint16_t offset = READ_SHORT();
+        uint32_t offset = READ_JUMP();
         frame->ip -= offset;
+
+        // Switch to machine code in the middle of a hot loop
+        int header = frame->ip - frame->function->chunk.code;
+        if (countLoop(vm, frame->function, header) && !wordcode) {
+          InterpretResult result = jitEnter(vm, frame, header);
+          if (result != INTERPRET_OK || vm->frameCount == baseFrame)
+            return result;
+
+          frame = &vm->frames[vm->frameCount - 1];
+        }
         break;
       }
       case OP_CALL: {
-        int argCount = READ_BYTE();
+        int argCount   = READ_OPERAND();
+        int frameCount = vm->frameCount;
         if (!callValue(vm, peekStack(vm, argCount), argCount))
           return INTERPRET_RUNTIME_ERR;
 
         frame = &vm->frames[vm->frameCount - 1];
+        if (vm->frameCount > frameCount && countCall(vm, frame->function) &&
+            !wordcode) {
+          InterpretResult result = jitEnter(vm, frame, 0);
+          if (result != INTERPRET_OK)
+            return result;
+
+          frame = &vm->frames[vm->frameCount - 1];
+        }
         break;
       }
       case OP_RETURN: {
+        PROBE1(function__return, PROBE_NAME(frame->function));
         Value result = popStack(vm);
         vm->frameCount--;
 
@@ -325,6 +602,9 @@ static InterpretResult run(VM *vm) {
         // and push the return value onto the stack
         vm->stackTop = frame->slots;
         pushStack(vm, result);
+        if (vm->frameCount == baseFrame)
+          return INTERPRET_OK;
+
         frame = &vm->frames[vm->frameCount - 1];
         break;
       }
@@ -332,20 +612,371 @@ static InterpretResult run(VM *vm) {
   }
 
 #undef READ_BYTE
+#undef READ_OPERAND
 #undef READ_SHORT
+#undef READ_JUMP
+#undef READ_LONG
 #undef READ_CONSTANT
+#undef READ_CONSTANT_LONG
+#undef READ_STRING
+#undef READ_GLOBAL_NAME
 #undef BINARY_OP
 }
 
+// Dispatches are counted for --perf-counters in the observed loop, where
+// their cost is small next to the checks it makes anyway.
+static InterpretResult run(VM *vm, int baseFrame) {
+  bool observed = vm->profile != NULL || vm->trace != NULL ||
+                  vm->perfCounters != NULL;
+#ifdef DEBUG_COUNT_DISPATCH
+  observed = true;
+#endif
+
+  if (vm->mode == VM_WORDCODE) {
+    return observed ? execute(vm, baseFrame, true, true)
+                    : execute(vm, baseFrame, true, false);
+  }
+
+  return observed ? execute(vm, baseFrame, false, true)
+                  : execute(vm, baseFrame, false, false);
+}
+
+bool vmGetGlobal(VM *vm, ObjString *name) {
+  Value value;
+  if (!tableGet(&vm->globals, name, &value)) {
+    runtimeError(vm, "undefined variable '%s'", name->chars);
+    return false;
+  }
+
+  pushStack(vm, value);
+  return true;
+}
+
+bool vmSetGlobal(VM *vm, ObjString *name) {
+  if (tableSet(&vm->globals, name, peekStack(vm, 0))) {
+    tableDelete(&vm->globals, name);
+    runtimeError(vm, "undefined variable '%s'", name->chars);
+    return false;
+  }
+
+  return true;
+}
+
+void vmDefineGlobal(VM *vm, ObjString *name) {
+  tableSet(&vm->globals, name, peekStack(vm, 0));
+  popStack(vm);
+}
+
+void vmEqual(VM *vm) {
+  Value b = popStack(vm), a = popStack(vm);
+  pushStack(vm, BOOL_VAL(valuesEqual(a, b)));
+}
+
+void vmNotEqual(VM *vm) {
+  Value b = popStack(vm), a = popStack(vm);
+  pushStack(vm, BOOL_VAL(!valuesEqual(a, b)));
+}
+
+#define NUMBER_HELPER(name, valueType, op)                        \
+  bool name(VM *vm) {                                             \
+    if (!IS_NUM(peekStack(vm, 0)) || !IS_NUM(peekStack(vm, 1))) { \
+      runtimeError(vm, "Operands must be numbers.");              \
+      return false;                                               \
+    }                                                             \
+    double b = AS_NUM(popStack(vm)), a = AS_NUM(popStack(vm));    \
+    pushStack(vm, valueType(a op b));                             \
+    return true;                                                  \
+  }
+
+NUMBER_HELPER(vmGreater, BOOL_VAL, >)
+NUMBER_HELPER(vmGreaterEq, BOOL_VAL, >=)
+NUMBER_HELPER(vmLess, BOOL_VAL, <)
+NUMBER_HELPER(vmLessEq, BOOL_VAL, <=)
+NUMBER_HELPER(vmSubtract, NUM_VAL, -)
+NUMBER_HELPER(vmMultiply, NUM_VAL, *)
+NUMBER_HELPER(vmDivide, NUM_VAL, /)
+
+#undef NUMBER_HELPER
+
+bool vmAdd(VM *vm) {
+  Value p0 = peekStack(vm, 0), p1 = peekStack(vm, 1);
+  if (IS_STRING(p0) && IS_STRING(p1)) {
+    concatenate(vm);
+  } else if (IS_NUM(p0) && IS_NUM(p1)) {
+    double b = AS_NUM(popStack(vm)), a = AS_NUM(popStack(vm));
+    pushStack(vm, NUM_VAL(a + b));
+  } else {
+    runtimeError(vm, "operands must both be numbers or both be strings");
+    return false;
+  }
+
+  return true;
+}
+
+void vmNot(VM *vm) {
+  *(vm->stackTop - 1) = BOOL_VAL(isFalsy(peekStack(vm, 0)));
+}
+
+bool vmNegate(VM *vm) {
+  if (!IS_NUM(peekStack(vm, 0))) {
+    runtimeError(vm, "operand must be a number");
+    return false;
+  }
+
+  *(vm->stackTop - 1) = NUM_VAL(-AS_NUM(peekStack(vm, 0)));
+  return true;
+}
+
+void vmPrint(VM *vm) { printLine(&vm->output, popStack(vm)); }
+
+static InterpretResult runRegister(VM *vm, int baseFrame);
+
+bool vmCall(VM *vm, int argCount) {
+  int frameCount = vm->frameCount;
+  if (!callValue(vm, peekStack(vm, argCount), argCount))
+    return false;
+
+  // Natives have already returned
+  if (vm->frameCount == frameCount)
+    return true;
+
+  CallFrame *frame = &vm->frames[vm->frameCount - 1];
+  InterpretResult result;
+  if (frame->function->compiled != NULL) {
+    result = frame->function->compiled(vm, frame);
+  } else if (countCall(vm, frame->function)) {
+    result = jitEnter(vm, frame, 0);
+  } else if (vm->mode == VM_REGISTER) {
+    result = runRegister(vm, frameCount);
+  } else {
+    result = run(vm, frameCount);
+  }
+
+  return result == INTERPRET_OK;
+}
+
+void vmReturn(VM *vm) {
+  Value result     = popStack(vm);
+  CallFrame *frame = &vm->frames[--vm->frameCount];
+  PROBE1(function__return, PROBE_NAME(frame->function));
+
+  if (vm->frameCount == 0) {
+    popStack(vm);
+    return;
+  }
+
+  vm->stackTop = frame->slots;
+  pushStack(vm, result);
+}
+
+// Interpreter loop for the register-based instruction set. Each call frame's
+// slots form its register window, with the callee in R[0] and its arguments
+// in the registers that follow. Like run, it returns once the frame count
+// drops back to `baseFrame`.
+static InterpretResult runRegister(VM *vm, int baseFrame) {
+  CallFrame *frame = &vm->frames[vm->frameCount - 1];
+  Value *regs      = frame->slots;
+  uint8_t *ip;
+  bool counted     = vm->perfCounters != NULL; // Count dispatches
+#ifdef DEBUG_COUNT_DISPATCH
+  counted = true;
+#endif
+
+#define RA regs[ip[1]]
+#define RB regs[ip[2]]
+#define RC regs[ip[3]]
+#define BX ((uint16_t)(ip[2] << 8 | ip[3]))
+
+#define READ_CONSTANT() (frame->function->chunk.constants.values[BX])
+
+#define REG_BINARY_OP(valueType, op)                 \
+  do {                                               \
+    if (!IS_NUM(RB) || !IS_NUM(RC)) {                \
+      runtimeError(vm, "Operands must be numbers."); \
+      return INTERPRET_RUNTIME_ERR;                  \
+    }                                                \
+    RA = valueType(AS_NUM(RB) op AS_NUM(RC));        \
+  } while (false)
+
+  while (true) {
+    if (counted)
+      vm->dispatchCount++;
+
+    ip = frame->ip;
+    frame->ip += REG_INSTRUCTION_BYTES;
+
+    switch (ip[0]) {
+      case ROP_MOVE:       RA = RB; break;
+      case ROP_LOADK:      RA = READ_CONSTANT(); break;
+      case ROP_NIL:        RA = NIL_VAL; break;
+      case ROP_TRUE:       RA = BOOL_VAL(true); break;
+      case ROP_FALSE:      RA = BOOL_VAL(false); break;
+      case ROP_GET_GLOBAL: {
+        ObjString *name = AS_STRING(READ_CONSTANT());
+        if (!tableGet(&vm->globals, name, &RA)) {
+          runtimeError(vm, "undefined variable '%s'", name->chars);
+          return INTERPRET_RUNTIME_ERR;
+        }
+        break;
+      }
+      case ROP_DEFINE_GLOBAL:
+        tableSet(&vm->globals, AS_STRING(READ_CONSTANT()), RA);
+        break;
+      case ROP_SET_GLOBAL: {
+        ObjString *name = AS_STRING(READ_CONSTANT());
+        if (tableSet(&vm->globals, name, RA)) {
+          tableDelete(&vm->globals, name);
+          runtimeError(vm, "undefined variable '%s'", name->chars);
+          return INTERPRET_RUNTIME_ERR;
+        }
+        break;
+      }
+      case ROP_EQ:         RA = BOOL_VAL(valuesEqual(RB, RC)); break;
+      case ROP_NOT_EQ:     RA = BOOL_VAL(!valuesEqual(RB, RC)); break;
+      case ROP_GREATER:    REG_BINARY_OP(BOOL_VAL, >); break;
+      case ROP_GREATER_EQ: REG_BINARY_OP(BOOL_VAL, >=); break;
+      case ROP_LESS:       REG_BINARY_OP(BOOL_VAL, <); break;
+      case ROP_LESS_EQ:    REG_BINARY_OP(BOOL_VAL, <=); break;
+      case ROP_ADD:        {
+        Value b = RB, c = RC;
+        if (IS_STRING(b) && IS_STRING(c)) {
+          RA = OBJ_VAL(concatStrings(vm, AS_STRING(b), AS_STRING(c)));
+        } else if (IS_NUM(b) && IS_NUM(c)) {
+          RA = NUM_VAL(AS_NUM(b) + AS_NUM(c));
+        } else {
+          runtimeError(vm, "operands must both be numbers or both be strings");
+          return INTERPRET_RUNTIME_ERR;
+        }
+        break;
+      }
+      case ROP_SUBTRACT: REG_BINARY_OP(NUM_VAL, -); break;
+      case ROP_MULTIPLY: REG_BINARY_OP(NUM_VAL, *); break;
+      case ROP_DIVIDE:   REG_BINARY_OP(NUM_VAL, /); break;
+      case ROP_NOT:      RA = BOOL_VAL(isFalsy(RB)); break;
+      case ROP_NEGATE:
+        if (!IS_NUM(RB)) {
+          runtimeError(vm, "operand must be a number");
+          return INTERPRET_RUNTIME_ERR;
+        }
+
+        RA = NUM_VAL(-AS_NUM(RB));
+        break;
+      case ROP_PRINT: printLine(&vm->output, RA); break;
+      case ROP_JUMP: frame->ip += BX; break;
+      case ROP_JUMP_IF_FALSE:
+        if (isFalsy(RA)) {
+          frame->ip += BX;
+        }
+        break;
+      case ROP_JUMP_IF_TRUE:
+        if (!isFalsy(RA)) {
+          frame->ip += BX;
+        }
+        break;
+      case ROP_LOOP: frame->ip -= BX; break;
+      case ROP_CALL: {
+        // The callee's window starts at R[A], right where call() expects it
+        // to be when the stack top sits just past the last argument.
+        int argCount = ip[2];
+        vm->stackTop = &RA + argCount + 1;
+        if (!callValue(vm, RA, argCount))
+          return INTERPRET_RUNTIME_ERR;
+
+        frame = &vm->frames[vm->frameCount - 1];
+        regs  = frame->slots;
+        break;
+      }
+      case ROP_RETURN:
+      case ROP_RETURN_NIL: {
+        PROBE1(function__return, PROBE_NAME(frame->function));
+        Value result = ip[0] == ROP_RETURN ? RA : NIL_VAL;
+        vm->frameCount--;
+
+        if (vm->frameCount == 0) {
+          vm->stackTop = vm->stack;
+          return INTERPRET_OK;
+        }
+
+        // The returning frame's R[0] is the caller's register holding the
+        // callee, which is where the caller expects the result.
+        frame->slots[0] = result;
+
+        // A call made through vmCall leaves its result on top of the stack
+        if (vm->frameCount == baseFrame) {
+          vm->stackTop = frame->slots + 1;
+          return INTERPRET_OK;
+        }
+
+        frame           = &vm->frames[vm->frameCount - 1];
+        regs            = frame->slots;
+        break;
+      }
+    }
+  }
+
+#undef RA
+#undef RB
+#undef RC
+#undef BX
+#undef READ_CONSTANT
+#undef REG_BINARY_OP
+}
+
+InterpretResult interpretFunction(VM *vm, ObjFunction *func) {
+  // The script is the "main" function call frame, with it being at VM slot 0.
+  pushStack(vm, OBJ_VAL(func));
+  call(vm, func, 0);
+  func->calls++;
+
+  if (func->compiled != NULL)
+    return func->compiled(vm, &vm->frames[0]);
+
+  return vm->mode == VM_REGISTER ? runRegister(vm, 0) : run(vm, 0);
+}
+
+ObjFunction *compileScript(VM *vm, const char *source) {
+  ObjFunction *func = NULL;
+  if (vm->scriptCache != NULL)
+    func = findScript(vm->scriptCache, source, vm->mode);
+  if (func != NULL)
+    return func;
+
+  func = vm->mode == VM_REGISTER ? compileRegister(vm, source)
+                                 : compile(vm, source);
+  if (func != NULL && vm->scriptCache != NULL)
+    addScript(vm->scriptCache, source, vm->mode, func);
+  return func;
+}
+
 InterpretResult interpret(VM *vm, const char *source) {
+  // Compile errors go straight to stderr, after anything printed before
+  flushOutput(&vm->output);
+
+  if (vm->perfCounters != NULL)
+    perfPhaseStart(vm->perfCounters);
+
   // Successful compilation gives compiled top-level code.
-  // This will be the "main" function call frame, with it being at VM slot 0.
-  ObjFunction *func = compile(vm, source);
+  PROBE1(compile__start, source);
+  ObjFunction *func = compileScript(vm, source);
+  PROBE1(compile__end, func != NULL);
+
+  if (vm->perfCounters != NULL)
+    perfPhaseEnd(vm->perfCounters, PERF_COMPILE);
+
   if (func == NULL)
     return INTERPRET_COMPILE_ERR;
 
-  pushStack(vm, OBJ_VAL(func));
-  call(vm, func, 0);
+  if (vm->perfCounters != NULL)
+    perfPhaseStart(vm->perfCounters);
+
+  InterpretResult result = interpretFunction(vm, func);
+
+  if (vm->perfCounters != NULL)
+    perfPhaseEnd(vm->perfCounters, PERF_RUN);
+
+#ifdef DEBUG_COUNT_DISPATCH
+  fprintf(stderr, "[%lu instructions dispatched]\n", vm->dispatchCount);
+#endif
 
-  return run(vm);
+  return result;
 }